@@ -0,0 +1,113 @@
+// Link layer benchmark harness implementation
+
+#include "bench_link.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "frame_utils.h"
+#include "trace.h"
+
+#define SEED 42
+
+const Mode modes[N_MODES] = {
+  {"sw", 1, FALSE},
+  {"gbn", MAX_WINDOW_SIZE, FALSE},
+  {"sr", MAX_SR_WINDOW_SIZE, TRUE},
+};
+
+
+long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// Tx or Rx end of a run (child process)
+// Rx writes its payload bytes and the time it took them to arrive to result
+static void runEnd(LinkLayerRole role, const char *port, const Mode *mode, int baud, int payload, long long frames,
+                   int result)
+{
+  traceSetLevel(TrError); // The CSV goes to stdout too
+
+  LinkLayer ll;
+  memset(&ll, 0, sizeof(ll));
+  strncpy(ll.serialPort, port, sizeof(ll.serialPort) - 1);
+  ll.role = role;
+  ll.baudRate = baud;
+  ll.nRetransmissions = 10;
+  ll.timeoutMs = 1000;
+  ll.windowSize = mode->windowSize;
+  ll.selectiveRepeat = mode->selectiveRepeat;
+  ll.frameCheck = LlFcsCrc32c;
+  ll.payloadSize = (payload > DEFAULT_PAYLOAD_SIZE) ? payload : DEFAULT_PAYLOAD_SIZE;
+
+  if (llopen(ll) == -1) {
+    _exit(2);
+  }
+
+  static unsigned char packet[MAX_PAYLOAD_SIZE];
+  if (role == LlTx) {
+    srand(SEED);
+    for (int i = 0; i < payload; i++) {
+      packet[i] = rand();
+    }
+    for (long long f = 0; f < frames; f++) {
+      if (llwrite(packet, payload) == -1) {
+        _exit(3);
+      }
+    }
+    _exit(llclose(FALSE) == -1 ? 4 : 0);
+  }
+
+  long long bytes = 0, start = nowNs(), last = start;
+  int n;
+  while ((n = llread(packet)) > 0) {
+    bytes += n;
+    last = nowNs();
+  }
+  llclose(FALSE);
+
+  long long out[2] = {bytes, last - start};
+  _exit((n < 0 || write(result, out, sizeof(out)) != sizeof(out)) ? 5 : 0);
+}
+
+
+int startRun(const char *txPort, const char *rxPort, const Mode *mode, int baud, int payload, long long frames,
+             pid_t *tx, pid_t *rx)
+{
+  int result[2];
+  if (pipe(result) == -1) {
+    perror("pipe");
+    return -1;
+  }
+
+  fflush(stdout); // The children inherit what wasn't written yet
+  *rx = fork();
+  if (*rx == 0) {
+    close(result[0]);
+    runEnd(LlRx, rxPort, mode, baud, payload, frames, result[1]);
+  }
+  *tx = fork();
+  if (*tx == 0) {
+    close(result[1]);
+    runEnd(LlTx, txPort, mode, baud, payload, frames, -1);
+  }
+  close(result[1]);
+  return result[0];
+}
+
+
+long long runResult(int fd, long long frames, int payload)
+{
+  long long out[2] = {0, 0};
+  int got = read(fd, out, sizeof(out));
+  close(fd);
+  return (got == sizeof(out) && out[0] == frames * payload && out[1] > 0) ? out[1] : -1;
+}
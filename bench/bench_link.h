@@ -0,0 +1,32 @@
+// Link layer benchmark harness header.
+
+#ifndef _BENCH_LINK_H_
+#define _BENCH_LINK_H_
+
+#include <sys/types.h>
+
+// Tx and Rx of a run are child processes, each with its own connection on one end of a
+// line the benchmark provides - Tx sends frames packets of payload bytes, Rx takes them
+// and reports to the parent through a pipe.
+
+typedef struct {
+  const char *name;
+  int windowSize;
+  int selectiveRepeat;
+} Mode;
+
+#define N_MODES 3
+extern const Mode modes[N_MODES]; // Stop-and-Wait, Go-Back-N and Selective Repeat, largest windows
+
+long long nowNs();
+
+// Fork Rx on rxPort, then Tx on txPort (baud is what the link layer times its frames by)
+// Returns the end of the pipe Rx reports on, -1 on error
+int startRun(const char *txPort, const char *rxPort, const Mode *mode, int baud, int payload, long long frames,
+             pid_t *tx, pid_t *rx);
+
+// Read the report of Rx (and close fd)
+// Returns the time it took all frames * payload bytes to arrive (ns), -1 if they didn't
+long long runResult(int fd, long long frames, int payload);
+
+#endif // _BENCH_LINK_H_
@@ -0,0 +1,118 @@
+// Microbenchmark of the frame check sequences in frame_utils
+// Compares BCC2 (XOR) with CRC-16 and CRC-32C on a full payload and puts the cost
+// of each in perspective with the time the frame takes on the wire.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_utils.h"
+
+#define PAYLOAD_SIZE 1000 // MAX_PAYLOAD_SIZE
+#define ROUNDS 20000
+#define TRIALS 5 // Best of, to filter out preemption and frequency changes
+#define BAUD_RATE 115200 // 10 bits per byte on the wire (start + 8 data + stop)
+
+typedef unsigned int (*CheckFn)(const unsigned char *data, int len);
+
+
+static unsigned long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static unsigned int xorCheck(const unsigned char *data, int len)
+{
+  return funcI_BCC2(data, len);
+}
+
+static unsigned int crc16BytewiseCheck(const unsigned char *data, int len)
+{
+  return crc16Bytewise(CRC16_INIT, data, len);
+}
+
+static unsigned int crc16Check(const unsigned char *data, int len)
+{
+  return crc16(CRC16_INIT, data, len);
+}
+
+static unsigned int crc32cSlice8Check(const unsigned char *data, int len)
+{
+  return crc32cSlice8(CRC32C_INIT, data, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static unsigned int crc32cHwCheck(const unsigned char *data, int len)
+{
+  return crc32cHw(CRC32C_INIT, data, len);
+}
+#endif
+
+
+// Returns the best time of one run over the payload, in ns
+static double run(CheckFn fn, const unsigned char *data, int len)
+{
+  unsigned long long best = ~0ULL;
+  for (int t = 0; t < TRIALS; t++) {
+    unsigned long long start = nowNs();
+    for (int r = 0; r < ROUNDS; r++) {
+      unsigned int check = fn(data, len);
+      __asm__ volatile("" : : "r"(check), "r"(data) : "memory");
+    }
+    unsigned long long elapsed = nowNs() - start;
+    best = (elapsed < best) ? elapsed : best;
+  }
+  return (double)best / ROUNDS;
+}
+
+
+int main()
+{
+  struct {
+    const char *name;
+    CheckFn fn;
+    unsigned int check; // Check value - the CRC of "123456789"
+  } checks[] = {
+    {"xor", xorCheck, 0x31},
+    {"crc16-byte", crc16BytewiseCheck, 0x29B1},
+    {"crc16", crc16Check, 0x29B1},
+    {"crc32c-sl8", crc32cSlice8Check, 0xE3069283},
+#if defined(__x86_64__) || defined(__i386__)
+    {"crc32c-hw", crc32cHwCheck, 0xE3069283},
+#endif
+  };
+  int nChecks = sizeof(checks) / sizeof(checks[0]);
+
+  static unsigned char payload[PAYLOAD_SIZE];
+  srand(42);
+  for (int i = 0; i < PAYLOAD_SIZE; i++) {
+    payload[i] = rand();
+  }
+
+  double wireNs = (double)PAYLOAD_SIZE * 10 * 1e9 / BAUD_RATE;
+  printf("%-12s %10s %12s %14s   (%d-byte payload, %.1f ms on the wire at %d baud)\n",
+         "check", "byte/ns", "ns/frame", "% of wire", PAYLOAD_SIZE, wireNs / 1e6, BAUD_RATE);
+
+  for (int k = 0; k < nChecks; k++) {
+    if (strcmp(checks[k].name, "crc32c-hw") == 0 && !__builtin_cpu_supports("sse4.2")) {
+      continue;
+    }
+
+    // Known answer first, then the slicing tables against the bytewise reference
+    if (checks[k].fn((const unsigned char *)"123456789", 9) != checks[k].check ||
+        (strncmp(checks[k].name, "crc16", 5) == 0 && checks[k].fn(payload, PAYLOAD_SIZE) != crc16BytewiseCheck(payload, PAYLOAD_SIZE)) ||
+        (strncmp(checks[k].name, "crc32c", 6) == 0 && checks[k].fn(payload, PAYLOAD_SIZE) != crc32cSlice8Check(payload, PAYLOAD_SIZE))) {
+      printf("%s gives the wrong check value!\n", checks[k].name);
+      return 1;
+    }
+
+    double ns = run(checks[k].fn, payload, PAYLOAD_SIZE);
+    printf("%-12s %10.3f %12.1f %13.5f%%\n", checks[k].name, PAYLOAD_SIZE / ns, ns, 100 * ns / wireNs);
+  }
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+// Microbenchmark of the Reed-Solomon FEC in fec
+// Encodes and decodes a full data field at several strengths - clean, and with as many
+// errors as every codeword corrects - and puts the cost of each in perspective with the
+// time the coded frame takes on the wire.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fec.h"
+
+#define FIELD_SIZE 1004 // 1000-byte payload and CRC-32C
+#define ROUNDS 2000
+#define TRIALS 5 // Best of, to filter out preemption and frequency changes
+#define BAUD_RATE 115200 // 10 bits per byte on the wire (start + 8 data + stop)
+
+
+static unsigned long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Flip parity / 2 bytes of every codeword (bytes i * n + c of the field, spread over it)
+static void corrupt(unsigned char *coded, int len, int parity)
+{
+  int n = (fecCodedLen(len, parity) - len) / parity;
+  for (int c = 0; c < n; c++) {
+    for (int e = 0; e < parity / 2; e++) {
+      int i = c + (e * 7 % ((len - c + n - 1) / n)) * n;
+      coded[i] ^= 1 + rand() % 255;
+    }
+  }
+}
+
+
+// Returns the best time of one encode (decode if !encode) of the field, in ns
+static double run(int encode, int parity, const unsigned char *field, const unsigned char *damaged)
+{
+  static unsigned char buf[FEC_MAX_LEN(FIELD_SIZE)];
+  int codedLen = fecCodedLen(FIELD_SIZE, parity);
+  unsigned long long best = ~0ULL;
+
+  for (int t = 0; t < TRIALS; t++) {
+    unsigned long long elapsed = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+      memcpy(buf, encode ? field : damaged, codedLen);
+      unsigned long long start = nowNs();
+      if (encode) {
+        fecEncode(buf, FIELD_SIZE, parity);
+      }
+      else {
+        fecDecode(buf, codedLen, parity);
+      }
+      elapsed += nowNs() - start;
+      __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    best = (elapsed < best) ? elapsed : best;
+  }
+  return (double)best / ROUNDS;
+}
+
+
+int main()
+{
+  int parities[] = {2, 4, 8, 16, 32};
+  int nParities = sizeof(parities) / sizeof(parities[0]);
+
+  static unsigned char field[FEC_MAX_LEN(FIELD_SIZE)], damaged[FEC_MAX_LEN(FIELD_SIZE)];
+  srand(42);
+  for (int i = 0; i < FIELD_SIZE; i++) {
+    field[i] = rand();
+  }
+
+  printf("%-7s %8s %10s %12s %12s %12s %11s   (%d-byte field, at %d baud)\n",
+         "parity", "coded", "corrects", "encode ns", "clean ns", "errors ns", "% of wire", FIELD_SIZE, BAUD_RATE);
+
+  for (int k = 0; k < nParities; k++) {
+    int parity = parities[k];
+    int codedLen = fecCodedLen(FIELD_SIZE, parity);
+    int codewords = (codedLen - FIELD_SIZE) / parity;
+    double wireNs = (double)codedLen * 10 * 1e9 / BAUD_RATE;
+
+    // Known answer first - every error corrected, and the clean field left alone
+    fecEncode(field, FIELD_SIZE, parity);
+    memcpy(damaged, field, codedLen);
+    corrupt(damaged, FIELD_SIZE, parity);
+    static unsigned char check[FEC_MAX_LEN(FIELD_SIZE)];
+    memcpy(check, damaged, codedLen);
+    if (fecDecode(check, codedLen, parity) != codewords * parity / 2 || memcmp(check, field, codedLen) != 0 ||
+        fecDecode(field, codedLen, parity) != 0) {
+      printf("parity %d doesn't correct the errors!\n", parity);
+      return 1;
+    }
+
+    double enc = run(1, parity, field, damaged);
+    double clean = run(0, parity, field, field);
+    double errors = run(0, parity, field, damaged);
+    printf("%-7d %8d %10d %12.1f %12.1f %12.1f %10.4f%%\n", parity, codedLen, codewords * parity / 2,
+           enc, clean, errors, 100 * (enc + errors) / wireNs);
+  }
+
+  return 0;
+}
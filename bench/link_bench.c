@@ -0,0 +1,269 @@
+// Loopback benchmark of the whole link layer
+// Tx and Rx run in child processes on two pseudo-terminal pairs and this process is
+// the cable between them: it paces the bytes at the line rate, delays them by the
+// propagation time and damages I frames at the frame error rate. Sweeps of frame
+// error rate, a = Tprop / Tf, payload size and baud rate are printed as CSV, next to
+// the textbook efficiency of each ARQ mode.
+//
+// S is the fraction of the time the line carries payload (10 bits per byte on the
+// line - start + 8 data + stop), so frame headers and stuffing keep it below 1.
+// Go-Back-N stays below its textbook curve under errors even with a = 0: the whole
+// window is already written to the port when a REJ comes back, and all of it is resent.
+//
+// Usage: link_bench [frames per run]
+
+#define _GNU_SOURCE // openpty(), ppoll()
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "frame_utils.h"
+#include "bench_link.h"
+
+#define FRAMES 50            // Frames sent in each run (default)
+#define BAUD_RATE 921600     // Line rate when it isn't the swept parameter
+#define PAYLOAD 512          // Payload size when it isn't the swept parameter
+#define FRAME_OVERHEAD 9     // Flags, address, control, BCC1 and CRC-32C of an I frame
+#define RUN_TIMEOUT_S 60     // A run that takes longer than this is reported as failed
+#define SEED 42 // Of the frames damaged
+
+#define LINE_BUF_SIZE (1 << 20) // Bytes on their way through the cable, each direction
+
+// One direction of the cable - bytes are delivered once their last bit arrived
+typedef struct {
+  int in, out;              // Master side of the sending and receiving pseudo-terminals
+  unsigned char buf[LINE_BUF_SIZE];
+  long long due[LINE_BUF_SIZE]; // When each byte reaches the other end (ns)
+  int head, tail;
+  long long lineFree;       // When the line finishes sending what it has (ns)
+  int damage;               // Damage I frames (Tx -> Rx only)
+  int sinceFlag;            // Position of the next byte in its frame
+  int iFrame, hit;          // The frame is an I frame / chosen to be damaged
+} Line;
+
+static Line toRx, toTx;
+
+
+// Bytes written into the cable - the first data byte of an I frame is damaged with probability fer
+static void lineAccept(Line *line, const unsigned char *bytes, int n, long long nsPerByte, long long propNs, double fer)
+{
+  long long now = nowNs();
+  for (int i = 0; i < n; i++) {
+    unsigned char b = bytes[i];
+
+    if (line->damage) {
+      if (b == I_Flag) {
+        line->sinceFlag = 0;
+      }
+      else {
+        line->sinceFlag++;
+        if (line->sinceFlag == 2) { // Control field
+          line->iFrame = (seqFromI(b) >= 0);
+          line->hit = line->iFrame && (rand() < fer * ((double)RAND_MAX + 1));
+        }
+        else if (line->sinceFlag == 4 && line->hit) { // First data byte - never turned into a flag or an escape
+          b ^= 0x01;
+          if (b == I_Flag || b == STUFF_ESC) {
+            b ^= 0x41;
+          }
+        }
+      }
+    }
+
+    line->lineFree = ((line->lineFree > now) ? line->lineFree : now) + nsPerByte;
+    line->buf[line->tail % LINE_BUF_SIZE] = b;
+    line->due[line->tail % LINE_BUF_SIZE] = line->lineFree + propNs;
+    line->tail++;
+  }
+}
+
+
+// Deliver the bytes that arrived (up to the end of the buffer - the rest on the next call)
+// Returns when the next one is due (-1 = none waiting)
+static long long lineDeliver(Line *line)
+{
+  long long now = nowNs();
+  int start = line->head % LINE_BUF_SIZE;
+  int n = 0;
+  while (line->head + n != line->tail && start + n < LINE_BUF_SIZE && line->due[start + n] <= now) {
+    n++;
+  }
+
+  if (n > 0) {
+    int w = write(line->out, line->buf + start, n);
+    if (w > 0) {
+      line->head += w;
+    }
+  }
+  return (line->head != line->tail) ? line->due[line->head % LINE_BUF_SIZE] : -1;
+}
+
+
+// Open a pseudo-terminal pair in raw mode
+// Returns the master (the slave stays open, so the master never sees a hang up)
+static int openPty(char *name)
+{
+  int master, slave;
+  if (openpty(&master, &slave, name, NULL, NULL) == -1) {
+    perror("openpty");
+    exit(1);
+  }
+  struct termios tio;
+  tcgetattr(master, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(master, TCSANOW, &tio);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  return master;
+}
+
+
+// One transfer - returns S, or -1 if it failed
+static double run(const Mode *mode, int baud, int payload, double fer, double a, int frames)
+{
+  char txName[64], rxName[64];
+  int txMaster = openPty(txName);
+  int rxMaster = openPty(rxName);
+
+  long long nsPerByte = 10 * 1000000000LL / baud;
+  long long frameNs = (payload + FRAME_OVERHEAD) * nsPerByte;
+  long long propNs = (long long)(a * frameNs);
+
+  memset(&toRx, 0, sizeof(toRx));
+  memset(&toTx, 0, sizeof(toTx));
+  toRx.in = txMaster;
+  toRx.out = rxMaster;
+  toRx.damage = TRUE;
+  toTx.in = rxMaster;
+  toTx.out = txMaster;
+  srand(SEED);
+
+  pid_t tx, rx;
+  int result = startRun(txName, rxName, mode, baud, payload, frames, &tx, &rx);
+  if (result == -1) {
+    exit(1);
+  }
+
+  // The cable, until both ends are done
+  int txStatus = -1, rxStatus = -1;
+  long long deadline = nowNs() + RUN_TIMEOUT_S * 1000000000LL;
+  unsigned char chunk[4096];
+  while ((txStatus == -1 || rxStatus == -1) && nowNs() < deadline) {
+    struct pollfd pfd[2] = {{.fd = txMaster, .events = POLLIN}, {.fd = rxMaster, .events = POLLIN}};
+    long long next = -1, due;
+    if ((due = lineDeliver(&toRx)) != -1) next = due;
+    if ((due = lineDeliver(&toTx)) != -1 && (next == -1 || due < next)) next = due;
+
+    long long waitNs = (next == -1) ? 10000000LL : next - nowNs();
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = (waitNs > 0) ? ((waitNs < 10000000LL) ? waitNs : 10000000LL) : 0};
+    if (ppoll(pfd, 2, &ts, NULL) > 0) {
+      int n;
+      if ((pfd[0].revents & POLLIN) && (n = read(txMaster, chunk, sizeof(chunk))) > 0) {
+        lineAccept(&toRx, chunk, n, nsPerByte, propNs, fer);
+      }
+      if ((pfd[1].revents & POLLIN) && (n = read(rxMaster, chunk, sizeof(chunk))) > 0) {
+        lineAccept(&toTx, chunk, n, nsPerByte, propNs, 0);
+      }
+    }
+
+    int status;
+    if (txStatus == -1 && waitpid(tx, &status, WNOHANG) == tx) txStatus = WEXITSTATUS(status);
+    if (rxStatus == -1 && waitpid(rx, &status, WNOHANG) == rx) rxStatus = WEXITSTATUS(status);
+  }
+
+  if (txStatus == -1 || rxStatus == -1) { // Stuck - give up on this run
+    kill(tx, SIGKILL);
+    kill(rx, SIGKILL);
+    waitpid(tx, NULL, 0);
+    waitpid(rx, NULL, 0);
+  }
+
+  long long ns = runResult(result, frames, payload);
+  close(txMaster);
+  close(rxMaster);
+
+  if (txStatus != 0 || rxStatus != 0 || ns == -1) {
+    return -1;
+  }
+  return (double)payload * frames * nsPerByte / ns;
+}
+
+
+// Textbook efficiency (frame time units, no overhead) - p = frame error rate, W = window
+static double theory(const Mode *mode, double p, double a)
+{
+  double w = mode->windowSize;
+  if (w == 1) {
+    return (1 - p) / (1 + 2 * a);
+  }
+  if (mode->selectiveRepeat) {
+    return (w >= 1 + 2 * a) ? 1 - p : w * (1 - p) / (1 + 2 * a);
+  }
+  return (w >= 1 + 2 * a) ? (1 - p) / (1 + 2 * a * p) : w * (1 - p) / ((1 + 2 * a) * (1 - p + w * p));
+}
+
+
+static void row(const char *table, const Mode *mode, int baud, int payload, double fer, double a, int frames)
+{
+  double s = run(mode, baud, payload, fer, a, frames);
+  double tfMs = (payload + FRAME_OVERHEAD) * 10000.0 / baud;
+  printf("%s,%s,%d,%d,%.3f,%.2f,%.3f,", table, mode->name, baud, payload, fer, a, a * tfMs);
+  if (s < 0) {
+    printf("failed,%.4f\n", theory(mode, fer, a));
+  }
+  else {
+    printf("%.4f,%.4f\n", s, theory(mode, fer, a));
+  }
+  fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int frames = (argc > 1) ? atoi(argv[1]) : FRAMES;
+  if (frames < 1) {
+    printf("Usage: %s [frames per run]\n", argv[0]);
+    return 1;
+  }
+
+  const double fers[] = {0, 0.05, 0.1, 0.2, 0.4};
+  const double as[] = {0, 0.5, 1, 2, 4};
+  const int payloads[] = {64, 128, 256, 512, 1000, 2000, 4000};
+  const int bauds[] = {57600, 115200, 230400, 460800, 921600};
+
+  printf("table,mode,baud,payload,fer,a,tprop_ms,S,S_theory\n");
+  for (int m = 0; m < N_MODES; m++) {
+    for (int i = 0; i < (int)(sizeof(fers) / sizeof(fers[0])); i++) {
+      row("fer", &modes[m], BAUD_RATE, PAYLOAD, fers[i], 0, frames);
+    }
+  }
+  for (int m = 0; m < N_MODES; m++) {
+    for (int i = 0; i < (int)(sizeof(as) / sizeof(as[0])); i++) {
+      row("a", &modes[m], BAUD_RATE, PAYLOAD, 0, as[i], frames);
+    }
+  }
+  // Fixed propagation delay (1 ms) - larger frames make up for it
+  for (int m = 0; m < N_MODES; m++) {
+    for (int i = 0; i < (int)(sizeof(payloads) / sizeof(payloads[0])); i++) {
+      double tf = (payloads[i] + FRAME_OVERHEAD) * 10.0 / BAUD_RATE;
+      row("payload", &modes[m], BAUD_RATE, payloads[i], 0, 0.001 / tf, frames);
+    }
+  }
+  for (int m = 0; m < N_MODES; m++) {
+    for (int i = 0; i < (int)(sizeof(bauds) / sizeof(bauds[0])); i++) {
+      double tf = (PAYLOAD + FRAME_OVERHEAD) * 10.0 / bauds[i];
+      row("baud", &modes[m], bauds[i], PAYLOAD, 0, 0.001 / tf, frames);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,211 @@
+// Microbenchmark of the byte stuffing and destuffing kernels in frame_utils
+// Compares them with the original byte by byte loops followed by a funcI_BCC2 pass
+// on random payloads and on payloads full of flags.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_utils.h"
+
+#ifdef HAVE_X86_SIMD
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#define UNIT "byte/cycle"
+#else
+static unsigned long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define CYCLES() nowNs()
+#define UNIT "byte/ns"
+#endif
+
+#define PAYLOAD_SIZE 1000 // MAX_PAYLOAD_SIZE
+#define ROUNDS 20000
+#define TRIALS 5 // Best of, to filter out preemption and frequency changes
+
+
+// The loop llwrite had before the kernels
+static int stuffOriginal(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2)
+{
+  int i = 0, j = 0;
+  while (i < len) {
+    if (src[i] == I_Flag || src[i] == STUFF_ESC) {
+        dst[j++] = STUFF_ESC;
+        dst[j++] = STUFF_MASK(src[i++]);
+    } else {
+        dst[j++] = src[i++];
+    }
+  }
+  *bcc2 ^= funcI_BCC2(src, len);
+  return j;
+}
+
+
+// Byte by byte destuffing, then a second pass for BCC2
+static int destuffOriginal(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd)
+{
+  int i;
+  *frameEnd = 0;
+  for (i = 0; i < srcLen; i++) {
+    if (src[i] == I_Flag) {
+      *frameEnd = 1;
+      i++;
+      break;
+    }
+    if (src[i] == STUFF_ESC) {
+      state->escaped = 1;
+    }
+    else {
+      dst[state->len++] = state->escaped ? STUFF_MASK(src[i]) : src[i];
+      state->escaped = 0;
+    }
+  }
+  state->bcc ^= funcI_BCC2(dst, state->len);
+  return i;
+}
+
+
+static double runDestuff(DestuffFn fn, const unsigned char *src, int srcLen, unsigned char *dst, int len)
+{
+  unsigned long long best = ~0ULL;
+  for (int t = 0; t < TRIALS; t++) {
+    unsigned long long start = CYCLES();
+    for (int r = 0; r < ROUNDS; r++) {
+      DestuffState state = DESTUFF_INIT;
+      int frameEnd;
+      fn(dst, len + 1, src, srcLen, &state, &frameEnd);
+      __asm__ volatile("" : : "r"(dst), "r"(state.bcc) : "memory");
+    }
+    unsigned long long elapsed = CYCLES() - start;
+    best = (elapsed < best) ? elapsed : best;
+  }
+  return (double)len * ROUNDS / best;
+}
+
+
+static double run(StuffFn fn, const unsigned char *src, unsigned char *dst, int len)
+{
+  unsigned char bcc2 = 0;
+  unsigned long long best = ~0ULL;
+  for (int t = 0; t < TRIALS; t++) {
+    unsigned long long start = CYCLES();
+    for (int r = 0; r < ROUNDS; r++) {
+      fn(dst, src, len, &bcc2);
+      __asm__ volatile("" : : "r"(dst), "r"(bcc2) : "memory");
+    }
+    unsigned long long elapsed = CYCLES() - start;
+    best = (elapsed < best) ? elapsed : best;
+  }
+  return (double)len * ROUNDS / best;
+}
+
+
+int main()
+{
+  struct {
+    const char *name;
+    StuffFn fn;
+  } kernels[] = {
+    {"original", stuffOriginal},
+    {"scalar", stuffBytesScalar},
+    {"word", stuffBytesWord},
+#ifdef HAVE_X86_SIMD
+    {"sse2", stuffBytesSSE2},
+    {"avx2", stuffBytesAVX2},
+#endif
+  };
+  int nKernels = sizeof(kernels) / sizeof(kernels[0]);
+
+  static unsigned char payloads[3][PAYLOAD_SIZE];
+  const char *payloadNames[3] = {"random", "1% flags", "all flags"};
+  srand(42);
+  for (int i = 0; i < PAYLOAD_SIZE; i++) {
+    payloads[0][i] = rand();
+    payloads[1][i] = (rand() % 100 == 0) ? I_Flag : (rand() % 2 ? 0x41 : 0x00);
+    payloads[2][i] = (i % 2) ? I_Flag : STUFF_ESC;
+  }
+
+  const char *best;
+  stuffKernel(&best);
+  printf("Kernel selected for this CPU: %s\n", best);
+  printf("%-10s", "payload");
+  for (int k = 0; k < nKernels; k++) {
+    printf(" %10s", kernels[k].name);
+  }
+  printf("   (%s, %d-byte payloads)\n", UNIT, PAYLOAD_SIZE);
+
+  static unsigned char ref[2 * PAYLOAD_SIZE], out[2 * PAYLOAD_SIZE];
+  for (int p = 0; p < 3; p++) {
+    // Every kernel must produce the same frame
+    unsigned char refBcc2 = 0;
+    int refLen = stuffOriginal(ref, payloads[p], PAYLOAD_SIZE, &refBcc2);
+    for (int k = 0; k < nKernels; k++) {
+      unsigned char bcc2 = 0;
+      int len = kernels[k].fn(out, payloads[p], PAYLOAD_SIZE, &bcc2);
+      if (len != refLen || bcc2 != refBcc2 || memcmp(out, ref, len) != 0) {
+        printf("%s kernel output differs on %s payload!\n", kernels[k].name, payloadNames[p]);
+        return 1;
+      }
+    }
+
+    printf("%-10s", payloadNames[p]);
+    for (int k = 0; k < nKernels; k++) {
+      printf(" %10.3f", run(kernels[k].fn, payloads[p], out, PAYLOAD_SIZE));
+    }
+    printf("\n");
+  }
+
+  // Destuffing - frames are the stuffed payloads above (plus BCC2 and the closing flag)
+  struct {
+    const char *name;
+    DestuffFn fn;
+  } dkernels[] = {
+    {"original", destuffOriginal},
+    {"scalar", destuffBytesScalar},
+#ifdef HAVE_X86_SIMD
+    {"sse2", destuffBytesSSE2},
+    {"avx2", destuffBytesAVX2},
+#endif
+  };
+  int nDkernels = sizeof(dkernels) / sizeof(dkernels[0]);
+
+  destuffKernel(&best);
+  printf("\nDestuffing kernel selected for this CPU: %s\n", best);
+  printf("%-10s", "payload");
+  for (int k = 0; k < nDkernels; k++) {
+    printf(" %10s", dkernels[k].name);
+  }
+  printf("   (%s of payload, %d-byte payloads)\n", UNIT, PAYLOAD_SIZE);
+
+  static unsigned char frame[2 * PAYLOAD_SIZE + 3];
+  for (int p = 0; p < 3; p++) {
+    unsigned char bcc2 = 0;
+    int frameLen = stuffOriginal(frame, payloads[p], PAYLOAD_SIZE, &bcc2);
+    frameLen += stuffOriginal(frame + frameLen, &bcc2, 1, &(unsigned char){0});
+    frame[frameLen++] = I_Flag;
+
+    for (int k = 0; k < nDkernels; k++) {
+      DestuffState state = DESTUFF_INIT;
+      int frameEnd;
+      int used = dkernels[k].fn(out, PAYLOAD_SIZE + 1, frame, frameLen, &state, &frameEnd);
+      if (used != frameLen || !frameEnd || state.len != PAYLOAD_SIZE + 1 || state.bcc != 0 ||
+          memcmp(out, payloads[p], PAYLOAD_SIZE) != 0) {
+        printf("%s destuffing kernel output differs on %s payload!\n", dkernels[k].name, payloadNames[p]);
+        return 1;
+      }
+    }
+
+    printf("%-10s", payloadNames[p]);
+    for (int k = 0; k < nDkernels; k++) {
+      printf(" %10.3f", runDestuff(dkernels[k].fn, frame, frameLen, out, PAYLOAD_SIZE));
+    }
+    printf("\n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Memory speed benchmark of the link layer
+// Tx and Rx run in child processes joined directly by a transport (transport.h) - no
+// cable and no baud rate, so the bytes move as fast as the protocol code makes and
+// takes them and its CPU cost is what is left to measure. Prints CSV: the goodput of
+// each transport, ARQ mode and payload size, and the CPU time each end spent per MB.
+//
+// Usage: transport_bench [MB per run]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "link_layer.h"
+#include "frame_utils.h"
+#include "transport.h"
+#include "bench_link.h"
+
+#define MEGABYTES 16         // Payload moved in each run (default)
+#define BAUD_RATE 921600     // Only for the statistics - these transports aren't paced
+#define RUN_TIMEOUT_S 60     // A run that takes longer than this is reported as failed
+
+typedef struct {
+  const char *name;
+  TransportKind kind;
+} Kind;
+
+static const Kind kinds[] = {
+  {"mem", TpMem},
+  {"socketpair", TpSocketpair},
+  {"pty", TpPty},
+};
+#define N_KINDS (int)(sizeof(kinds) / sizeof(kinds[0]))
+
+
+static double cpuSeconds(const struct rusage *ru)
+{
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+
+// Wait for a child until deadline, collecting its exit status and CPU time
+// Returns FALSE if it had to be killed
+static int reap(pid_t pid, long long deadline, int *status, double *cpu)
+{
+  struct rusage ru;
+  int st;
+  while (wait4(pid, &st, WNOHANG, &ru) != pid) {
+    if (nowNs() > deadline) {
+      kill(pid, SIGKILL);
+      wait4(pid, &st, 0, &ru);
+      return FALSE;
+    }
+    usleep(1000);
+  }
+  *status = WIFEXITED(st) ? WEXITSTATUS(st) : -1;
+  *cpu = cpuSeconds(&ru);
+  return TRUE;
+}
+
+
+static void row(const Kind *kind, const Mode *mode, int payload, int megabytes)
+{
+  char txPort[64], rxPort[64];
+  int pair = transportPair(kind->kind, txPort, rxPort, sizeof(txPort));
+  if (pair == -1) {
+    exit(1);
+  }
+
+  long long frames = (long long)megabytes * 1000000 / payload;
+  pid_t tx, rx;
+  int result = startRun(txPort, rxPort, mode, BAUD_RATE, payload, frames, &tx, &rx);
+  transportUnpair(pair);
+  if (result == -1) {
+    exit(1);
+  }
+
+  long long deadline = nowNs() + RUN_TIMEOUT_S * 1000000000LL;
+  int txStatus = -1, rxStatus = -1;
+  double txCpu = 0, rxCpu = 0;
+  int done = reap(tx, deadline, &txStatus, &txCpu);
+  done = reap(rx, done ? deadline : 0, &rxStatus, &rxCpu) && done;
+
+  long long ns = runResult(result, frames, payload);
+
+  printf("%s,%s,%d,", kind->name, mode->name, payload);
+  if (!done || txStatus != 0 || rxStatus != 0 || ns == -1) {
+    printf("failed,,,\n");
+  }
+  else {
+    double mb = (double)frames * payload / 1e6;
+    printf("%.1f,%.3f,%.4f,%.4f\n", mb * 1e9 / ns, ns / 1e9, txCpu / mb, rxCpu / mb);
+  }
+  fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int megabytes = (argc > 1) ? atoi(argv[1]) : MEGABYTES;
+  if (megabytes < 1) {
+    printf("Usage: %s [MB per run]\n", argv[0]);
+    return 1;
+  }
+
+  const int payloads[] = {512, 4000};
+
+  printf("transport,mode,payload,MB_per_s,seconds,tx_cpu_s_per_MB,rx_cpu_s_per_MB\n");
+  for (int k = 0; k < N_KINDS; k++) {
+    for (int m = 0; m < N_MODES; m++) {
+      for (int i = 0; i < (int)(sizeof(payloads) / sizeof(payloads[0])); i++) {
+        row(&kinds[k], &modes[m], payloads[i], megabytes);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -5,18 +5,23 @@
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
 // Baudrate settings are defined in <asm/termbits.h>, which is
@@ -28,11 +33,49 @@
 #define TRUE 1
 
 #define BUF_SIZE 2048
+#define TICK_NSEC 1000000  // Period of the cable loop - every byte due since the last
+                           // tick is moved at once, with one read/write per direction
+
+#define DEFAULT_SEED 1
+#define SCENARIO_MAX 1024  // Events in a scenario file
+#define COMMAND_SIZE 128
+#define NEVER (1ULL << 62)  // Bit position of an error that never happens
+
+// Error model - bit errors at a fixed BER in each of two states (Gilbert-Elliott).
+// The uniform model is a good state that is never left.
+struct ErrorModel {
+    double ber[2];    // [good, bad] bit error rate
+    double leave[2];  // [good, bad] probability per bit of switching to the other state
+};
+
+// Errors of one direction of the cable. Error positions are counted in bits carried,
+// and the gaps between them drawn from a geometric distribution, so the same seed,
+// model and bytes give the same errors, with no random draw per byte.
+struct ErrorStream {
+    unsigned long long rng;         // xorshift64* state
+    unsigned long long bits;        // Bits carried so far
+    unsigned long long nextError;   // Position of the next bit error
+    unsigned long long stateEnd;    // Position of the next state switch
+    int bad;                        // Current state
+    unsigned long long flips;       // Bits flipped so far
+};
+
+// Command of a scenario, run t seconds after the first byte the cable carries
+struct ScenarioEvent {
+    double t;
+    char cmd[COMMAND_SIZE];
+};
 
 // Current running parameters
 struct Parameters {
     int cableOn;
-    double byteER;   // Byte error rate
+    unsigned long long seed;
+    struct ErrorModel errors;
+    struct ErrorStream tx2rxErrors;
+    struct ErrorStream rx2txErrors;
+    unsigned long outageEvery;   // Scripted outages - the cable is off for the last
+    unsigned long outageFor;     // outageFor msec of every outageEvery msec (0 = none)
+    struct timespec outageStart;
     struct timespec byteDelay;
     unsigned long propDelay;   // Desired propagation delay in usec
     int bufSize;  // Dimensioned to enforce the propagation delay
@@ -42,12 +85,30 @@ struct Parameters {
     char *rx2tx;
     char *rx2txValid;  // TRUE if corresponding entry holds a byte
     long rx2txIdx;     // Input index for the tx2rx buffer
-    FILE *logfile;
+    long inFlight;     // Bytes in the ring buffers, both directions
+    struct timespec lineStart;  // Start of byte slot 0
+    long long slotsDone;        // Byte slots moved since lineStart
+    int unreliableRate;         // Fell behind the line rate (warned once)
+    struct ScenarioEvent *scenario;  // Headless mode (NULL = interactive only)
+    int scenarioLen;
+    int scenarioNext;                // Next event to run
+    int scenarioStarted;
+    struct timespec scenarioStart;   // First byte carried
+    int carried;                     // Any byte carried yet
+    unsigned long long tx2rxBytes;   // Bytes carried Tx->Rx
+    unsigned long exitIdle;          // Exit conditions (0 = none): msec idle after
+    unsigned long long exitBytes;    // carrying data, bytes carried Tx->Rx
+    struct timespec idleSince;
+    int quit;
+    unsigned long baud;
+    FILE *logfile;              // Binary capture (see capture.h)
+    struct timespec logStart;
 };
 
 struct Parameters par = {
     .cableOn = TRUE,
-    .byteER = 0.0,
+    .seed = DEFAULT_SEED,
+    .outageEvery = 0,
     .propDelay = 0,
     .tx2rx = NULL,
     .tx2rxValid = NULL,
@@ -115,6 +176,9 @@ int init_ring_buffers(void)
     bzero(par.rx2txValid, par.bufSize);
     par.tx2rxIdx = 0;
     par.rx2txIdx = 0;
+    par.inFlight = 0;
+    clock_gettime(CLOCK_MONOTONIC, &par.lineStart);
+    par.slotsDone = 0;
     printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
     return 0;
 }
@@ -127,6 +191,7 @@ void set_baud_rate(unsigned long baud)
     double delay = 1.0e10 / baud;
     par.byteDelay.tv_sec = 0;
     par.byteDelay.tv_nsec = (long) delay;
+    par.baud = baud;
     printf("BAUD RATE: %lu\n", baud);
     init_ring_buffers();
 }
@@ -154,75 +219,455 @@ struct timespec timespec_diff(const struct timespec *t2, const struct timespec *
 }
 
 
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+// Time nsec nanoseconds after t
+struct timespec timespec_after(const struct timespec *t, long long nsec)
 {
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
+    long long total = t->tv_nsec + nsec;
+    struct timespec after = { .tv_sec = t->tv_sec + total / 1000000000,
+                              .tv_nsec = total % 1000000000 };
+    return after;
+}
+
+
+// Nanoseconds from t1 to t2
+long long timespec_nsec(const struct timespec *t2, const struct timespec *t1)
+{
+    struct timespec diff = timespec_diff(t2, t1);
+    return diff.tv_sec * 1000000000LL + diff.tv_nsec;
+}
+
+
+void endlog(void)
+{
+    if (par.logfile != NULL)
+    {
+        fclose(par.logfile);
+        par.logfile = NULL;
     }
-    return sum;
 }
 
 
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
+void startlog(const char *filename)
 {
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
+    endlog();
+    par.logfile = fopen(filename, "wb");
+    if (par.logfile != NULL)
+    {
+        setvbuf(par.logfile, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &par.logStart);
+        struct CaptureHeader header = { .magic = CAPTURE_MAGIC,
+                                        .startNs = par.logStart.tv_sec * 1000000000ULL + par.logStart.tv_nsec };
+        fwrite(&header, sizeof(header), 1, par.logfile);
+        printf("LOGGING TO FILE %s\n", filename);
     }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
+    else
+    {
+        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
     }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
+}
+
+
+// Next number of the xorshift64* generator of a stream, as a double in (0, 1]
+double error_random(struct ErrorStream *e)
+{
+    e->rng ^= e->rng >> 12;
+    e->rng ^= e->rng << 25;
+    e->rng ^= e->rng >> 27;
+    return ((e->rng * 0x2545F4914F6CDD1DULL >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+
+// Bits before the next event of probability p per bit (geometric distribution)
+unsigned long long error_gap(struct ErrorStream *e, double p)
+{
+    if (p <= 0.0)
+    {
+        return NEVER;
     }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
+    if (p >= 1.0)
+    {
+        return 0;
     }
-    return 0;
+    double gap = floor(log(error_random(e)) / log1p(-p));
+    return (gap < (double) NEVER) ? (unsigned long long) gap : NEVER;
+}
+
+
+// Restart a stream from the seed, in the good state
+void error_reset(struct ErrorStream *e, unsigned long long seed)
+{
+    memset(e, 0, sizeof(*e));
+    e->rng = seed * 0x9E3779B97F4A7C15ULL + 0xD1B54A32D192ED03ULL;  // Never 0
+    e->rng = (e->rng != 0) ? e->rng : 1;
+    e->nextError = error_gap(e, par.errors.ber[0]);
+    e->stateEnd = error_gap(e, par.errors.leave[0]);
+}
+
+
+// Both directions start over, so the same seed and model give the same errors
+void reset_errors(void)
+{
+    error_reset(&par.tx2rxErrors, par.seed);
+    error_reset(&par.rx2txErrors, ~par.seed);
 }
 
 
-int timespec_is_negative(const struct timespec *t)
+// Flip the bits of the next byte of the stream that the model says are wrong
+void add_noise(struct ErrorStream *e, char *byte)
 {
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
+    unsigned long long end = e->bits + 8;
+    while (TRUE)
     {
-        return TRUE;
+        if (e->nextError < e->stateEnd)
+        {
+            if (e->nextError >= end)
+            {
+                break;
+            }
+            *byte ^= (char) (0x80 >> (e->nextError - e->bits));
+            ++e->flips;
+            e->nextError += 1 + error_gap(e, par.errors.ber[e->bad]);
+        }
+        else
+        {
+            if (e->stateEnd >= end)
+            {
+                break;
+            }
+            // Both gaps are memoryless, so the next error is drawn again in the new state
+            unsigned long long at = e->stateEnd;
+            e->bad = !e->bad;
+            e->stateEnd = at + 1 + error_gap(e, par.errors.leave[e->bad]);
+            e->nextError = at + error_gap(e, par.errors.ber[e->bad]);
+        }
     }
-    return FALSE;
+    e->bits = end;
 }
 
 
-void endlog(void)
+// TRUE during a scripted outage
+int in_outage(void)
 {
-    if (par.logfile != NULL)
+    if (par.outageEvery == 0)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        return FALSE;
     }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct timespec elapsed = timespec_diff(&now, &par.outageStart);
+    unsigned long msec = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+    return msec % par.outageEvery >= par.outageEvery - par.outageFor;
 }
 
 
-void startlog(const char *filename)
+// Capture the bytes of a direction that left the cable in this batch of slots (slots[i] =
+// slot of bytes[i], from par.slotsDone) - a record for each run of consecutive slots
+void capture_batch(int dir, const char *bytes, const int *slots, int len)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    int from = 0;
+    for (int i = 1; i <= len; ++i)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
+        if (i < len && slots[i] == slots[i - 1] + 1 && i - from < UINT16_MAX)
+        {
+            continue;
+        }
+        struct timespec at = timespec_after(&par.lineStart, (par.slotsDone + slots[from]) * par.byteDelay.tv_nsec);
+        long long ns = timespec_nsec(&at, &par.logStart);
+        struct CaptureRecord record = { .ns = (ns > 0) ? ns : 0, .baud = par.baud, .len = i - from, .dir = dir };
+        fwrite(&record, sizeof(record), 1, par.logfile);
+        fwrite(bytes + from, 1, i - from, par.logfile);
+        from = i;
+    }
+}
+
+
+// Move the given number of byte slots through the cable: up to one byte per slot is
+// read from each side, and the byte that entered the ring buffer propDelay ago leaves
+// it (with noise) at the other side. Reads and writes are done in bulk.
+// Returns the number of bytes read
+int move_slots(int fdTx, int fdRx, int slots)
+{
+    char fromTx[BUF_SIZE], fromRx[BUF_SIZE], toRx[BUF_SIZE], toTx[BUF_SIZE];
+    int toRxSlot[BUF_SIZE], toTxSlot[BUF_SIZE];  // For the capture
+    int toRxLen = 0, toTxLen = 0;
+
+    int bytesFromTx = read(fdTx, fromTx, slots);
+    int bytesFromRx = read(fdRx, fromRx, slots);
+    bytesFromTx = (bytesFromTx > 0) ? bytesFromTx : 0;
+    bytesFromRx = (bytesFromRx > 0) ? bytesFromRx : 0;
+    int cableUp = par.cableOn && !in_outage();
+
+    for (int slot = 0; slot < slots; ++slot)
+    {
+        // Read from Tx and Rx (ignored while the cable is off)
+        par.tx2rxValid[par.tx2rxIdx] = slot < bytesFromTx && cableUp;
+        par.tx2rx[par.tx2rxIdx] = fromTx[slot];
+        par.rx2txValid[par.rx2txIdx] = slot < bytesFromRx && cableUp;
+        par.rx2tx[par.rx2txIdx] = fromRx[slot];
+        par.inFlight += par.tx2rxValid[par.tx2rxIdx] + par.rx2txValid[par.rx2txIdx];
+
+        // Advance indices to next position
+        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
+        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
+
+        if (cableUp)
+        {
+            if (par.tx2rxValid[par.tx2rxIdx])
+            {
+                add_noise(&par.tx2rxErrors, &par.tx2rx[par.tx2rxIdx]);
+                toRxSlot[toRxLen] = slot;
+                toRx[toRxLen++] = par.tx2rx[par.tx2rxIdx];
+            }
+
+            if (par.rx2txValid[par.rx2txIdx])
+            {
+                add_noise(&par.rx2txErrors, &par.rx2tx[par.rx2txIdx]);
+                toTxSlot[toTxLen] = slot;
+                toTx[toTxLen++] = par.rx2tx[par.rx2txIdx];
+            }
+        }
+
+        // The byte left the cable (or was lost, if it is off)
+        par.inFlight -= par.tx2rxValid[par.tx2rxIdx] + par.rx2txValid[par.rx2txIdx];
+        par.tx2rxValid[par.tx2rxIdx] = FALSE;
+        par.rx2txValid[par.rx2txIdx] = FALSE;
+    }
+
+    if (par.logfile != NULL)  // Currently logging
+    {
+        capture_batch(CAPTURE_TX2RX, toRx, toRxSlot, toRxLen);
+        capture_batch(CAPTURE_RX2TX, toTx, toTxSlot, toTxLen);
+    }
+
+    if (toRxLen > 0)
+    {
+        write(fdRx, toRx, toRxLen);
+        par.tx2rxBytes += toRxLen;
+    }
+    if (toTxLen > 0)
+    {
+        write(fdTx, toTx, toTxLen);
+    }
+    return bytesFromTx + bytesFromRx;
+}
+
+
+void run_command(char *cmd);
+
+// Time of the next scenario event (FALSE if none is pending)
+int next_event(struct timespec *at)
+{
+    if (par.scenario == NULL || !par.scenarioStarted || par.scenarioNext >= par.scenarioLen)
+    {
+        return FALSE;
+    }
+    *at = timespec_after(&par.scenarioStart, (long long) (par.scenario[par.scenarioNext].t * 1e9));
+    return TRUE;
+}
+
+
+// Run the scenario events due by t
+void run_events(const struct timespec *t)
+{
+    struct timespec at;
+    while (par.quit == FALSE && next_event(&at) && timespec_nsec(t, &at) >= 0)
+    {
+        struct ScenarioEvent *event = &par.scenario[par.scenarioNext++];
+        printf("[%.3lf s] %s\n", event->t, event->cmd);
+        run_command(event->cmd);
+    }
+}
+
+
+// Move every byte slot that started since the last tick. Slots are counted from
+// lineStart, so the rate doesn't drift however late the ticks are. Scenario events
+// run right before the first slot that starts after them.
+// Returns the number of bytes read plus the bytes still in flight (0 = cable idle)
+long cable_tick(int fdTx, int fdRx)
+{
+    long bytes = 0;
+    while (par.quit == FALSE)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long due = timespec_nsec(&now, &par.lineStart) / par.byteDelay.tv_nsec + 1;
+
+        if (due - par.slotsDone > 1000000000LL / par.byteDelay.tv_nsec)
+        {
+            if (par.unreliableRate == FALSE)
+            {
+                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                       "No further warnings will be issued\n");
+                par.unreliableRate = TRUE;
+            }
+            par.slotsDone = due - 1; // Don't make up for the lost time above the line rate
+        }
+        if (par.slotsDone >= due)
+        {
+            break;
+        }
+
+        long long slots = (due - par.slotsDone < BUF_SIZE) ? due - par.slotsDone : BUF_SIZE;
+        struct timespec at;
+        if (next_event(&at))
+        {
+            long long sinceStart = timespec_nsec(&at, &par.lineStart);
+            long long eventSlot = (sinceStart > 0) ? (sinceStart + par.byteDelay.tv_nsec - 1) / par.byteDelay.tv_nsec : 0;
+            if (eventSlot <= par.slotsDone)
+            {
+                struct timespec slotStart = timespec_after(&par.lineStart, par.slotsDone * par.byteDelay.tv_nsec);
+                run_events(&slotStart);
+                continue; // baud / prop restart the slots
+            }
+            slots = (eventSlot - par.slotsDone < slots) ? eventSlot - par.slotsDone : slots;
+        }
+
+        bytes += move_slots(fdTx, fdRx, (int) slots);
+        par.slotsDone += slots;
+
+        if (par.exitBytes != 0 && par.tx2rxBytes >= par.exitBytes && par.quit == FALSE)
+        {
+            printf("%llu BYTES CARRIED Tx->Rx, EXITING\n", par.tx2rxBytes);
+            par.quit = TRUE;
+        }
+    }
+    return bytes + par.inFlight;
+}
+
+
+// Arm the timer of an idle cable for the next scenario event or the idle exit, if any
+void arm_idle_timer(int timerFd)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    struct timespec at;
+    if (next_event(&at))
+    {
+        its.it_value = at;
+    }
+    if (par.exitIdle != 0 && par.carried)
+    {
+        at = timespec_after(&par.idleSince, par.exitIdle * 1000000LL);
+        if ((its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) || timespec_nsec(&at, &its.it_value) < 0)
+        {
+            its.it_value = at;
+        }
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+// Ticking: the timer runs and the emulator ports are read on every tick.
+// Idle: the loop sleeps until a port has data (or the scenario needs it).
+void set_ticking(int epfd, int timerFd, int fdTx, int fdRx, int ticking)
+{
+    if (ticking)
+    {
+        struct itimerspec its = { .it_interval = { 0, TICK_NSEC }, .it_value = { 0, TICK_NSEC } };
+        timerfd_settime(timerFd, 0, &its, NULL);
     }
     else
     {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        arm_idle_timer(timerFd);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = fdTx;
+    epoll_ctl(epfd, ticking ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, fdTx, &ev);
+    ev.data.fd = fdRx;
+    epoll_ctl(epfd, ticking ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, fdRx, &ev);
+
+    if (ticking)
+    {
+        // The line was idle - the first byte starts now
+        clock_gettime(CLOCK_MONOTONIC, &par.lineStart);
+        par.slotsDone = 0;
+        par.carried = TRUE;
+        if (par.scenario != NULL && !par.scenarioStarted)
+        {
+            printf("SCENARIO STARTED\n");
+            par.scenarioStart = par.lineStart;
+            par.scenarioStarted = TRUE;
+        }
     }
 }
 
 
+// Events due and exit condition while the cable is idle
+void idle_wakeup(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    run_events(&now);
+    if (par.exitIdle != 0 && par.carried && par.quit == FALSE &&
+        timespec_nsec(&now, &par.idleSince) >= par.exitIdle * 1000000LL)
+    {
+        printf("CABLE IDLE FOR %lu msec, EXITING\n", par.exitIdle);
+        par.quit = TRUE;
+    }
+}
+
+
+// Read a scenario - one "<seconds> <command>" per line, in time order, with the time
+// counted from the first byte the cable carries. '#' starts a comment.
+// Returns 0 on success, -1 on failure
+int load_scenario(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    par.scenario = malloc(SCENARIO_MAX * sizeof(struct ScenarioEvent));
+    if (par.scenario == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    char line[COMMAND_SIZE + 32];
+    int lineNo = 0;
+    double last = 0.0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        ++lineNo;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        struct ScenarioEvent event;
+        int cmdStart = 0;
+        if (sscanf(line, " %lf %n", &event.t, &cmdStart) < 1)
+        {
+            if (strspn(line, " \t") == strlen(line))
+            {
+                continue;  // Blank line
+            }
+            printf("SCENARIO %s:%d: MISSING TIME\n", path, lineNo);
+            fclose(file);
+            return -1;
+        }
+        if (event.t < last || line[cmdStart] == '\0' || par.scenarioLen == SCENARIO_MAX)
+        {
+            printf("SCENARIO %s:%d: %s\n", path, lineNo,
+                   (event.t < last) ? "OUT OF ORDER" : (line[cmdStart] == '\0') ? "MISSING COMMAND" : "TOO MANY EVENTS");
+            fclose(file);
+            return -1;
+        }
+        snprintf(event.cmd, sizeof(event.cmd), "%s", line + cmdStart);
+        par.scenario[par.scenarioLen++] = event;
+        last = event.t;
+    }
+    fclose(file);
+    printf("SCENARIO %s: %d EVENTS\n", path, par.scenarioLen);
+    return 0;
+}
+
+
 // Show help
 void help()
 {
@@ -235,22 +680,222 @@ void help()
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
+           "--- burst <p_gb> <p_bg> <ber_bad> [ber_good]\n"
+           "                 : Gilbert-Elliott burst errors - the line switches from the\n"
+           "                   good to the bad state with probability p_gb per bit, back\n"
+           "                   with p_bg, and has ber_bad / ber_good (default=0) in each\n"
+           "--- seed <n>     : seed of the errors (default=1) - the same seed, model and\n"
+           "                   data give the same errors; ber/burst/seed restart them\n"
+           "--- outage <every> <for>\n"
+           "                 : disconnect the cable for the last <for> msec of every\n"
+           "                   <every> msec (outage off: stop)\n"
+           "--- errors       : show the bits flipped in each direction\n"
+           "--- baud <rate>  : set baud rate, between 1200 and 921600 (default=9600)\n"
            "                   note that 10 bits are sent per byte (8-N-1)\n"
            "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
            "                   will be approximated to an integer multiple of the byte\n"
            "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
+           "--- log <file>   : capture transmitted data to file (binary - read it with\n"
+           "                   capture_decode)\n"
            "--- endlog       : stop logging transmitted data\n"
+           "--- exit idle <msec>\n"
+           "                 : terminate once the cable is idle for <msec> after carrying\n"
+           "                   data (0 = never, default)\n"
+           "--- exit bytes <n>\n"
+           "                 : terminate once <n> bytes went from Tx to Rx (0 = never)\n"
            "--- quit         : terminate the program\n"
            "\n"
            "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
            "           ongoing will result in losses.\n"
+           "\n"
+           "Headless mode: cable <scenario> runs the commands of the scenario file, one\n"
+           "\"<seconds> <command>\" per line, in time order, timed from the first byte\n"
+           "the cable carries, e.g.\n"
+           "    0    exit idle 3000\n"
+           "    2    ber 1e-4\n"
+           "    5    off\n"
+           "    5.8  on\n"
            "\n");
 }
 
+// Run one of the interactive commands (from stdin or the scenario)
+void run_command(char *cmd)
+{
+    if (strcmp(cmd, "off") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        par.cableOn = FALSE;
+    }
+    else if (strcmp(cmd, "on") == 0)
+    {
+        printf("CONNECTION ON\n");
+        par.cableOn = TRUE;
+    }
+    else if (strncmp(cmd, "ber ", 4) == 0)
+    {
+        double ber;
+        if (sscanf(cmd + 4, "%lf", &ber) == 1 && ber >= 0.0 && ber < 1.0)
+        {
+            struct ErrorModel uniform = { .ber = { ber, 0.0 }, .leave = { 0.0, 0.0 } };
+            par.errors = uniform;
+            reset_errors();
+            printf("BER SET TO %lf (SEED %llu)\n", ber, par.seed);
+        }
+        else
+        {
+            printf("BAD BER VALUE (MUST BE 0 <= BER < 1.0)\n");
+        }
+    }
+    else if (strncmp(cmd, "burst ", 6) == 0)
+    {
+        struct ErrorModel burst = { .ber = { 0.0, 0.0 } };
+        int n = sscanf(cmd + 6, "%lf %lf %lf %lf", &burst.leave[0], &burst.leave[1],
+                       &burst.ber[1], &burst.ber[0]);
+        if (n >= 3 && burst.leave[0] >= 0.0 && burst.leave[0] <= 1.0 && burst.leave[1] > 0.0 &&
+            burst.leave[1] <= 1.0 && burst.ber[1] >= 0.0 && burst.ber[1] <= 1.0 &&
+            burst.ber[0] >= 0.0 && burst.ber[0] < 1.0)
+        {
+            par.errors = burst;
+            reset_errors();
+            printf("BURST ERRORS SET: MEAN BURST %.0lf BITS AT BER %lf, MEAN GAP %.0lf BITS AT BER %lf (SEED %llu)\n",
+                   1.0 / burst.leave[1], burst.ber[1],
+                   (burst.leave[0] > 0.0) ? 1.0 / burst.leave[0] : INFINITY, burst.ber[0], par.seed);
+        }
+        else
+        {
+            printf("BAD BURST PARAMETERS (burst <p_good_bad> <p_bad_good> <ber_bad> [ber_good])\n");
+        }
+    }
+    else if (strncmp(cmd, "seed ", 5) == 0)
+    {
+        if (sscanf(cmd + 5, "%llu", &par.seed) == 1)
+        {
+            reset_errors();
+            printf("SEED SET TO %llu\n", par.seed);
+        }
+        else
+        {
+            printf("BAD SEED\n");
+        }
+    }
+    else if (strcmp(cmd, "outage off") == 0)
+    {
+        par.outageEvery = 0;
+        printf("NO OUTAGES\n");
+    }
+    else if (strncmp(cmd, "outage ", 7) == 0)
+    {
+        unsigned long every, duration;
+        if (sscanf(cmd + 7, "%lu %lu", &every, &duration) == 2 && every > 0 && duration <= every)
+        {
+            par.outageEvery = every;
+            par.outageFor = duration;
+            clock_gettime(CLOCK_MONOTONIC, &par.outageStart);
+            printf("OUTAGE OF %lu msec EVERY %lu msec\n", duration, every);
+        }
+        else
+        {
+            printf("BAD OUTAGE (outage <every_msec> <for_msec>, for <= every)\n");
+        }
+    }
+    else if (strncmp(cmd, "exit idle ", 10) == 0)
+    {
+        if (sscanf(cmd + 10, "%lu", &par.exitIdle) == 1)
+        {
+            printf("EXIT AFTER %lu msec IDLE\n", par.exitIdle);
+        }
+        else
+        {
+            printf("BAD EXIT CONDITION\n");
+        }
+    }
+    else if (strncmp(cmd, "exit bytes ", 11) == 0)
+    {
+        if (sscanf(cmd + 11, "%llu", &par.exitBytes) == 1)
+        {
+            printf("EXIT AFTER %llu BYTES Tx->Rx\n", par.exitBytes);
+        }
+        else
+        {
+            printf("BAD EXIT CONDITION\n");
+        }
+    }
+    else if (strcmp(cmd, "errors") == 0)
+    {
+        printf("Tx->Rx: %llu BITS FLIPPED IN %llu\n", par.tx2rxErrors.flips, par.tx2rxErrors.bits);
+        printf("Rx->Tx: %llu BITS FLIPPED IN %llu\n", par.rx2txErrors.flips, par.rx2txErrors.bits);
+    }
+    else if (strncmp(cmd, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(cmd + 5, "%lu", &baud);
+        switch (baud) {
+            case 1200:
+            case 1800:
+            case 2400:
+            case 4800:
+            case 9600:
+            case 19200:
+            case 38400:
+            case 57600:
+            case 115200:
+            case 230400:
+            case 460800:
+            case 921600:
+                set_baud_rate(baud);
+                break;
+            default:
+                printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800 or 921600\n");
+        }
+    }
+    else if (strncmp(cmd, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(cmd + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            par.propDelay = propDelay;
+            init_ring_buffers();
+        }
+    }
+    else if (strncmp(cmd, "log ", 4) == 0)
+    {
+        startlog(cmd + 4);
+    }
+    else if (strcmp(cmd, "endlog") == 0)
+    {
+        endlog();
+        printf("NOT LOGGING\n");
+    }
+    else if (strcmp(cmd, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        par.quit = TRUE;
+    }
+    else if (strcmp(cmd, "help") == 0) {
+        help();
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+}
+
+
 int main(int argc, char *argv[])
 {
+    if (argc > 2)
+    {
+        printf("Usage: %s [scenario]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2 && load_scenario(argv[1]) == -1)
+    {
+        exit(1);
+    }
+
     printf("\n");
 
     system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
@@ -260,7 +905,10 @@ int main(int argc, char *argv[])
     system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
     sleep(1);
 
-    help();
+    if (par.scenario == NULL)
+    {
+        help();
+    }
 
     // Configure serial ports
     struct termios oldtioTx;
@@ -289,253 +937,101 @@ int main(int argc, char *argv[])
     int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    char rxStdin[BUF_SIZE] = {0};
-
-    int STOP = FALSE;
+    char rxStdin[BUF_SIZE + 1] = {0};
 
     set_baud_rate(DEFAULT_BAUDRATE);
+    reset_errors();
 
     set_rt_priority();
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
+    // Wait for the tick timer, the emulator ports (while the cable is idle) and stdin
+    int epfd = epoll_create1(0);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epfd < 0 || timerFd < 0)
+    {
+        perror("Creating the cable timer");
+        exit(-1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = timerFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timerFd, &ev);
+    ev.data.fd = STDIN_FILENO;
+    int stdinOpen = epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    int ticking = FALSE;
+    set_ticking(epfd, timerFd, fdTx, fdRx, FALSE);
 
     printf("\nCable ready\n\n");
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
-
-    while (STOP == FALSE)
+    while (par.quit == FALSE)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        struct epoll_event events[4];
+        int nEvents = epoll_wait(epfd, events, 4, -1);
+        if (nEvents < 0)
         {
-            if (unreliableRate == FALSE)
+            if (errno == EINTR)
             {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
+                continue;
             }
-        }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
-        {
-            skipWait = TRUE;
-        }
-        else
-        {
-            skipWait = FALSE;
+            perror("epoll_wait");
+            break;
         }
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
-
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
-
-        if (!par.cableOn)
-        {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
-        }
-
-        if (par.logfile != NULL)  // Currently logging
+        int stdinReady = FALSE;
+        for (int i = 0; i < nEvents; ++i)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            if (events[i].data.fd == timerFd)
             {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
+                unsigned long long expirations;
+                read(timerFd, &expirations, sizeof(expirations));
+                if (!ticking)
+                {
+                    idle_wakeup();
+                    arm_idle_timer(timerFd);
+                }
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            else if (events[i].data.fd == STDIN_FILENO)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                stdinReady = TRUE;
             }
-            else
+            else if (!ticking)  // An emulator port has data
             {
-                memcpy(rx2txTx, "  ", 3);
+                set_ticking(epfd, timerFd, fdTx, fdRx, TRUE);
+                ticking = TRUE;
             }
         }
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
-
-        if (par.cableOn)
+        if (ticking && cable_tick(fdTx, fdRx) == 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
-
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
+            clock_gettime(CLOCK_MONOTONIC, &par.idleSince);
+            set_ticking(epfd, timerFd, fdTx, fdRx, FALSE);
+            ticking = FALSE;
         }
 
-        if (par.logfile != NULL)  // Currently logging
+        if (!stdinReady)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
-
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
-            {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
-            }
-            else
-            {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
-            }
+            continue;
         }
 
         // Read commands from STDIN to control the cable mode
         int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+        if (fromStdin == 0 && stdinOpen)
         {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
-            {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
-            }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
-            {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
-            }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
-            }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
-            {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
+            // End of input - keep running, without commands
+            epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            stdinOpen = FALSE;
+        }
+        else if (fromStdin > 0)
+        {
+            rxStdin[fromStdin] = '\0';
+            for (char *cmd = strtok(rxStdin, "\n"); cmd != NULL; cmd = strtok(NULL, "\n"))
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
+                run_command(cmd);
             }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
-            }
-        }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
         }
     }
 
+    endlog();
+
     // Restore the old port settings
     if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
     {
@@ -549,6 +1045,8 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    close(timerFd);
+    close(epfd);
     close(fdTx);
     close(fdRx);
 
@@ -0,0 +1,31 @@
+// Binary capture of the cable (log <file>), read by capture_decode.
+//
+// A CaptureHeader, then records: a CaptureRecord followed by its len bytes.
+// Every record holds bytes of one direction that left the cable in consecutive byte
+// slots - byte i at ns + i * 10e9 / baud. All fields are little endian (host order).
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "RCOMCAP1"
+#define CAPTURE_BUF_SIZE (1 << 20)  // stdio buffer of the capture file
+
+#define CAPTURE_TX2RX 0
+#define CAPTURE_RX2TX 1
+
+struct CaptureHeader {
+    char magic[8];
+    uint64_t startNs;  // CLOCK_MONOTONIC when the capture started
+};
+
+struct CaptureRecord {
+    uint64_t ns;    // When the first byte left the cable, since startNs
+    uint32_t baud;  // Line rate at the time
+    uint16_t len;   // Bytes that follow
+    uint8_t dir;    // CAPTURE_TX2RX / CAPTURE_RX2TX
+    uint8_t reserved;
+};
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,374 @@
+// Offline decoder of the cable captures (log <file>, see capture.h).
+// Splits each direction of the capture into frames and lists them with their timing,
+// then prints per direction totals: frames of each kind, errors, retransmissions,
+// stuffing overhead and line utilization.
+//
+// Usage: capture_decode [-s] <capture>   (-s: totals only)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "fec.h"
+#include "frame_utils.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define FRAME_MAX (1 << 16)  // Longer runs between flags are not frames
+
+// Frames and bytes of one direction
+struct Direction {
+    const char *name;
+    unsigned char frame[FRAME_MAX];  // Between the flags, still stuffed
+    int len;
+    int inFrame;
+    unsigned long long startNs;      // Opening flag
+    unsigned int dataHash[SEQ_MOD_EXT];  // Last good I frame of each sequence number
+    int haveHash[SEQ_MOD_EXT];
+
+    unsigned long long bytes;
+    double lineNs;                   // Time the line was busy (bytes at their baud rate)
+    unsigned long long firstNs, lastNs;
+    unsigned long long junk;         // Bytes outside frames
+    unsigned long frames, iFrames, suFrames, uFrames;
+    unsigned long shortFrames, bcc1Errors, fcsErrors;
+    unsigned long fecFrames;         // I frames FEC corrected
+    unsigned long long fecBytes;     // Bytes it corrected in them
+    unsigned long uniqueFrames;      // I frames seen intact for the first time
+    unsigned long long payload;      // Their data field bytes
+    unsigned long long stuffed;      // Bytes added by stuffing to the data fields of I frames
+    double iTimeMin, iTimeMax, iTimeSum;
+};
+
+static struct Direction dirs[2] = {{.name = "Tx->Rx"}, {.name = "Rx->Tx"}};
+static int fcsType = FCS_XOR;  // From the UA parameters
+static int duplex = FALSE;     // Full duplex (UA parameters) - I frames carry an acknowledgement
+static int fecParity = 0;      // FEC parity bytes per codeword (UA parameters) - after the check sequence of I frames
+static int listFrames = TRUE;
+
+
+// FNV-1a - tells a retransmission (same data as the last frame with that number) from a new frame
+unsigned int hashData(const unsigned char *data, int len)
+{
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; ++i)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+// Name of the frame with control field c
+void frameName(unsigned char c, char *name, int size)
+{
+    int seq;
+    if (duplex && (seq = seqFromIA(c)) >= 0)
+    {
+        snprintf(name, size, "I(%d,%d)", seq, ackFromIA(c));
+    }
+    else if (c == SU_C_SET || c == SU_C_UA || c == SU_C_DISC)
+    {
+        snprintf(name, size, "%s", (c == SU_C_SET) ? "SET" : (c == SU_C_UA) ? "UA" : "DISC");
+    }
+    else if ((seq = seqFromRR(c)) >= 0)
+    {
+        snprintf(name, size, "RR(%d)", seq);
+    }
+    else if ((seq = seqFromREJ(c)) >= 0)
+    {
+        snprintf(name, size, "REJ(%d)", seq);
+    }
+    else if ((seq = seqFromSREJ(c)) >= 0)
+    {
+        snprintf(name, size, "SREJ(%d)", seq);
+    }
+    else if ((seq = seqFromI(c)) >= 0)
+    {
+        snprintf(name, size, "I(%d)", seq);
+    }
+    else
+    {
+        snprintf(name, size, "C=0x%02X", c);
+    }
+}
+
+
+// FCS, full duplex and FEC agreed to in the parameters of a UA
+void readParams(const unsigned char *params, int len)
+{
+    for (int i = 0; i + 2 <= len && i + 2 + params[i + 1] <= len; i += 2 + params[i + 1])
+    {
+        if (params[i] == PARAM_FCS && params[i + 1] == 1 && params[i + 2] <= FCS_CRC32C)
+        {
+            fcsType = params[i + 2];
+        }
+        if (params[i] == PARAM_DUPLEX && params[i + 1] == 1)
+        {
+            duplex = (params[i + 2] == TRUE);
+        }
+        if (params[i] == PARAM_FEC && params[i + 1] == 1 && fecValid(params[i + 2]))
+        {
+            fecParity = params[i + 2];
+        }
+    }
+}
+
+
+// A frame ended (closing flag) at endNs
+void decodeFrame(struct Direction *d, unsigned long long endNs)
+{
+    char name[16] = "?";
+    const char *status = "ok";
+    int resent = FALSE;
+    int dataLen = -1;
+    int stuffing = 0;
+    int corrected = 0;
+
+    // Address, control and BCC1 (full duplex stuffs them too - see frameHeader())
+    unsigned char header[3];
+    int h = 0, start = 0;
+    for (; h < 3 && start < d->len; ++start)
+    {
+        header[h++] = (d->frame[start] == STUFF_ESC && start + 1 < d->len) ? STUFF_MASK(d->frame[++start]) : d->frame[start];
+    }
+
+    d->frames++;
+    if (h < 3)
+    {
+        d->shortFrames++;
+        status = "short";
+    }
+    else
+    {
+        unsigned char a = header[0], c = header[1];
+        frameName(c, name, sizeof(name));
+        if (header[2] != (unsigned char) (a ^ c))
+        {
+            d->bcc1Errors++;
+            status = "BCC1 error";
+        }
+        else if (start == d->len)
+        {
+            d->suFrames++;
+        }
+        else
+        {
+            // Destuff the data field and check sequence
+            unsigned char data[FRAME_MAX];
+            int n = 0;
+            for (int i = start; i < d->len; ++i)
+            {
+                data[n++] = (d->frame[i] == STUFF_ESC && i + 1 < d->len) ? STUFF_MASK(d->frame[++i]) : d->frame[i];
+            }
+            stuffing = (d->len - start) - n;
+
+            int seq = duplex ? seqFromIA(c) : seqFromI(c);
+            int fcs = (seq >= 0) ? fcsType : FCS_XOR;  // SET/UA parameters always use BCC2
+            unsigned char check[FCS_MAX_LEN];
+            if (seq >= 0 && fecParity > 0)
+            {
+                // Corrected as Rx does, before the check sequence
+                int fieldLen = fecFieldLen(n, fecParity);
+                corrected = (fieldLen >= 0) ? fecDecode(data, n, fecParity) : -1;
+                n = (corrected >= 0) ? fieldLen : -1;
+            }
+            dataLen = n - fcsLen(fcs);
+            if (dataLen >= 0)
+            {
+                fcsCompute(fcs, data, dataLen, check);
+            }
+            if (dataLen < 0 || memcmp(check, data + dataLen, fcsLen(fcs)) != 0)
+            {
+                d->fcsErrors++;
+                status = "BCC2 error";
+                corrected = 0;
+            }
+            else if (seq < 0)
+            {
+                d->uFrames++;
+                if (c == SU_C_UA)
+                {
+                    readParams(data, dataLen);
+                }
+            }
+            else
+            {
+                if (corrected > 0)
+                {
+                    d->fecFrames++;
+                    d->fecBytes += corrected;
+                }
+                unsigned int hash = hashData(data, dataLen);
+                resent = d->haveHash[seq] && d->dataHash[seq] == hash;
+                if (!resent)
+                {
+                    d->uniqueFrames++;
+                    d->payload += dataLen;
+                    d->dataHash[seq] = hash;
+                    d->haveHash[seq] = TRUE;
+                }
+            }
+
+            if (seq >= 0)
+            {
+                d->iFrames++;
+                d->stuffed += stuffing;
+                double us = (endNs - d->startNs) / 1000.0;
+                d->iTimeMin = (d->iFrames == 1 || us < d->iTimeMin) ? us : d->iTimeMin;
+                d->iTimeMax = (us > d->iTimeMax) ? us : d->iTimeMax;
+                d->iTimeSum += us;
+            }
+        }
+    }
+
+    if (listFrames)
+    {
+        printf("%12.3f ms  %s  %-8s %6d B", d->startNs / 1e6, d->name, name, d->len + 2);
+        if (dataLen >= 0)
+        {
+            printf("  data %5d  stuffing +%-4d", dataLen, stuffing);
+        }
+        else
+        {
+            printf("%28s", "");
+        }
+        printf("  %9.1f us  %s%s", (endNs - d->startNs) / 1000.0, status, resent ? " (resent)" : "");
+        if (corrected > 0)
+        {
+            printf(" (FEC corrected %d bytes)", corrected);
+        }
+        printf("\n");
+    }
+}
+
+
+// Next byte of a direction, and when its transmission ended
+void addByte(struct Direction *d, unsigned char byte, unsigned long long startNs, unsigned long long endNs)
+{
+    if (byte == SU_Flag)
+    {
+        if (d->inFrame && d->len > 0)
+        {
+            decodeFrame(d, endNs);
+            d->inFrame = FALSE;  // The next flag opens a frame
+        }
+        else
+        {
+            d->inFrame = TRUE;   // Opening flag (or a repeated one)
+            d->startNs = startNs;
+        }
+        d->len = 0;
+    }
+    else if (!d->inFrame || d->len == FRAME_MAX)
+    {
+        d->junk++;
+        d->inFrame = FALSE;
+        d->len = 0;
+    }
+    else
+    {
+        d->frame[d->len++] = byte;
+    }
+}
+
+
+void printTotals(const struct Direction *d, double spanNs)
+{
+    printf("\n---- %s ----\n", d->name);
+    printf("Bytes on the line: %llu (%.1f%% utilization)\n", d->bytes, (spanNs > 0) ? 100.0 * d->lineNs / spanNs : 0.0);
+    printf("Frames:            %lu - I %lu, S/U %lu, U with parameters %lu\n",
+           d->frames, d->iFrames, d->suFrames, d->uFrames);
+    printf("Errors:            %lu BCC1, %lu BCC2/FCS, %lu too short, %llu bytes outside frames\n",
+           d->bcc1Errors, d->fcsErrors, d->shortFrames, d->junk);
+    if (fecParity > 0)
+    {
+        printf("FEC:               %lu frames corrected (%llu bytes), %d parity bytes per codeword\n",
+               d->fecFrames, d->fecBytes, fecParity);
+    }
+    if (d->iFrames == 0)
+    {
+        return;
+    }
+    printf("I frames:          %lu new, %lu resent or damaged (%.1f%%)\n", d->uniqueFrames,
+           d->iFrames - d->uniqueFrames, 100.0 * (d->iFrames - d->uniqueFrames) / d->iFrames);
+    printf("Payload:           %llu bytes, stuffing +%llu bytes (%.2f%%)\n", d->payload, d->stuffed,
+           (d->payload > 0) ? 100.0 * d->stuffed / d->payload : 0.0);
+    printf("Goodput:           %.1f bytes/s\n", (spanNs > 0) ? d->payload * 1e9 / spanNs : 0.0);
+    printf("I frame time (us): min %.1f, avg %.1f, max %.1f\n", d->iTimeMin, d->iTimeSum / d->iFrames, d->iTimeMax);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            listFrames = FALSE;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+    if (path == NULL)
+    {
+        printf("Usage: %s [-s] <capture>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+
+    struct CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        printf("%s: not a cable capture\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    struct CaptureRecord record;
+    unsigned char bytes[UINT16_MAX];
+    unsigned long long firstNs = 0, lastNs = 0;
+    int any = FALSE;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.dir > CAPTURE_RX2TX || record.baud == 0 || fread(bytes, 1, record.len, file) != record.len)
+        {
+            printf("%s: truncated or damaged record\n", path);
+            break;
+        }
+
+        struct Direction *d = &dirs[record.dir];
+        double byteNs = 1e10 / record.baud;
+        for (int i = 0; i < record.len; ++i)
+        {
+            unsigned long long start = record.ns + (unsigned long long) (i * byteNs);
+            addByte(d, bytes[i], start, start + (unsigned long long) byteNs);
+        }
+        d->bytes += record.len;
+        d->lineNs += record.len * byteNs;
+
+        unsigned long long end = record.ns + (unsigned long long) (record.len * byteNs);
+        firstNs = (!any || record.ns < firstNs) ? record.ns : firstNs;
+        lastNs = (end > lastNs) ? end : lastNs;
+        any = TRUE;
+    }
+    fclose(file);
+
+    double spanNs = (double) (lastNs - firstNs);
+    printf("\nCapture of %.3f s\n", spanNs / 1e9);
+    printTotals(&dirs[CAPTURE_TX2RX], spanNs);
+    printTotals(&dirs[CAPTURE_RX2TX], spanNs);
+    return 0;
+}
@@ -0,0 +1,42 @@
+// Link bonding header.
+
+#ifndef _BOND_H_
+#define _BOND_H_
+
+#include "link_layer.h"
+
+// One transfer striped over several serial lines between the same two hosts. Every line
+// is a link layer connection of its own, run by its own thread (the connection state is
+// per thread), and takes the next packet whenever its window has room - faster lines
+// take more. Each packet goes with a stripe sequence number and Rx hands them over in
+// that order. A line that fails gives the packets it may not have delivered back to the
+// others, and Rx drops the ones that arrive twice.
+#define BOND_MAX_LINES 8
+#define BOND_HEADER_SIZE 4 // Stripe sequence number (big endian) before each packet
+#define BOND_WINDOW 64     // Packets sent and not acknowledged (Tx) / held for reordering (Rx)
+
+// Open a connection on every port of the comma separated list ports, with the other
+// parameters of params (adaptive payloads are off - any line may carry any packet).
+// Tx waits for every line to connect or give up, Rx for the first one to connect.
+// Returns -1 if no line connected, otherwise the number of lines that did.
+int bondOpen(const char *ports, LinkLayer params);
+
+// Largest packet bondWrite() takes (the smallest payload agreed by the lines, less the header).
+int bondMaxPayload();
+
+// Queue a packet made of head and buf for the next line that has room (see llwritev()).
+// Waits while BOND_WINDOW packets are in flight.
+// Returns -1 if every line failed, otherwise the packet size.
+int bondWrite(const unsigned char *head, int headSize, const unsigned char *buf, int bufSize);
+
+// Receive the next packet in stripe order into packet.
+// Returns 0 once every line disconnected, -1 if they all failed, otherwise the packet size.
+int bondRead(unsigned char *packet);
+
+// Tx: deliver everything queued and disconnect every line. Rx: wait for every line to
+// disconnect (a line that stays silent is left behind after a while).
+// Prints a summary of each line if showStatistics is TRUE.
+// Returns -1 if some packet couldn't be delivered (Tx) or no line disconnected cleanly (Rx).
+int bondClose(int showStatistics);
+
+#endif // _BOND_H_
@@ -0,0 +1,45 @@
+// Block compression header.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Methods (the value sent in the START packet)
+#define COMP_NONE 0
+#define COMP_FAST 1 // Deflate (zlib) level 1
+#define COMP_HIGH 2 // LZMA2 (xz) preset 6, dictionary the size of a block
+
+// A compressed file goes as a stream of records, one per block of up to COMP_BLOCK_SIZE bytes:
+// method (COMP_NONE if the block didn't compress), raw length and data length (4 bytes each,
+// big endian), then the data. Blocks are independent, so they can be (de)compressed in parallel.
+#define COMP_BLOCK_SIZE (256 * 1024)
+#define COMP_RECORD_HEADER 9
+#define COMP_RECORD_MAX (COMP_RECORD_HEADER + COMP_BLOCK_SIZE)
+
+#define COMP_MAX_WORKERS 16
+
+// Start the worker pool - compressing (Tx) or decompressing (Rx) with method.
+// Returns -1 on error.
+int compStart(int method, int compress);
+
+// Blocks submitted and not released yet, and whether another one can be submitted.
+int compPending();
+int compFull();
+
+// Whether the oldest block submitted is done (compNext() returns without waiting).
+int compReady();
+
+// Tx: compress len bytes at block (read in place until the block is released).
+// Rx: decompress the record of len bytes, which the caller put in compBuffer().
+void compSubmit(const unsigned char *block, int len);
+unsigned char *compBuffer(); // COMP_RECORD_MAX bytes for the next record (Rx)
+
+// Wait for the oldest block submitted: *out points to its record (Tx) or raw data (Rx)
+// until compRelease().
+// Returns its length, or -1 if it couldn't be (de)compressed.
+int compNext(const unsigned char **out);
+void compRelease();
+
+// Stop the worker pool (whatever is pending is dropped).
+void compStop();
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,48 @@
+// Forward error correction header.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+// Reed-Solomon code over GF(256) for the data field of I frames (payload and check sequence),
+// applied before stuffing. The field is split into n = ceil(len / (255 - parity)) codewords,
+// byte i going to codeword i % n, so a burst of errors on the line is shared by all of them.
+// The code is systematic: the field goes unchanged, followed by the parity bytes of every
+// codeword (byte j of codeword c at len + j * n + c). Each codeword corrects up to parity / 2
+// wrong bytes - errors that hit a flag or an escape change the length of the field, and those
+// frames are still rejected by the check sequence.
+#define FEC_SYMBOLS 255      // Codeword length (shorter ones are padded with zeros that aren't sent)
+#define FEC_MAX_PARITY 32    // Parity bytes per codeword (even)
+#define FEC_MAX_CODEWORDS 64 // Longest field: FEC_MAX_CODEWORDS * (FEC_SYMBOLS - parity) bytes
+
+// Largest coded field of a field of up to n bytes (with any parity)
+#define FEC_MAX_LEN(n) ((n) + FEC_MAX_PARITY * (((n) + FEC_SYMBOLS - FEC_MAX_PARITY - 1) / (FEC_SYMBOLS - FEC_MAX_PARITY)))
+
+// Is parity a number of parity bytes per codeword fecEncode() takes (0 = no FEC)?
+int fecValid(int parity);
+
+// Length of a field of len bytes once coded (field and parity), -1 if it is too long
+int fecCodedLen(int len, int parity);
+
+// Length of the field in a coded field of codedLen bytes, -1 if no field codes to that length
+int fecFieldLen(int codedLen, int parity);
+
+// Parity of a field in pieces: fecUpdate() each one, starting from fecInit(), then fecFinal()
+typedef struct {
+  int parity;
+  int codewords;
+  int next; // Codeword of the next byte
+  unsigned char reg[FEC_MAX_CODEWORDS][FEC_MAX_PARITY]; // Remainder of each codeword so far
+} FecEncoder;
+
+void fecInit(FecEncoder *enc, int len, int parity); // len - the whole field (at most fecCodedLen() allows)
+void fecUpdate(FecEncoder *enc, const unsigned char *data, int len);
+void fecFinal(const FecEncoder *enc, unsigned char *out); // fecCodedLen() - len bytes
+
+// Parity of a field in one piece, written right after it
+void fecEncode(unsigned char *field, int len, int parity);
+
+// Correct a coded field (field and parity) in place
+// Returns the number of bytes corrected, or -1 if some codeword had more errors than it corrects
+int fecDecode(unsigned char *coded, int codedLen, int parity);
+
+#endif // _FEC_H_
@@ -3,13 +3,19 @@
 
 
 // Miscellaneous Macros
-#define ALARM_INTV 3 // Alarm interval (in seconds) - for timeouts and retransmissions
+#define DEFAULT_TIMEOUT_MS 3000 // Retransmission timeout when LinkLayer doesn't set one (until the RTT is measured)
+#define RTO_MIN_MS 50           // Bounds of the adaptive retransmission timeout
+#define RTO_MAX_MS 60000
+#define DEFAULT_PAYLOAD_SIZE 1000 // Payload size when it isn't negotiated (the original MAX_PAYLOAD_SIZE) - the least llopen agrees to
+#define MIN_PAYLOAD_SIZE 64       // Smallest payload the adaptive mode cuts frames to
+#define ADAPT_FRAMES 32           // Frames sent (or resent) between two adaptive payload size updates
 
 
 // Buffer sizes
 #define SU_BUF_SIZE 5                     // SU Frames have 5 bytes
-#define I_BUF_SIZE 2*MAX_PAYLOAD_SIZE + 6 // Based on MAX_PAYLOAD_SIZE
-// #define I_BUF_SIZE(n) (2*(n)+6)          // Byte Stuffing - I Frames have up to double the original size + header and tailer bytes
+#define I_HDR_MAX 6                       // Flag, address, control and BCC1 - the last two may be stuffed (see I_CXA)
+#define I_BUF_SIZE(n) (2*((n)+FCS_MAX_LEN) + I_HDR_MAX + 1) // I Frame with up to n bytes of payload - payload and BCC2/FCS may double with stuffing
+#define PARAMS_MAX_LEN 24                 // SET/UA parameter list (see PARAM_*)
 
 
 // Macros for the Supervision (S) and Unnumbered (U) Frames
@@ -27,8 +33,16 @@
 #define SU_C_REJ0 0x54         // Control field - Negative ACK - Receiver rejects - reject information in frame 0 (detected error)
 #define SU_C_REJ1 0x55         // Control field - Negative ACK - Receiver rejects - reject information in frame 1 (detected error)
 #define SU_C_REJ(n) (((n) % 2 == 0) ? SU_C_REJ0 : SU_C_REJ1)
+#define SU_C_SREJ0 0x56        // Control field - Selective Reject - only information frame 0 must be resent (Selective Repeat)
+#define SU_C_SREJ1 0x57        // Control field - Selective Reject - only information frame 1 must be resent (Selective Repeat)
+#define SU_C_SREJ(n) (((n) % 2 == 0) ? SU_C_SREJ0 : SU_C_SREJ1)
+#define SU_C_RRX(n) (0xA0 | ((n) & 0x07))  // Control field - Positive ACK with extended (3-bit) numbering - 0xA0 to 0xA7
+#define SU_C_REJX(n) (0x30 | ((n) & 0x07)) // Control field - Negative ACK with extended (3-bit) numbering - 0x30 to 0x37
+#define SU_C_SREJX(n) (0x38 | ((n) & 0x07)) // Control field - Selective Reject with extended (3-bit) numbering - 0x38 to 0x3F
 
 #define SU_C_DISC 0x0B         // Control field - DISC - disconnect - indicate the termination of connection
+#define SU_C_POLL 0x0F         // Control field - POLL - Tx asks Rx for what the application left it to say (half duplex, see llpoll())
+#define SU_C_ANSWER 0x13       // Control field - ANSWER - Rx replying to POLL, with the answer in a BCC2 protected data field
 // Byte 3 - BCC1 - Block Check Character - Protection Field to detect the occurrence of errors in header
 #define SU_BCC1(a,c) ((a)^(c))     // Protection field - Field to detect occurences of errors in the header
 
@@ -43,6 +57,12 @@
 #define I_C0 0x00              // Control field - Information frame 0
 #define I_C1 0x80              // Control field - Information frame 1
 #define I_C(n) (((n) % 2 == 0) ? I_C0 : I_C1) // Given the current frame count, get the control field
+#define I_CX(n) (0x40 | (((n) & 0x07) << 3))  // Control field - Information frame n with extended (3-bit) numbering - 0x40 to 0x78
+#define IS_I_CX(c) (((c) & 0xC7) == 0x40)     // Does the control field use extended numbering?
+// Full duplex - both ends send I frames, and each one also acknowledges every frame before r of the other
+// side (a piggybacked RR). The control field (and BCC1) may then be a flag or an escape, so it is stuffed.
+#define I_CXA(n,r) (I_CX(n) | ((r) & 0x07))    // Control field - Information frame n, acknowledging up to r - 0x40 to 0x7F
+#define IS_I_CXA(c) (((c) & 0xC0) == 0x40)
 
 // Information Field here in the middle (packet generated by the Application) - no macros, just to see the layout of the frame
 
@@ -50,11 +70,114 @@
 #define I_BCC1(a,c) ((a)^(c))                              // Protection field - Field to detect occurences of errors in the header
 unsigned int funcI_BCC2(const unsigned char *arr, int len);    // Protection field - Field to detect the occurrence of errors in the data field (XOR all the data bytes)
 
+// Frame Check Sequence - what goes in the BCC2 position, negotiated in llopen
+// Multi-byte FCS are sent most significant byte first (and stuffed, like BCC2)
+#define FCS_XOR 0     // BCC2 - XOR of the data bytes (1 byte, the original protocol)
+#define FCS_CRC16 1   // CRC-16-CCITT - poly 0x1021, init 0xFFFF (2 bytes)
+#define FCS_CRC32C 2  // CRC-32C (Castagnoli) - reflected poly 0x82F63B78, init/xorout 0xFFFFFFFF (4 bytes)
+#define FCS_MAX_LEN 4
+
+int fcsLen(int fcs);
+void fcsCompute(int fcs, const unsigned char *data, int len, unsigned char *out);
+
+// Same for a data field in pieces: fcsUpdate() each one, starting from fcsInit(), then fcsFinal()
+unsigned int fcsInit(int fcs);
+unsigned int fcsUpdate(int fcs, unsigned int acc, const unsigned char *data, int len);
+void fcsFinal(int fcs, unsigned int acc, unsigned char *out);
+
+// CRCs continue from crc - the CRC of the data before, or *_INIT for the first piece
+#define CRC16_INIT 0xFFFF
+#define CRC32C_INIT 0
+unsigned short crc16Bytewise(unsigned short crc, const unsigned char *data, int len); // One table lookup per byte
+unsigned short crc16(unsigned short crc, const unsigned char *data, int len);         // Slicing-by-8
+unsigned int crc32cSlice8(unsigned int crc, const unsigned char *data, int len);
+#if defined(__x86_64__) || defined(__i386__)
+unsigned int crc32cHw(unsigned int crc, const unsigned char *data, int len);        // SSE4.2 crc32 instruction - check the CPU first
+#endif
+unsigned int crc32c(unsigned int crc, const unsigned char *data, int len);          // Hardware if the CPU has it, otherwise slicing-by-8
+
+// Link parameters negotiated in llopen - a TLV list (type, length, value) in the data field of
+// SET (Tx proposal) and UA (values Rx agreed to). A plain SET/UA keeps the original protocol.
+#define PARAM_FCS 0x01     // Frame check sequence (1 byte - FCS_*)
+#define PARAM_PAYLOAD 0x02 // Maximum payload size (2 bytes, big endian) - Rx agrees to the smaller of both
+#define PARAM_DUPLEX 0x03  // Full duplex (1 byte - TRUE/FALSE) - Rx agrees if it asked for it too
+#define PARAM_FEC 0x04     // FEC parity bytes per codeword (1 byte - 0 = none, see fec.h) - Tx keeps it only if Rx echoes it
+#define PARAM_WINDOW 0x05  // Window size (1 byte) - Rx agrees to the smaller of both, absent = 1 (Stop-and-Wait)
+#define PARAM_ARQ 0x06     // Selective Repeat (1 byte - TRUE/FALSE, absent = Go-Back-N) - Rx agrees if it asked for it too
+
+
+// Sequence numbering
+// Stop-and-Wait uses the original 1-bit numbering (I_C, SU_C_RR, SU_C_REJ)
+// Windowed modes (Go-Back-N, Selective Repeat) use the extended 3-bit numbering (I_CX, SU_C_RRX, SU_C_REJX, SU_C_SREJX)
+#define SEQ_MOD_SW 2                    // Sequence number modulus for Stop-and-Wait
+#define SEQ_MOD_EXT 8                   // Sequence number modulus for windowed modes
+#define MAX_WINDOW_SIZE (SEQ_MOD_EXT-1) // Go-Back-N window can't exceed modulus - 1
+#define MAX_SR_WINDOW_SIZE (SEQ_MOD_EXT/2) // Selective Repeat windows (Tx and Rx) can't exceed modulus / 2
+
+// Get the sequence number from a control field (either numbering)
+// Return -1 if the control field is not of that type
+int seqFromI(unsigned char ctrl);
+int seqFromRR(unsigned char ctrl);
+int seqFromREJ(unsigned char ctrl);
+int seqFromSREJ(unsigned char ctrl);
+
+// Full duplex I frames (I_CXA) - their sequence number and the acknowledgement they carry
+int seqFromIA(unsigned char ctrl);
+int ackFromIA(unsigned char ctrl);
+
 
 // Macros for Byte Stuffing
 #define STUFF_ESC 0x7D                     // Escape octet to put before special data char
 #define STUFF_MASK(byte) ((byte)^0x20)     // Octet to XOR with special data char
 
+// Byte stuffing kernels - stuff len bytes of src into dst (which must have room for 2*len bytes)
+// and XOR them into *bcc2 in the same pass (BCC2 itself is not stuffed)
+// Return the number of bytes written to dst
+typedef int (*StuffFn)(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2);
+
+int stuffBytes(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2); // Best kernel for this CPU
+int stuffBytesScalar(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2);
+int stuffBytesWord(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2); // 8 bytes at a time
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+int stuffBytesSSE2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2);
+int stuffBytesAVX2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2);
+#endif
+
+// Kernel used by stuffBytes() (chosen on the first call from the CPU features)
+StuffFn stuffKernel(const char **name);
+
+// Destuffing kernels - destuff the data field from src into dst (dstCap bytes) until the closing
+// I_Flag, XORing every destuffed byte (BCC2 included) into state->bcc in the same pass
+// May be called again with the next bytes of the frame - state carries over
+#define DESTUFF_SPILL_SIZE FCS_MAX_LEN
+
+typedef struct {
+  int len;             // Bytes destuffed so far (payload + BCC2/FCS)
+  int escaped;         // Last byte seen was STUFF_ESC
+  unsigned char bcc;   // XOR of everything destuffed - 0 at the end of a frame with a good BCC2
+  unsigned char spill[DESTUFF_SPILL_SIZE]; // Bytes after dstCap - only the FCS may end up here, so dst never needs room for it
+} DestuffState;
+
+#define DESTUFF_INIT {0, 0, 0, {0}}
+#define DESTUFF_OVERFLOW(state, dstCap) ((state)->len > (dstCap) + DESTUFF_SPILL_SIZE) // Too long for payload + FCS - not a valid frame
+
+// Copy the last n destuffed bytes (the FCS), wherever they ended up, to out
+void destuffTail(const unsigned char *dst, int dstCap, const DestuffState *state, int n, unsigned char *out);
+
+// Return the number of src bytes consumed (the closing I_Flag included, in which case *frameEnd is set)
+typedef int (*DestuffFn)(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd);
+
+int destuffBytes(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd); // Best kernel for this CPU
+int destuffBytesScalar(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd);
+#ifdef HAVE_X86_SIMD
+int destuffBytesSSE2(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd);
+int destuffBytesAVX2(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd);
+#endif
+
+// Kernel used by destuffBytes() (chosen on the first call from the CPU features)
+DestuffFn destuffKernel(const char **name);
+
 
 // Function to prepare Supervision and Unnumbered Frames
 void prepSU(unsigned char *buf, unsigned char addr, unsigned char ctrl);
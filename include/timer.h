@@ -0,0 +1,31 @@
+// Timer engine header.
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+// Timers are deadlines on the monotonic clock (microsecond resolution) - no signals.
+// Whoever waits for input asks how long it may block (timerRemainingUs()) and then
+// checks which timers expired.
+#define MAX_TIMERS 16
+
+// Current time of the monotonic clock, in microseconds.
+long long timerNowUs();
+
+// Start (or restart) timer id to expire timeoutUs microseconds from now.
+void timerStart(int id, long long timeoutUs);
+
+// Stop timer id (or all of them).
+void timerStop(int id);
+void timerStopAll();
+
+// Return TRUE if timer id is running (expired or not).
+int timerRunning(int id);
+
+// Return the time left until the first running timer expires, 0 if one already expired,
+// or -1 if no timer is running.
+long long timerRemainingUs();
+
+// Return the running timer that expired first, or -1 if none expired yet.
+int timerFirstExpired();
+
+#endif // _TIMER_H_
@@ -0,0 +1,107 @@
+// Per-frame latency tracing header.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+// Every I frame is stamped (nanoseconds, monotonic clock) at each stage of its life.
+// When its last stage is reached, the time between stages goes into log-scale
+// histograms and the frame into a ring of the last TRACE_RING_SIZE frames, which
+// traceDump() writes as a Chrome trace (chrome://tracing, Perfetto) if asked to.
+// A stamp is one clock read and a store, so it is always on. Like the connection,
+// the frames traced belong to the calling thread.
+#define TRACE_RING_SIZE 65536
+#define TRACE_OPEN 16 // Frames in flight at once (at least MAX_WINDOW_SIZE / SEQ_MOD_EXT)
+#define TRACE_FILE "link_trace_%s.json" // %s = tx / rx
+#define TRACE_FILE_ENV "LINK_TRACE_FILE" // Set (to anything but 0) for traceDump() to write TRACE_FILE
+
+// Histogram buckets - 8 per power of two (12.5% resolution), up to 2^63 ns
+#define TRACE_SUB_BITS 3
+#define TRACE_BUCKETS (64 << TRACE_SUB_BITS)
+
+typedef enum
+{
+    // Tx - last one is TrTxAcked
+    TrTxQueued,   // llwrite() has room for the frame (full duplex waits for the window and the line first)
+    TrTxStuffed,  // Frame built (stuffed, check sequence computed)
+    TrTxWritten,  // Frame written to the serial port (the first time)
+    TrTxAcked,    // Acknowledged by RR/REJ
+    // Rx - last one is TrRxDelivered
+    TrRxFlag,      // Opening flag arrived
+    TrRxComplete,  // Closing flag arrived (check sequence verified)
+    TrRxDelivered, // Handed to the application by llread()
+    TR_STAGES
+} TraceStage;
+
+// Current time of the monotonic clock, in nanoseconds.
+long long traceNowNs();
+
+// Drop every stamp, histogram, traced frame and event of the calling thread (llopen),
+// and read the runtime event level from TRACE_LEVEL_ENV. What it allocates is freed
+// when the thread exits.
+void traceReset();
+
+// Stamp a stage of frame (absolute frame number) with t (traceNowNs()).
+// Stamping TrTxWritten again counts a retransmission; the last stage of each
+// side completes the frame.
+void traceStamp(unsigned int frame, TraceStage stage, long long t);
+
+// Print the percentiles of each histogram.
+void tracePrint();
+
+// Write the traced frames to TRACE_FILE (role = "tx" or "rx"), if TRACE_FILE_ENV asks for it.
+// Returns -1 if the trace file can't be written, 0 if it wasn't asked for, 1 otherwise.
+int traceDump(const char *role);
+
+
+// Event log - diagnostics of the link layer are stored, not printed: a record holds
+// the time, the function, a format string literal and up to two integer arguments,
+// in a ring of the last TRACE_EVENTS events of each thread. The ring is formatted
+// when an error event arrives, on SIGUSR1 (or a fatal signal) and at llclose.
+typedef enum
+{
+    TrError, // Dumps the events not printed yet, itself included
+    TrInfo,  // Retransmissions, timeouts, frames in error... (the default)
+    TrDebug, // Every frame
+    TrByte   // Every byte and state machine transition
+} TraceLevel;
+
+#define TRACE_EVENTS 4096    // Per thread
+#define TRACE_THREADS 16     // Threads that may log events
+#define TRACE_LEVEL_ENV "LINK_TRACE_LEVEL" // Runtime level (0-3), read by traceReset()
+
+// Events above TRACE_MAX_LEVEL are compiled out
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TrByte
+#endif
+
+extern int traceLevel; // Runtime level - events above it cost a comparison
+
+void traceSetLevel(TraceLevel level);
+
+// Store an event (use the TRACE macros) - arguments are printed with %lld / %llx
+void traceEvent(TraceLevel level, const char *func, const char *fmt, long long a, long long b);
+
+// Print the events not printed yet, of every thread, in time order
+void traceEventsDump();
+
+// Dump the events on SIGUSR1, and before dying of SIGSEGV / SIGBUS / SIGFPE / SIGABRT
+void traceInstallSignals();
+
+// Only checks the format string against the arguments, never called
+static inline __attribute__((format(printf, 1, 2))) void traceFormatCheck(const char *fmt, ...) { (void)fmt; }
+
+#define TRACE_ON(level) ((level) <= TRACE_MAX_LEVEL && (int)(level) <= traceLevel)
+#define TRACE2(level, fmt, a, b) do {                                                   \
+    if (TRACE_ON(level)) traceEvent((level), __func__, (fmt), (long long)(a), (long long)(b)); \
+    if (0) traceFormatCheck((fmt), (long long)(a), (long long)(b));                     \
+  } while (0)
+#define TRACE1(level, fmt, a) do {                                                      \
+    if (TRACE_ON(level)) traceEvent((level), __func__, (fmt), (long long)(a), 0);       \
+    if (0) traceFormatCheck((fmt), (long long)(a));                                     \
+  } while (0)
+#define TRACE(level, fmt) do {                                                          \
+    if (TRACE_ON(level)) traceEvent((level), __func__, (fmt), 0, 0);                    \
+    if (0) traceFormatCheck(fmt);                                                       \
+  } while (0)
+
+#endif // _TRACE_H_
@@ -0,0 +1,64 @@
+// Transport header - what carries the bytes of the serial port.
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/uio.h>
+
+// The port name picks the backend:
+//   "fd:<n>"            descriptor already open in this process (socketpair end, pty master)
+//   "mem:<pair>.<end>"  end 0 or 1 of a shared memory ring pair made by transportPair()
+//   "pty:<path>"        pty slave of transportPair(), configured with termios but not paced
+//   anything else       serial device configured with termios (/dev/ttyS10, or a pty slave
+//                       behind a cable that paces it)
+// Like the link layer above it, a thread has one transport open at a time.
+typedef struct
+{
+    const char *name;
+
+    // Open the port (baudRate only configures the termios backends). Returns -1 on error.
+    int (*open)(const char *port, int baudRate);
+
+    // Copy up to the iovec sizes of what was received, without waiting.
+    // Returns -1 on error, otherwise the number of bytes read (0 if none).
+    int (*readv)(const struct iovec *iov, int iovcnt);
+
+    // Write all of the iovecs, waiting for room if needed.
+    // Returns -1 on error, otherwise the number of bytes written.
+    int (*writev)(const struct iovec *iov, int iovcnt);
+
+    // Wait up to timeoutUs microseconds (-1 = no limit) for bytes to read.
+    // Returns -1 on error, 0 on timeout (or signal), 1 if there are bytes to read.
+    int (*poll)(long long timeoutUs);
+
+    // Close the port. Returns -1 on error.
+    int (*close)();
+
+    int paced; // Bytes leave at the baud rate (a serial line), not as fast as they are written
+} Transport;
+
+typedef enum
+{
+    TpPty,        // Pseudo terminal - the slave's device path ("pty:") and the master's descriptor
+    TpSocketpair, // Unix stream socket pair - two descriptors
+    TpMem,        // Two lock-free single producer/single consumer rings in shared memory
+} TransportKind;
+
+#define TRANSPORT_PAIRS_MAX 16
+#define MEM_RING_SIZE (1 << 16) // Bytes each way (power of two)
+
+// Backend of a port name.
+const Transport *transportFor(const char *port);
+
+// Create a connected pair of ports and write their names (for openSerialPort()) to
+// port0 and port1, each portSize bytes long. Made before fork() or pthread_create(), so
+// each end can be opened by its own process or thread - the link layer keeps one
+// connection per thread.
+// Returns -1 on error, otherwise the pair number.
+int transportPair(TransportKind kind, char *port0, char *port1, int portSize);
+
+// Let go of what this process holds of a pair (after fork(), the ends keep theirs) - a
+// descriptor its transport closed already (fd: ports, on closing) is left alone.
+void transportUnpair(int pair);
+
+#endif // _TRANSPORT_H_
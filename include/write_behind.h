@@ -0,0 +1,34 @@
+// Write-behind file output header.
+
+#ifndef _WRITE_BEHIND_H_
+#define _WRITE_BEHIND_H_
+
+// The receiver copies data into large aligned buffers and goes back to the link;
+// a writer thread drains the full ones to the file in big sequential writes.
+// Only the queue is bounded - wbWrite() waits when every buffer is waiting for the disk.
+#define WB_BUF_SIZE (1024 * 1024)
+#define WB_BUF_COUNT 8
+#define WB_ALIGN 4096
+
+// Called by the writer thread each time the file is on disk (fdatasync) up to offset bytes
+typedef void (*WbDurableFn)(long long offset);
+
+// Open filename (created if needed) keeping only its first offset bytes, which the data
+// queued then follows, and start the writer thread. If onDurable isn't NULL, every buffer
+// written is synced to disk and reported to it.
+// Returns -1 on error.
+int wbOpen(const char *filename, long long offset, WbDurableFn onDurable);
+
+// Queue len bytes to be written after everything queued before.
+// Returns -1 if a write already failed, otherwise len.
+int wbWrite(const unsigned char *data, int len);
+
+// Hand the data queued so far to the writer without waiting for the buffer to fill up
+// (so it reaches the disk, and onDurable, in bounded time on a slow link).
+void wbFlush();
+
+// Write everything still queued, stop the writer thread and close the file.
+// Returns -1 if any write failed.
+int wbClose();
+
+#endif // _WRITE_BEHIND_H_
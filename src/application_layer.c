@@ -1,11 +1,940 @@
 // Application layer protocol implementation
 
 #include "application_layer.h"
+#include "bond.h"
+#include "compress.h"
+#include "frame_utils.h"
+#include "link_layer.h"
+#include "write_behind.h"
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Packets
+#define C_DATA 1
+#define C_START 2
+#define C_END 3
+#define C_RESUME 4 // Rx answering a START with T_HASH - where Tx picks up the file (see RESUME)
+
+#define T_SIZE 0   // File size (big endian, as many bytes as it needs)
+#define T_NAME 1   // File name
+#define T_COMP 2   // Compression of the data packets (1 byte - COMP_*, absent = COMP_NONE)
+#define T_HASH 3   // CRC-32C of the whole file (4 bytes, big endian) - which file it is, for Rx's checkpoint (see RESUME)
+#define T_OFFSET 4 // RESUME: file bytes Rx already has (big endian, as many bytes as it needs)
+
+#define DATA_HEADER_SIZE 4 // C, N, L2, L1
+
+// Link layer options (both ends run this application)
+#define WINDOW_SIZE 7 // Go-Back-N
+#define FRAME_CHECK LlFcsCrc32c
+#define PAYLOAD_SIZE MAX_PAYLOAD_SIZE // Proposed - the link layer may agree to less
+#define ADAPTIVE_PAYLOAD TRUE         // Smaller frames when the line is noisy
+#define FEC_PARITY 0                  // Reed-Solomon parity bytes per 255-byte codeword (0 = off) - corrects half as many bytes without a retransmission
+
+// Tx compresses the file before it goes on the wire (Rx learns it from START) - not in full
+// duplex, where the worker pool is left to the file coming in
+#define COMPRESSION COMP_HIGH
+
+// Tx asks to resume by sending the hash of the file in START: Rx then keeps a checkpoint of the file it
+// receives (<file>.ckpt - its size, hash and how much of it is safely on disk) and answers with where Tx
+// picks up, so a transfer cut short carries on from there once both ends are started again. Rx goes by
+// what START says, so only Tx's setting counts. In full duplex the answer is one more packet, in half
+// duplex Tx polls Rx for it (see llpoll()). Bonded lines don't resume - Rx starts over
+#define RESUME TRUE
+#define CHECKPOINT_MS 2000 // Longest time received data waits before it is synced to disk and checkpointed
+
+// Tx maps the file this much at a time, so memory use doesn't grow with the file
+// (a multiple of COMP_BLOCK_SIZE, so compressed blocks never straddle two mappings)
+#define MAP_CHUNK (16 * 1024 * 1024)
+
+// A file going one way
+typedef struct
+{
+    unsigned int seq;       // Data packets sent / received
+    long long wireBytes;    // Bytes carried by data packets (compressed, if it is on)
+    long long fileBytes;    // Bytes of the file sent / written
+    int compression;
+    long long resumedAt;    // Bytes of the file Rx had from an earlier run (not sent again)
+} Transfer;
+
+// Transfer state
+static int bonded = FALSE;   // Striped over several lines (a comma separated list of ports)
+static int duplex = FALSE;   // A file each way at once (a comma separated pair of files)
+static Transfer sent = {0, 0, 0, COMP_NONE, 0};
+static Transfer received = {0, 0, 0, COMP_NONE, 0};
+static long long txResumeAt = -1; // From RESUME (-1 until it arrives)
+
+// File being received - full duplex takes its packets while the other file is being sent
+static const char *rxFilename = NULL;
+static long long rxFileSize = 0;
+static int rxStarted = FALSE;
+static int rxEnded = FALSE; // END received
+static int rxFailed = FALSE;
+
+// Checkpoint of the file being received (see RESUME)
+static char rxCheckpoint[1100];
+static int rxCheckpointing = FALSE;
+static long long rxHash = -1;           // From START
+static long long rxCheckpointedAt = 0;  // When the data received was last handed over to be synced (ms)
+
+static int receivePacket(const unsigned char *packet, int len);
+
+
+// The link layer, or the bonded lines
+static int packetWrite(const unsigned char *head, int headSize, const unsigned char *buf, int bufSize)
+{
+    if (bonded)
+    {
+        return bondWrite(head, headSize, buf, bufSize);
+    }
+
+    // Full duplex: the packets that came in meanwhile are taken first, so the link layer
+    // has room for more while it waits to send this one (it gives up waiting when more come)
+    int ret;
+    do
+    {
+        while (duplex && llavailable() > 0)
+        {
+            unsigned char packet[MAX_PAYLOAD_SIZE];
+            int len = llread(packet);
+            if (len <= 0 || receivePacket(packet, len) == -1)
+            {
+                return -1;
+            }
+        }
+    } while ((ret = llwritev(head, headSize, buf, bufSize)) == 0);
+    return ret;
+}
+
+static int packetRead(unsigned char *packet)
+{
+    return bonded ? bondRead(packet) : llread(packet);
+}
+
+static int packetMax()
+{
+    return bonded ? bondMaxPayload() : llmaxpayload();
+}
+
+
+// Put a number parameter (big endian, as many bytes as it needs) at packet
+// Returns its size
+static int putNumber(unsigned char *packet, unsigned char t, long long value)
+{
+    int n = 0;
+    int len = 1;
+    while (len < 8 && (value >> (8 * len)) != 0)
+    {
+        len++;
+    }
+    packet[n++] = t;
+    packet[n++] = len;
+    for (int i = len - 1; i >= 0; i--)
+    {
+        packet[n++] = value >> (8 * i);
+    }
+    return n;
+}
+
+static long long getNumber(const unsigned char *v, int len)
+{
+    long long value = 0;
+    for (int k = 0; k < len; k++)
+    {
+        value = (value << 8) | v[k];
+    }
+    return value;
+}
+
+
+// Build a START/END control packet (hash -1 - none)
+// Returns its size
+static int buildControlPacket(unsigned char *packet, unsigned char c, long long fileSize, const char *fileName,
+                              long long hash)
+{
+    int n = 0;
+    packet[n++] = c;
+
+    if (sent.compression != COMP_NONE)
+    {
+        packet[n++] = T_COMP;
+        packet[n++] = 1;
+        packet[n++] = sent.compression;
+    }
+
+    n += putNumber(packet + n, T_SIZE, fileSize);
+
+    if (hash >= 0)
+    {
+        packet[n++] = T_HASH;
+        packet[n++] = 4;
+        for (int i = 3; i >= 0; i--)
+        {
+            packet[n++] = hash >> (8 * i);
+        }
+    }
+
+    int nameLen = strlen(fileName);
+    if (nameLen > 255)
+    {
+        nameLen = 255;
+    }
+    packet[n++] = T_NAME;
+    packet[n++] = nameLen;
+    memcpy(packet + n, fileName, nameLen);
+    n += nameLen;
+
+    return n;
+}
+
+
+// Parse a START/END control packet (the file name, compression and hash are optional - *hash is -1 without one)
+// Returns -1 if it is malformed, 1 otherwise
+static int parseControlPacket(const unsigned char *packet, int len, long long *fileSize, char *fileName, int *comp,
+                              long long *hash)
+{
+    int haveSize = FALSE;
+    int i = 1;
+
+    fileName[0] = '\0';
+    *comp = COMP_NONE;
+    *hash = -1;
+    while (i + 2 <= len && i + 2 + packet[i + 1] <= len)
+    {
+        unsigned char t = packet[i];
+        int l = packet[i + 1];
+        const unsigned char *v = packet + i + 2;
+
+        if (t == T_SIZE && l <= 8)
+        {
+            *fileSize = getNumber(v, l);
+            haveSize = TRUE;
+        }
+        else if (t == T_NAME)
+        {
+            memcpy(fileName, v, l);
+            fileName[l] = '\0';
+        }
+        else if (t == T_COMP && l == 1)
+        {
+            *comp = v[0];
+        }
+        else if (t == T_HASH && l == 4)
+        {
+            *hash = getNumber(v, l);
+        }
+        i += 2 + l;
+    }
+
+    return (haveSize && i == len) ? 1 : -1;
+}
+
+
+// Send len bytes as data packets, built straight from data (only their header is separate)
+// Packets are as large as the link layer takes them at the moment (see llmaxpayload(), bondMaxPayload())
+// Returns -1 on error, 1 otherwise
+static int sendData(const unsigned char *data, long long len)
+{
+    long long i = 0;
+    while (i < len)
+    {
+        int dataSize = packetMax() - DATA_HEADER_SIZE;
+        int dataLen = (len - i < dataSize) ? len - i : dataSize;
+        unsigned char header[DATA_HEADER_SIZE] = {C_DATA, sent.seq % 256, dataLen >> 8, dataLen & 0xFF};
+
+        if (packetWrite(header, DATA_HEADER_SIZE, data + i, dataLen) == -1)
+        {
+            printf("%s: Failed to send data packet %u\n", __func__, sent.seq);
+            return -1;
+        }
+        sent.seq++;
+        sent.wireBytes += dataLen;
+        i += dataLen;
+    }
+    return 1;
+}
+
+
+// Send the record of the oldest block the workers compressed
+// Returns -1 on error, 1 otherwise
+static int sendRecord()
+{
+    const unsigned char *record;
+    int len = compNext(&record);
+    int ret = sendData(record, len);
+    compRelease();
+    return ret;
+}
+
+
+// Send a chunk of the file - in place, or compressed in blocks by the worker pool
+// (every block of the chunk is sent before it returns, so the chunk may be unmapped)
+// Returns -1 on error, 1 otherwise
+static int sendChunk(const unsigned char *chunk, long long len)
+{
+    if (sent.compression == COMP_NONE)
+    {
+        return sendData(chunk, len);
+    }
+
+    for (long long i = 0; i < len; i += COMP_BLOCK_SIZE)
+    {
+        // The oldest block goes on the wire while the others are being compressed
+        if (compFull() && sendRecord() == -1)
+        {
+            return -1;
+        }
+        compSubmit(chunk + i, (len - i < COMP_BLOCK_SIZE) ? len - i : COMP_BLOCK_SIZE);
+    }
+
+    while (compPending() > 0)
+    {
+        if (sendRecord() == -1)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+
+// CRC-32C of the whole file - which file it is, for the checkpoint Rx keeps (a file changed since doesn't match)
+// Returns -1 if it can't be read
+static long long fileHash(int fd, long long fileSize)
+{
+    unsigned int crc = CRC32C_INIT;
+
+    for (long long offset = 0; offset < fileSize; offset += MAP_CHUNK)
+    {
+        long long chunkLen = (fileSize - offset < MAP_CHUNK) ? fileSize - offset : MAP_CHUNK;
+        unsigned char *chunk = mmap(NULL, chunkLen, PROT_READ, MAP_PRIVATE, fd, offset);
+        if (chunk == MAP_FAILED)
+        {
+            perror("mmap");
+            return -1;
+        }
+        madvise(chunk, chunkLen, MADV_SEQUENTIAL);
+        crc = crc32c(crc, chunk, chunkLen);
+        munmap(chunk, chunkLen);
+    }
+    return crc;
+}
+
+
+// Wait for the RESUME answering START (full duplex takes the packets of the file coming in meanwhile,
+// half duplex asks Rx for it)
+// Returns -1 on error, 1 otherwise (txResumeAt is set then)
+static int waitResume()
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+
+    if (!duplex)
+    {
+        int len = llpoll(packet);
+        if (len <= 0 || packet[0] != C_RESUME)
+        {
+            printf("%s: No answer to the START packet\n", __func__);
+            return -1;
+        }
+        receivePacket(packet, len);
+    }
+
+    while (duplex && txResumeAt < 0 && !rxFailed)
+    {
+        int len = packetRead(packet);
+        if (len <= 0 || receivePacket(packet, len) == -1)
+        {
+            printf("%s: No answer to the START packet\n", __func__);
+            return -1;
+        }
+    }
+    return (txResumeAt < 0 || rxFailed) ? -1 : 1;
+}
+
+
+// Send the file - from where Rx asks for it, if it has part of it already (see RESUME)
+// Returns -1 on error, 1 otherwise
+static int sendFile(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    long long fileSize = st.st_size;
+    long long hash = (RESUME && !bonded) ? fileHash(fd, fileSize) : -1;
+
+    const char *baseName = strrchr(filename, '/');
+    baseName = baseName ? baseName + 1 : filename;
+
+    sent.compression = duplex ? COMP_NONE : COMPRESSION;
+    if (sent.compression != COMP_NONE && compStart(sent.compression, TRUE) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int packetLen = buildControlPacket(packet, C_START, fileSize, baseName, hash);
+    int ret = packetWrite(NULL, 0, packet, packetLen);
+    if (ret == -1)
+    {
+        printf("%s: Failed to send the START packet\n", __func__);
+    }
+
+    // Rx says where to pick up - past whatever an earlier run left on its disk
+    long long offset = 0;
+    if (ret != -1 && hash >= 0)
+    {
+        ret = waitResume();
+        offset = (ret != -1 && txResumeAt <= fileSize) ? txResumeAt : 0;
+        if (ret != -1 && offset > 0)
+        {
+            printf("%s: Resuming %s at byte %lld\n", __func__, baseName, offset);
+        }
+    }
+    sent.resumedAt = offset;
+
+    // Mappings start at a multiple of MAP_CHUNK (so at a page), the first one possibly before offset
+    while (ret != -1 && offset < fileSize)
+    {
+        long long mapAt = offset - offset % MAP_CHUNK;
+        long long mapLen = (fileSize - mapAt < MAP_CHUNK) ? fileSize - mapAt : MAP_CHUNK;
+        unsigned char *chunk = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, fd, mapAt);
+        if (chunk == MAP_FAILED)
+        {
+            perror("mmap");
+            ret = -1;
+            break;
+        }
+        madvise(chunk, mapLen, MADV_SEQUENTIAL); // Aggressive read-ahead, pages behind are dropped first
+
+        long long chunkLen = mapAt + mapLen - offset;
+        ret = sendChunk(chunk + (offset - mapAt), chunkLen);
+        if (ret != -1)
+        {
+            sent.fileBytes += chunkLen;
+        }
+        offset += chunkLen;
+
+        // The link layer keeps its own (stuffed) copy of the frames not acknowledged yet
+        munmap(chunk, mapLen);
+    }
+    close(fd);
+    if (sent.compression != COMP_NONE)
+    {
+        compStop();
+    }
+    if (ret == -1)
+    {
+        return -1;
+    }
+
+    packetLen = buildControlPacket(packet, C_END, fileSize, baseName, -1);
+    if (packetWrite(NULL, 0, packet, packetLen) == -1)
+    {
+        printf("%s: Failed to send the END packet\n", __func__);
+        return -1;
+    }
+
+    printf("%s: Sent %s (%lld bytes) in %u data packets\n", __func__, baseName, fileSize, sent.seq);
+    return 1;
+}
+
+
+static long long nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+// Record that the first offset bytes of the file being received are on disk, with its size and
+// hash - called by the write-behind thread once they are synced (see wbOpen())
+static void saveCheckpoint(long long offset)
+{
+    char tmp[sizeof(rxCheckpoint) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", rxCheckpoint);
+
+    // Written aside and renamed over the old one, so a crash leaves one or the other whole
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        perror(tmp);
+        return;
+    }
+    fprintf(f, "%lld %08llx %lld\n", rxFileSize, (unsigned long long)rxHash, offset);
+    if (fflush(f) != 0 || fsync(fileno(f)) == -1)
+    {
+        perror(tmp);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+    if (rename(tmp, rxCheckpoint) == -1)
+    {
+        perror(rxCheckpoint);
+    }
+}
+
+
+// Bytes of the file with this size and hash an earlier run left in rxFilename (0 if the checkpoint is of another file)
+static long long loadCheckpoint(long long fileSize, long long hash)
+{
+    long long size, offset;
+    unsigned long long ckHash;
+    struct stat st;
+
+    FILE *f = fopen(rxCheckpoint, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    int n = fscanf(f, "%lld %llx %lld", &size, &ckHash, &offset);
+    fclose(f);
+
+    if (n != 3 || size != fileSize || ckHash != (unsigned long long)hash || offset < 0 || offset > fileSize)
+    {
+        printf("%s: %s is of another file, starting over\n", __func__, rxCheckpoint);
+        return 0;
+    }
+    if (stat(rxFilename, &st) == -1)
+    {
+        return 0;
+    }
+    return (offset < st.st_size) ? offset : st.st_size;
+}
+
+
+// Rx record being put together from data packets (compression on)
+static unsigned char *recBuf = NULL;
+static int recLen = 0;
+static int recNeed = 0; // Header, then header + data
+
+
+// Write the oldest block the workers decompressed
+// Returns -1 on error, 1 otherwise
+static int writeBlock()
+{
+    const unsigned char *data;
+    int len = compNext(&data);
+    if (len == -1)
+    {
+        printf("%s: Corrupted compressed block\n", __func__);
+        return -1;
+    }
+
+    int ret = wbWrite(data, len);
+    compRelease();
+    received.fileBytes += len;
+    return ret;
+}
+
+
+// Take the data of a packet - records go to the worker pool as soon as they are complete
+// Returns -1 on error, 1 otherwise
+static int receiveRecords(const unsigned char *data, int len)
+{
+    while (len > 0)
+    {
+        if (recBuf == NULL)
+        {
+            // The oldest block goes to disk while the others are being decompressed
+            if (compFull() && writeBlock() == -1)
+            {
+                return -1;
+            }
+            recBuf = compBuffer();
+            recLen = 0;
+            recNeed = COMP_RECORD_HEADER;
+        }
+
+        int n = (len < recNeed - recLen) ? len : recNeed - recLen;
+        memcpy(recBuf + recLen, data, n);
+        recLen += n;
+        data += n;
+        len -= n;
+
+        if (recLen == COMP_RECORD_HEADER && recNeed == COMP_RECORD_HEADER)
+        {
+            unsigned int dataLen = (unsigned int)recBuf[5] << 24 | recBuf[6] << 16 | recBuf[7] << 8 | recBuf[8];
+            if (dataLen == 0 || dataLen > COMP_BLOCK_SIZE)
+            {
+                printf("%s: Malformed compressed block\n", __func__);
+                return -1;
+            }
+            recNeed += dataLen;
+        }
+        else if (recLen == recNeed)
+        {
+            compSubmit(recBuf, recLen);
+            recBuf = NULL;
+        }
+    }
+    return 1;
+}
+
+
+// Answer START with where Tx picks up the file (half duplex: left for Tx to poll)
+// Returns -1 on error, 1 otherwise
+static int sendResume(long long offset)
+{
+    unsigned char packet[MAX_ANSWER_SIZE];
+    int n = 0;
+    packet[n++] = C_RESUME;
+    n += putNumber(packet + n, T_OFFSET, offset);
+    if (duplex)
+    {
+        return (packetWrite(NULL, 0, packet, n) == -1) ? -1 : 1;
+    }
+    return llanswer(packet, n);
+}
+
+
+// Take a packet of the file being received into rxFilename (the name in the START packet is only reported),
+// or the RESUME answering the START of the file being sent
+// Returns -1 if the file can't be received, 1 otherwise
+static int receivePacket(const unsigned char *packet, int len)
+{
+    char txName[256];
+    long long fileSize = 0, endSize = 0, hash;
+    int comp;
+
+    if (packet[0] == C_RESUME)
+    {
+        txResumeAt = 0;
+        if (len >= 3 && packet[1] == T_OFFSET && packet[2] <= 8 && 3 + packet[2] == len)
+        {
+            txResumeAt = getNumber(packet + 3, packet[2]);
+        }
+    }
+    else if (packet[0] == C_START)
+    {
+        if (parseControlPacket(packet, len, &fileSize, txName, &comp, &hash) == -1)
+        {
+            printf("%s: Malformed START packet\n", __func__);
+            return 1;
+        }
+        if (!rxStarted)
+        {
+            if (comp < COMP_NONE || comp > COMP_HIGH)
+            {
+                printf("%s: Unknown compression %d\n", __func__, comp);
+                rxFailed = TRUE;
+                return -1;
+            }
+            received.compression = comp;
+            if (received.compression != COMP_NONE && compStart(received.compression, FALSE) == -1)
+            {
+                rxFailed = TRUE;
+                return -1;
+            }
+
+            // Part of this same file may be on disk already (without a hash, Tx can't tell it is the same)
+            rxFileSize = fileSize;
+            rxHash = hash;
+            rxCheckpointing = (hash >= 0 && !bonded); // Tx waits for RESUME
+            snprintf(rxCheckpoint, sizeof(rxCheckpoint), "%s.ckpt", rxFilename);
+            received.resumedAt = rxCheckpointing ? loadCheckpoint(fileSize, hash) : 0;
+            if (wbOpen(rxFilename, received.resumedAt, rxCheckpointing ? saveCheckpoint : NULL) == -1)
+            {
+                if (received.compression != COMP_NONE)
+                {
+                    compStop();
+                }
+                rxFailed = TRUE;
+                return -1;
+            }
+            rxStarted = TRUE;
+            if (rxCheckpointing)
+            {
+                saveCheckpoint(received.resumedAt);
+                rxCheckpointedAt = nowMs();
+            }
+            printf("%s: Receiving %s (%lld bytes)\n", __func__, txName, fileSize);
+            if (received.resumedAt > 0)
+            {
+                printf("%s: Resuming at byte %lld\n", __func__, received.resumedAt);
+            }
+            if (rxCheckpointing && sendResume(received.resumedAt) == -1)
+            {
+                printf("%s: Failed to answer the START packet\n", __func__);
+                rxFailed = TRUE;
+                return -1;
+            }
+        }
+    }
+    else if (packet[0] == C_DATA && rxStarted)
+    {
+        int dataLen = len - DATA_HEADER_SIZE;
+        if (dataLen < 0 || ((packet[2] << 8) | packet[3]) != dataLen)
+        {
+            printf("%s: Malformed data packet\n", __func__);
+            return 1;
+        }
+        if (packet[1] != received.seq % 256)
+        {
+            printf("%s: Data packet %d out of sequence (expected %u), discarded\n", __func__, packet[1], received.seq % 256);
+            return 1;
+        }
+        received.seq++;
+        received.wireBytes += dataLen;
+
+        if (received.compression != COMP_NONE)
+        {
+            if (receiveRecords(packet + DATA_HEADER_SIZE, dataLen) == -1)
+            {
+                printf("%s: Failed to write %s\n", __func__, rxFilename);
+                rxFailed = TRUE;
+                return -1;
+            }
+        }
+        else
+        {
+            if (wbWrite(packet + DATA_HEADER_SIZE, dataLen) == -1)
+            {
+                printf("%s: Failed to write %s\n", __func__, rxFilename);
+                rxFailed = TRUE;
+                return -1;
+            }
+            received.fileBytes += dataLen;
+        }
+
+        // On a slow link the blocks and the write-behind buffer take long to fill up - what came in
+        // is checkpointed anyway (the blocks already decompressed, at least)
+        if (rxCheckpointing && nowMs() - rxCheckpointedAt >= CHECKPOINT_MS)
+        {
+            while (received.compression != COMP_NONE && compReady())
+            {
+                if (writeBlock() == -1)
+                {
+                    printf("%s: Failed to write %s\n", __func__, rxFilename);
+                    rxFailed = TRUE;
+                    return -1;
+                }
+            }
+            wbFlush();
+            rxCheckpointedAt = nowMs();
+        }
+    }
+    else if (packet[0] == C_END && rxStarted)
+    {
+        if (parseControlPacket(packet, len, &endSize, txName, &comp, &hash) == -1 || endSize != rxFileSize)
+        {
+            printf("%s: END packet doesn't match START\n", __func__);
+        }
+        rxEnded = TRUE;
+    }
+    return 1;
+}
+
+
+// Receive the file into rxFilename - the rest of it, in full duplex (see packetWrite())
+// The data goes to disk write-behind, so a slow disk doesn't hold up llread() (and the next RR)
+// Returns -1 on error, 1 otherwise
+static int receiveFile()
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int len = 1;
+
+    while (!rxEnded && !rxFailed && (len = packetRead(packet)) > 0)
+    {
+        receivePacket(packet, len);
+    }
+
+    // The blocks still with the workers, then whatever is still queued, reach the disk here
+    if (rxStarted && received.compression != COMP_NONE)
+    {
+        if (!rxFailed && recBuf != NULL)
+        {
+            printf("%s: Last compressed block is incomplete\n", __func__);
+            rxFailed = TRUE;
+        }
+        while (!rxFailed && compPending() > 0)
+        {
+            if (writeBlock() == -1)
+            {
+                printf("%s: Failed to write %s\n", __func__, rxFilename);
+                rxFailed = TRUE;
+            }
+        }
+        compStop();
+        recBuf = NULL;
+    }
+    if (rxStarted && wbClose() == -1 && !rxFailed)
+    {
+        printf("%s: Failed to write %s\n", __func__, rxFilename);
+        rxFailed = TRUE;
+    }
+
+    if (rxFailed)
+    {
+        return -1;
+    }
+    if (len < 0)
+    {
+        printf("%s: Read error\n", __func__);
+        return -1;
+    }
+    if (!rxStarted || received.resumedAt + received.fileBytes != rxFileSize)
+    {
+        printf("%s: Incomplete file (%lld of %lld bytes)\n", __func__, received.resumedAt + received.fileBytes, rxFileSize);
+        return -1;
+    }
+    if (rxCheckpointing)
+    {
+        unlink(rxCheckpoint); // Whole - nothing to resume
+    }
+
+    printf("%s: Received %lld bytes in %u data packets\n", __func__, received.fileBytes, received.seq);
+    return 1;
+}
+
+
+// Summary of a file that went one way (label tells which, in full duplex)
+static void printTransfer(const char *label, const Transfer *t, double secs, double lineRate)
+{
+    double goodput = (secs > 0) ? t->fileBytes / secs : 0;
+
+    printf("%sCompression: %s, %lld file bytes in %lld packet bytes (ratio %.2f)\n", label,
+           t->compression == COMP_FAST ? "fast" : t->compression == COMP_HIGH ? "high" : "none",
+           t->fileBytes, t->wireBytes, t->wireBytes > 0 ? (double)t->fileBytes / t->wireBytes : 1.0);
+    printf("%sGoodput: %.0f bytes/s in %.2f s (%.1f%% of the line rate)\n", label,
+           goodput, secs, 100 * goodput / lineRate);
+    if (t->resumedAt > 0)
+    {
+        printf("%sResumed: the first %lld bytes came in an earlier run\n", label, t->resumedAt);
+    }
+}
+
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
-    // TODO
+    LinkLayer connectionParameters;
+    memset(&connectionParameters, 0, sizeof(connectionParameters));
+
+    // "file,other" - the other file goes the opposite way at the same time (full duplex):
+    // Tx sends file and receives other, Rx receives file and sends other
+    char ownFile[1024];
+    const char *otherFile = strchr(filename, ',');
+    int ownLen = otherFile ? (int)(otherFile - filename) : (int)strlen(filename);
+    snprintf(ownFile, sizeof(ownFile), "%.*s", ownLen, filename);
+    if (otherFile != NULL)
+    {
+        otherFile++;
+    }
+
+    strncpy(connectionParameters.serialPort, serialPort, sizeof(connectionParameters.serialPort) - 1);
+    connectionParameters.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
+    connectionParameters.baudRate = baudRate;
+    connectionParameters.nRetransmissions = nTries;
+    connectionParameters.timeout = timeout;
+    connectionParameters.windowSize = WINDOW_SIZE;
+    connectionParameters.selectiveRepeat = FALSE;
+    connectionParameters.frameCheck = FRAME_CHECK;
+    connectionParameters.payloadSize = PAYLOAD_SIZE;
+    connectionParameters.adaptivePayload = ADAPTIVE_PAYLOAD;
+    connectionParameters.fullDuplex = (otherFile != NULL);
+    connectionParameters.fecParity = FEC_PARITY;
+
+    // Several ports - the data is striped over all of them
+    int lines = 1;
+    for (const char *p = strchr(serialPort, ','); p != NULL; p = strchr(p + 1, ','))
+    {
+        lines++;
+    }
+    bonded = (lines > 1);
+    if (bonded && otherFile != NULL)
+    {
+        printf("%s: Bonded lines only carry one file, one way\n", __func__);
+        return;
+    }
+    if ((bonded ? bondOpen(serialPort, connectionParameters) : llopen(connectionParameters)) == -1)
+    {
+        printf("%s: Failed to open the connection\n", __func__);
+        return;
+    }
+
+    LinkLayerStats st;
+    duplex = (otherFile != NULL && llstats(&st) == 1 && st.fullDuplex);
+    if (otherFile != NULL && !duplex)
+    {
+        printf("%s: The other side didn't agree to full duplex\n", __func__);
+        llclose(FALSE);
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int ret;
+    if (duplex)
+    {
+        // Both files at once - the one coming in is taken between the packets of the one going out
+        rxFilename = (connectionParameters.role == LlTx) ? otherFile : ownFile;
+        ret = sendFile((connectionParameters.role == LlTx) ? ownFile : otherFile);
+        if (ret != -1)
+        {
+            ret = receiveFile();
+        }
+    }
+    else if (connectionParameters.role == LlTx)
+    {
+        ret = sendFile(ownFile);
+    }
+    else
+    {
+        rxFilename = ownFile;
+        ret = receiveFile();
+    }
+
+    // The bonded lines still hold up to BOND_WINDOW packets - Tx is done once they are delivered
+    if (bonded && bondClose(TRUE) == -1 && ret != -1)
+    {
+        printf("%s: Not every packet was delivered\n", __func__);
+        ret = -1;
+    }
+    if (ret == -1)
+    {
+        printf("%s: Transfer failed\n", __func__);
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        // A line carries baudRate / 10 bytes per second each way (start + 8 data + stop bits)
+        double lineRate = lines * baudRate / 10.0;
+        printf("\n---- Transfer ----\n");
+        if (duplex)
+        {
+            printTransfer("Sent - ", &sent, secs, lineRate);
+            printTransfer("Received - ", &received, secs, lineRate);
+        }
+        else
+        {
+            printTransfer("", (connectionParameters.role == LlTx) ? &sent : &received, secs, lineRate);
+        }
+    }
+
+    if (!bonded)
+    {
+        llclose(TRUE);
+    }
 }
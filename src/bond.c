@@ -0,0 +1,496 @@
+// Link bonding implementation
+
+#include "bond.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_utils.h" // MAX_WINDOW_SIZE, DEFAULT_TIMEOUT_MS
+#include "trace.h"
+
+
+typedef struct {
+  unsigned int seq;
+  int len;   // Header included
+  int inUse; // Tx: not acknowledged yet, Rx: waiting to be handed over
+  unsigned char data[BOND_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+} BondPacket;
+
+typedef enum {
+  LineOpening,
+  LineUp,
+  LineDown, // Failed (or never connected)
+  LineEnded // Rx: disconnected by Tx
+} LineState;
+
+typedef struct {
+  char port[sizeof(((LinkLayer *)0)->serialPort)];
+  pthread_t thread;
+  LineState state;
+  int started;   // The thread is running
+  int closed;    // The thread is done with its connection (stats is valid if haveStats)
+  int payload;   // Agreed in llopen
+  LinkLayerStats stats;
+  int haveStats;
+
+  // Tx: packets written since the last flush, oldest first - the ones llpending() counts are
+  // the last of them, and go back to the queue if the line fails
+  BondPacket *sent[MAX_WINDOW_SIZE + 1];
+  int nSent;
+  int flushed; // Nothing written since the last flush
+} Line;
+
+static Line lines[BOND_MAX_LINES];
+static int nLines = 0;
+static LinkLayer params;
+
+// Tx: packets in flight, and the queue of those waiting for a line (a failed line's go back to
+// its front). Rx: reorder slots, seq % BOND_WINDOW.
+static BondPacket packets[BOND_WINDOW];
+static BondPacket *queue[BOND_WINDOW];
+static unsigned int qHead = 0, qTail = 0;
+static unsigned int nextSeq = 0; // Tx: next packet queued, Rx: next packet handed over
+
+static int linesUp = 0;   // Lines connected and not failed or ended
+static int busyLines = 0; // Tx: lines that wrote packets since their last flush
+static int closing = FALSE;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER; // Any of the above
+
+
+static void put32(unsigned char *p, unsigned int v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+  return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+// The line failed - what it may not have delivered goes back to the front of the queue
+// (lock held)
+static void lineDown(Line *line)
+{
+  for (int i = line->nSent - 1; i >= 0; i--) {
+    queue[--qHead % BOND_WINDOW] = line->sent[i];
+  }
+  line->nSent = 0;
+  if (!line->flushed) {
+    busyLines--;
+  }
+  line->flushed = TRUE;
+  line->state = LineDown;
+  linesUp--;
+  pthread_cond_broadcast(&changed);
+}
+
+
+// Packets before the last pending ones were acknowledged - they leave the window (lock held)
+static void lineAcked(Line *line, int pending)
+{
+  int acked = line->nSent - pending;
+  if (acked <= 0) {
+    return;
+  }
+  for (int i = 0; i < acked; i++) {
+    line->sent[i]->inUse = FALSE;
+  }
+  memmove(line->sent, line->sent + acked, (line->nSent - acked) * sizeof(line->sent[0]));
+  line->nSent -= acked;
+  pthread_cond_broadcast(&changed);
+}
+
+
+// Connect the line (the thread owns the connection), then tell bondOpen() how it went
+// Returns FALSE if it couldn't connect
+static int lineOpen(Line *line)
+{
+  LinkLayer ll = params;
+  memcpy(ll.serialPort, line->port, sizeof(ll.serialPort));
+  int up = (llopen(ll) != -1);
+
+  pthread_mutex_lock(&lock);
+  line->state = up ? LineUp : LineDown;
+  line->payload = up ? llmaxpayload() : 0;
+  linesUp += up;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  return up;
+}
+
+
+// Done with the connection (if it connected) - keep its statistics for bondClose()
+static void lineClose(Line *line, int connected)
+{
+  if (connected) {
+    llclose(FALSE);
+  }
+  pthread_mutex_lock(&lock);
+  line->haveStats = connected && llstats(&line->stats) != -1;
+  line->closed = TRUE;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+
+static void *txLineThread(void *arg)
+{
+  Line *line = arg;
+  if (!lineOpen(line)) {
+    lineClose(line, FALSE);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&lock);
+  while (line->state == LineUp) {
+    if (qHead != qTail) {
+      BondPacket *packet = queue[qHead++ % BOND_WINDOW];
+      line->sent[line->nSent++] = packet; // At most the window and this one are unacknowledged
+      if (line->flushed) {
+        line->flushed = FALSE;
+        busyLines++;
+      }
+      pthread_mutex_unlock(&lock);
+
+      int ok = (llwrite(packet->data, packet->len) != -1);
+      int pending = ok ? llpending() : line->nSent;
+
+      pthread_mutex_lock(&lock);
+      lineAcked(line, pending);
+      if (!ok) {
+        TRACE2(TrError, "Line %lld failed, %lld packet(s) go to the other lines", line - lines + 1, line->nSent);
+        lineDown(line);
+      }
+    }
+    else if (closing && !line->flushed) {
+      // Nothing left to take - wait for the acknowledgements before telling the others
+      pthread_mutex_unlock(&lock);
+      int ok = (llflush() != -1);
+
+      pthread_mutex_lock(&lock);
+      if (ok) {
+        lineAcked(line, 0);
+        line->flushed = TRUE;
+        busyLines--;
+        pthread_cond_broadcast(&changed);
+      }
+      else {
+        TRACE2(TrError, "Line %lld failed, %lld packet(s) go to the other lines", line - lines + 1, line->nSent);
+        lineDown(line);
+      }
+    }
+    else if (closing && busyLines == 0) { // Everything was delivered (a line failing now has nothing to give back)
+      break;
+    }
+    else {
+      pthread_cond_wait(&changed, &lock);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  lineClose(line, TRUE);
+  return NULL;
+}
+
+
+static void *rxLineThread(void *arg)
+{
+  Line *line = arg;
+  if (!lineOpen(line)) {
+    lineClose(line, FALSE);
+    return NULL;
+  }
+
+  unsigned char buf[BOND_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+  int len;
+  while ((len = llread(buf)) > 0) {
+    if (len <= BOND_HEADER_SIZE) {
+      continue;
+    }
+    unsigned int seq = get32(buf);
+
+    pthread_mutex_lock(&lock);
+    // Tx keeps the lines within BOND_WINDOW of each other - this only waits if it didn't
+    while ((int)(seq - nextSeq) >= BOND_WINDOW && !closing) {
+      pthread_cond_wait(&changed, &lock);
+    }
+    BondPacket *slot = &packets[seq % BOND_WINDOW];
+    if ((int)(seq - nextSeq) >= 0 && !closing && !slot->inUse) {
+      memcpy(slot->data, buf, len);
+      slot->len = len;
+      slot->seq = seq;
+      slot->inUse = TRUE;
+      pthread_cond_broadcast(&changed);
+    }
+    // Else it was delivered already (sent again after a line failed)
+    pthread_mutex_unlock(&lock);
+  }
+
+  pthread_mutex_lock(&lock);
+  line->state = (len == 0) ? LineEnded : LineDown;
+  linesUp--;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+
+  lineClose(line, TRUE);
+  return NULL;
+}
+
+
+int bondOpen(const char *ports, LinkLayer connectionParameters)
+{
+  params = connectionParameters;
+  params.adaptivePayload = FALSE;
+  memset(lines, 0, sizeof(lines));
+  memset(packets, 0, sizeof(packets));
+  nLines = 0;
+  qHead = qTail = nextSeq = 0;
+  linesUp = busyLines = 0;
+  closing = FALSE;
+
+  const char *p = ports;
+  while (*p != '\0') {
+    int len = strcspn(p, ",");
+    if (len > 0) {
+      if (nLines == BOND_MAX_LINES || len >= (int)sizeof(lines[0].port)) {
+        TRACE(TrError, "Too many ports, or a port name too long");
+        return -1;
+      }
+      memcpy(lines[nLines].port, p, len);
+      nLines++;
+    }
+    p += len + (p[len] == ',');
+  }
+
+  for (int i = 0; i < nLines; i++) {
+    Line *line = &lines[i];
+    line->state = LineOpening;
+    line->flushed = TRUE;
+    if (pthread_create(&line->thread, NULL, (params.role == LlTx) ? txLineThread : rxLineThread, line) != 0) {
+      TRACE1(TrError, "Failed to start the thread of line %lld", i + 1);
+      line->state = LineDown;
+      line->closed = TRUE;
+      continue;
+    }
+    line->started = TRUE;
+  }
+
+  // Tx stripes over the lines that connected, Rx gets going with the first one
+  pthread_mutex_lock(&lock);
+  while (TRUE) {
+    int opening = 0;
+    for (int i = 0; i < nLines; i++) {
+      opening += (lines[i].state == LineOpening);
+    }
+    if (opening == 0 || (params.role == LlRx && linesUp > 0)) {
+      break;
+    }
+    pthread_cond_wait(&changed, &lock);
+  }
+  int up = linesUp;
+  pthread_mutex_unlock(&lock);
+
+  TRACE2(TrInfo, "%lld of %lld line(s) connected", up, nLines);
+  if (up == 0) {
+    bondClose(FALSE);
+    return -1;
+  }
+  return up;
+}
+
+
+int bondMaxPayload()
+{
+  int payload = MAX_PAYLOAD_SIZE;
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < nLines; i++) {
+    if (lines[i].state == LineUp && lines[i].payload < payload) {
+      payload = lines[i].payload;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return payload - BOND_HEADER_SIZE;
+}
+
+
+// Oldest packet not acknowledged yet (nextSeq if there is none) (lock held)
+static unsigned int oldestInFlight()
+{
+  unsigned int oldest = nextSeq;
+  for (int i = 0; i < BOND_WINDOW; i++) {
+    if (packets[i].inUse && (int)(packets[i].seq - oldest) < 0) {
+      oldest = packets[i].seq;
+    }
+  }
+  return oldest;
+}
+
+
+int bondWrite(const unsigned char *head, int headSize, const unsigned char *buf, int bufSize)
+{
+  if (headSize < 0 || bufSize < 0 || headSize + bufSize <= 0 || headSize + bufSize > MAX_PAYLOAD_SIZE) {
+    return -1;
+  }
+
+  // Rx holds BOND_WINDOW packets for reordering - none may get further ahead of the oldest
+  pthread_mutex_lock(&lock);
+  while (linesUp > 0 && nextSeq - oldestInFlight() >= BOND_WINDOW) {
+    pthread_cond_wait(&changed, &lock);
+  }
+  if (linesUp == 0) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  BondPacket *packet = packets;
+  while (packet->inUse) { // There is one - the ones in flight are fewer than BOND_WINDOW
+    packet++;
+  }
+  packet->inUse = TRUE;
+  packet->seq = nextSeq++;
+  pthread_mutex_unlock(&lock);
+
+  // Only this thread has it until it is queued
+  put32(packet->data, packet->seq);
+  if (headSize > 0) {
+    memcpy(packet->data + BOND_HEADER_SIZE, head, headSize);
+  }
+  memcpy(packet->data + BOND_HEADER_SIZE + headSize, buf, bufSize);
+  packet->len = BOND_HEADER_SIZE + headSize + bufSize;
+
+  pthread_mutex_lock(&lock);
+  queue[qTail++ % BOND_WINDOW] = packet;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  return headSize + bufSize;
+}
+
+
+int bondRead(unsigned char *packet)
+{
+  BondPacket *slot = &packets[nextSeq % BOND_WINDOW];
+  int ended = FALSE;
+
+  pthread_mutex_lock(&lock);
+  while (!(slot->inUse && slot->seq == nextSeq)) {
+    // A line still connecting now never will - Tx connects them all before sending any data
+    ended = FALSE;
+    for (int i = 0; i < nLines; i++) {
+      ended |= (lines[i].state == LineEnded);
+    }
+    if (linesUp == 0) {
+      pthread_mutex_unlock(&lock);
+      return ended ? 0 : -1;
+    }
+    pthread_cond_wait(&changed, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  // Only this thread takes it out of the slot
+  int len = slot->len - BOND_HEADER_SIZE;
+  memcpy(packet, slot->data + BOND_HEADER_SIZE, len);
+
+  pthread_mutex_lock(&lock);
+  slot->inUse = FALSE;
+  nextSeq++;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  return len;
+}
+
+
+static void printLines()
+{
+  printf("\n---- Bonded lines ----\n");
+  printf("%-5s %-20s %-8s %10s %12s %8s %8s %12s\n", "line", "port", "state", "packets", "bytes", "resent", "timeouts", "bytes/s");
+  for (int i = 0; i < nLines; i++) {
+    const Line *line = &lines[i];
+    const char *state = (line->state == LineDown) ? "failed" : (line->state == LineOpening) ? "silent" : "ok";
+    if (!line->haveStats) {
+      printf("%-5d %-20s %-8s\n", i + 1, line->port, state);
+      continue;
+    }
+    const LinkLayerStats *st = &line->stats;
+    printf("%-5d %-20s %-8s %10u %12lld %8u %8u %12.0f\n", i + 1, line->port, state,
+           (st->role == LlTx) ? st->iFramesSent : st->iFramesReceived, st->dataBytes,
+           st->retransmissions, st->timeouts, st->goodput);
+  }
+}
+
+
+int bondClose(int showStatistics)
+{
+  pthread_mutex_lock(&lock);
+  closing = TRUE;
+  pthread_cond_broadcast(&changed);
+
+  // Rx: Tx disconnects the lines one by one, each once it gave up on its frames - a line
+  // still silent that long after the first one closed is left behind (its thread too)
+  long long waitUs = (params.timeoutMs > 0) ? params.timeoutMs * 1000LL
+                     : (params.timeout > 0) ? params.timeout * 1000000LL : DEFAULT_TIMEOUT_MS * 1000LL;
+  waitUs *= params.nRetransmissions + 1;
+  struct timespec deadline = {0, 0};
+  int closed;
+  while (TRUE) {
+    closed = 0;
+    for (int i = 0; i < nLines; i++) {
+      closed += lines[i].closed;
+    }
+    if (closed == nLines || params.role == LlTx) {
+      break;
+    }
+    if (closed > 0 && deadline.tv_sec == 0) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += waitUs / 1000000;
+      deadline.tv_nsec += (waitUs % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+    }
+    if (deadline.tv_sec == 0) {
+      pthread_cond_wait(&changed, &lock);
+    }
+    else if (pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < nLines; i++) {
+    Line *line = &lines[i];
+    if (!line->started) {
+      continue;
+    }
+    if (params.role == LlTx || line->closed) {
+      pthread_join(line->thread, NULL);
+    }
+    else {
+      TRACE1(TrInfo, "Line %lld never disconnected, left behind", i + 1);
+      pthread_detach(line->thread);
+    }
+  }
+
+  if (showStatistics) {
+    printLines();
+  }
+
+  int ok = FALSE;
+  if (params.role == LlTx) {
+    ok = (qHead == qTail && oldestInFlight() == nextSeq);
+  }
+  else {
+    for (int i = 0; i < nLines; i++) {
+      ok |= (lines[i].state == LineEnded);
+    }
+  }
+  return ok ? 1 : -1;
+}
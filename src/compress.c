@@ -0,0 +1,282 @@
+// Block compression implementation
+
+#include "compress.h"
+
+#include <lzma.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "link_layer.h" // TRUE/FALSE
+
+
+typedef struct {
+  const unsigned char *in; // Tx: the block, Rx: its record (in inBuf)
+  int inLen;
+  unsigned char *inBuf;    // Rx only - COMP_RECORD_MAX
+  unsigned char *out;      // Tx: record, Rx: raw data - COMP_RECORD_MAX
+  int outLen;              // -1 if it failed
+  int done;
+} CompJob;
+
+// Ring of jobs: [head, next) are being worked on, [next, tail) wait for a worker,
+// head is the oldest one (handed back first)
+static CompJob jobs[2 * COMP_MAX_WORKERS];
+static int nJobs = 0;
+static unsigned int head = 0, next = 0, tail = 0;
+
+static int method = COMP_NONE;
+static int compressing = FALSE;
+static int stopping = FALSE;
+
+static pthread_t workers[COMP_MAX_WORKERS];
+static int nWorkers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t haveWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t haveDone = PTHREAD_COND_INITIALIZER;
+
+
+static void put32(unsigned char *p, unsigned int v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+  return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+static void lzmaFilters(lzma_filter *filters, lzma_options_lzma *opt)
+{
+  lzma_lzma_preset(opt, 6);
+  opt->dict_size = COMP_BLOCK_SIZE; // Blocks are independent - a bigger dictionary only costs memory
+
+  filters[0].id = LZMA_FILTER_LZMA2;
+  filters[0].options = opt;
+  filters[1].id = LZMA_VLI_UNKNOWN;
+}
+
+
+// Compress len bytes into at most outCap bytes
+// Returns the compressed length, or 0 if it didn't fit (doesn't compress)
+static int compressBlock(const unsigned char *in, int len, unsigned char *out, int outCap)
+{
+  if (method == COMP_FAST) {
+    uLongf outLen = outCap;
+    return (compress2(out, &outLen, in, len, 1) == Z_OK) ? (int)outLen : 0;
+  }
+
+  lzma_filter filters[2];
+  lzma_options_lzma opt;
+  size_t outPos = 0;
+  lzmaFilters(filters, &opt);
+  return (lzma_raw_buffer_encode(filters, NULL, in, len, out, &outPos, outCap) == LZMA_OK) ? (int)outPos : 0;
+}
+
+
+// Decompress len bytes with the method m into exactly rawLen bytes
+// Returns -1 on error, 1 otherwise
+static int decompressBlock(int m, const unsigned char *in, int len, unsigned char *out, int rawLen)
+{
+  if (m == COMP_NONE) {
+    if (len != rawLen) {
+      return -1;
+    }
+    memcpy(out, in, len);
+    return 1;
+  }
+
+  if (m == COMP_FAST) {
+    uLongf outLen = rawLen;
+    return (uncompress(out, &outLen, in, len) == Z_OK && outLen == (uLongf)rawLen) ? 1 : -1;
+  }
+
+  if (m == COMP_HIGH) {
+    lzma_filter filters[2];
+    lzma_options_lzma opt;
+    size_t inPos = 0, outPos = 0;
+    lzmaFilters(filters, &opt);
+    return (lzma_raw_buffer_decode(filters, NULL, in, &inPos, len, out, &outPos, rawLen) == LZMA_OK &&
+            outPos == (size_t)rawLen) ? 1 : -1;
+  }
+
+  return -1;
+}
+
+
+static void runJob(CompJob *job)
+{
+  if (compressing) {
+    // Blocks that don't get smaller go raw
+    int m = method;
+    int n = compressBlock(job->in, job->inLen, job->out + COMP_RECORD_HEADER, job->inLen - 1);
+    if (n == 0) {
+      m = COMP_NONE;
+      n = job->inLen;
+      memcpy(job->out + COMP_RECORD_HEADER, job->in, n);
+    }
+    job->out[0] = m;
+    put32(job->out + 1, job->inLen);
+    put32(job->out + 5, n);
+    job->outLen = COMP_RECORD_HEADER + n;
+    return;
+  }
+
+  int rawLen = get32(job->in + 1);
+  int dataLen = get32(job->in + 5);
+  if (job->inLen < COMP_RECORD_HEADER || dataLen != job->inLen - COMP_RECORD_HEADER ||
+      rawLen <= 0 || rawLen > COMP_BLOCK_SIZE ||
+      decompressBlock(job->in[0], job->in + COMP_RECORD_HEADER, dataLen, job->out, rawLen) == -1) {
+    job->outLen = -1;
+    return;
+  }
+  job->outLen = rawLen;
+}
+
+
+static void *workerThread(void *arg)
+{
+  pthread_mutex_lock(&lock);
+  while (TRUE) {
+    while (next == tail && !stopping) {
+      pthread_cond_wait(&haveWork, &lock);
+    }
+    if (stopping) {
+      break;
+    }
+
+    CompJob *job = &jobs[next++ % nJobs];
+    pthread_mutex_unlock(&lock);
+    runJob(job);
+    pthread_mutex_lock(&lock);
+    job->done = TRUE;
+    pthread_cond_broadcast(&haveDone);
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+
+int compStart(int m, int compress)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  nWorkers = (cpus < 1) ? 1 : (cpus > COMP_MAX_WORKERS) ? COMP_MAX_WORKERS : cpus;
+  nJobs = 2 * nWorkers; // Enough to keep every worker busy while the oldest block is sent
+  method = m;
+  compressing = compress;
+  stopping = FALSE;
+  head = next = tail = 0;
+
+  for (int i = 0; i < nJobs; i++) {
+    jobs[i].out = malloc(COMP_RECORD_MAX);
+    jobs[i].inBuf = compress ? NULL : malloc(COMP_RECORD_MAX);
+    if (jobs[i].out == NULL || (!compress && jobs[i].inBuf == NULL)) {
+      printf("%s: Out of memory\n", __func__);
+      nWorkers = 0;
+      compStop();
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < nWorkers; i++) {
+    if (pthread_create(&workers[i], NULL, workerThread, NULL) != 0) {
+      printf("%s: Failed to start the worker threads\n", __func__);
+      nWorkers = i;
+      compStop();
+      return -1;
+    }
+  }
+
+  printf("%s: %d %s worker(s), method %d\n", __func__, nWorkers, compress ? "compression" : "decompression", m);
+  return 1;
+}
+
+
+int compPending()
+{
+  return tail - head;
+}
+
+
+int compFull()
+{
+  return tail - head == (unsigned int)nJobs;
+}
+
+
+int compReady()
+{
+  pthread_mutex_lock(&lock);
+  int ready = (tail != head && jobs[head % nJobs].done);
+  pthread_mutex_unlock(&lock);
+  return ready;
+}
+
+
+unsigned char *compBuffer()
+{
+  return jobs[tail % nJobs].inBuf;
+}
+
+
+void compSubmit(const unsigned char *block, int len)
+{
+  pthread_mutex_lock(&lock);
+  CompJob *job = &jobs[tail % nJobs];
+  job->in = block;
+  job->inLen = len;
+  job->done = FALSE;
+  tail++;
+  pthread_cond_signal(&haveWork);
+  pthread_mutex_unlock(&lock);
+}
+
+
+int compNext(const unsigned char **out)
+{
+  CompJob *job = &jobs[head % nJobs];
+
+  pthread_mutex_lock(&lock);
+  while (!job->done) {
+    pthread_cond_wait(&haveDone, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  *out = job->out;
+  return job->outLen;
+}
+
+
+void compRelease()
+{
+  head++;
+}
+
+
+void compStop()
+{
+  pthread_mutex_lock(&lock);
+  stopping = TRUE;
+  pthread_cond_broadcast(&haveWork);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < nWorkers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  nWorkers = 0;
+
+  for (int i = 0; i < nJobs; i++) {
+    free(jobs[i].out);
+    free(jobs[i].inBuf);
+    jobs[i].out = jobs[i].inBuf = NULL;
+  }
+  head = next = tail = 0;
+}
@@ -0,0 +1,297 @@
+// Forward error correction implementation
+
+#include "fec.h"
+
+#include <string.h>
+
+
+// GF(256) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1, by log/exp tables.
+// log(0) points past the exponentials into zeros, so a product is one lookup with no branch:
+// a * b = gfExp[gfLog[a] + gfLog[b]]
+#define GF_POLY 0x11D
+#define GF_LOG_ZERO 511
+
+static unsigned char gfExp[2 * GF_LOG_ZERO + 2];
+static unsigned short gfLog[256];
+
+// Generator polynomial of each (even) number of parity bytes, (x + a^0)(x + a^1)...(x + a^(parity - 1)),
+// as the logs of its coefficients from x^(parity - 1) down to x^0 (x^parity is 1)
+static unsigned short genLog[FEC_MAX_PARITY / 2 + 1][FEC_MAX_PARITY];
+
+__attribute__((constructor))
+static void gfInit()
+{
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gfExp[i] = gfExp[i + 255] = x;
+    gfLog[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= GF_POLY;
+    }
+  }
+  gfLog[0] = GF_LOG_ZERO; // gfExp[] is 0 from 510 on
+
+  for (int parity = 2; parity <= FEC_MAX_PARITY; parity += 2) {
+    unsigned char g[FEC_MAX_PARITY + 1] = {1}; // g[k] - coefficient of x^k
+    for (int i = 0; i < parity; i++) {
+      for (int k = i + 1; k > 0; k--) {
+        g[k] = g[k - 1] ^ gfExp[gfLog[g[k]] + i];
+      }
+      g[0] = gfExp[gfLog[g[0]] + i];
+    }
+    for (int j = 0; j < parity; j++) {
+      genLog[parity / 2][j] = gfLog[g[parity - 1 - j]];
+    }
+  }
+}
+
+static inline unsigned char gfMul(unsigned char a, unsigned char b)
+{
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static inline unsigned char gfDiv(unsigned char a, unsigned char b) // b != 0
+{
+  return gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+// a^e for any e >= 0
+static inline unsigned char gfPow(int e)
+{
+  return gfExp[e % 255];
+}
+
+
+int fecValid(int parity)
+{
+  return parity >= 0 && parity <= FEC_MAX_PARITY && parity % 2 == 0;
+}
+
+
+static int codewords(int len, int parity)
+{
+  return (len + FEC_SYMBOLS - parity - 1) / (FEC_SYMBOLS - parity);
+}
+
+int fecCodedLen(int len, int parity)
+{
+  int n = codewords(len, parity);
+  return (n > FEC_MAX_CODEWORDS) ? -1 : len + parity * n;
+}
+
+int fecFieldLen(int codedLen, int parity)
+{
+  int n = (codedLen + FEC_SYMBOLS - 1) / FEC_SYMBOLS;
+  int len = codedLen - parity * n;
+  if (parity == 0) {
+    return codedLen;
+  }
+  if (n < 1 || n > FEC_MAX_CODEWORDS || len < 1 || codewords(len, parity) != n) {
+    return -1;
+  }
+  return len;
+}
+
+
+////////////////////////////////////////////////
+// ENCODER
+////////////////////////////////////////////////
+
+void fecInit(FecEncoder *enc, int len, int parity)
+{
+  enc->parity = parity;
+  enc->codewords = (parity > 0) ? codewords(len, parity) : 0;
+  enc->next = 0;
+  for (int c = 0; c < enc->codewords; c++) {
+    memset(enc->reg[c], 0, parity);
+  }
+}
+
+// Systematic encoding - the remainder of the codeword by the generator, one division step per byte
+void fecUpdate(FecEncoder *enc, const unsigned char *data, int len)
+{
+  int parity = enc->parity;
+  if (parity == 0) {
+    return;
+  }
+  const unsigned short *g = genLog[parity / 2];
+  int c = enc->next;
+
+  for (int i = 0; i < len; i++) {
+    unsigned char *r = enc->reg[c];
+    unsigned short f = gfLog[data[i] ^ r[0]];
+    for (int j = 0; j < parity - 1; j++) {
+      r[j] = r[j + 1] ^ gfExp[f + g[j]];
+    }
+    r[parity - 1] = gfExp[f + g[parity - 1]];
+    if (++c == enc->codewords) {
+      c = 0;
+    }
+  }
+  enc->next = c;
+}
+
+void fecFinal(const FecEncoder *enc, unsigned char *out)
+{
+  for (int j = 0; j < enc->parity; j++) {
+    for (int c = 0; c < enc->codewords; c++) {
+      *out++ = enc->reg[c][j];
+    }
+  }
+}
+
+void fecEncode(unsigned char *field, int len, int parity)
+{
+  FecEncoder enc;
+  fecInit(&enc, len, parity);
+  fecUpdate(&enc, field, len);
+  fecFinal(&enc, field + len);
+}
+
+
+////////////////////////////////////////////////
+// DECODER
+////////////////////////////////////////////////
+
+// Correct one codeword of len bytes (the first one is the coefficient of x^(len - 1))
+// Returns the number of bytes corrected, or -1 if it has more errors than it corrects
+static int decodeWord(unsigned char *cw, int len, int parity)
+{
+  // Syndromes - the codeword at each root of the generator, a^i (all 0 if it has no errors)
+  unsigned char s[FEC_MAX_PARITY] = {0};
+  unsigned char any = 0;
+  for (int r = 0; r < len; r++) {
+    for (int i = 0; i < parity; i++) {
+      s[i] = gfExp[gfLog[s[i]] + i] ^ cw[r];
+    }
+  }
+  for (int i = 0; i < parity; i++) {
+    any |= s[i];
+  }
+  if (any == 0) {
+    return 0;
+  }
+
+  // Berlekamp-Massey - the error locator, lambda(x) = (1 + X_1 x)(1 + X_2 x)... with X = a^(error degree)
+  unsigned char lambda[FEC_MAX_PARITY + 1] = {1}, prev[FEC_MAX_PARITY + 1] = {1}, t[FEC_MAX_PARITY + 1];
+  unsigned char b = 1;
+  int errors = 0, m = 1;
+  for (int n = 0; n < parity; n++) {
+    unsigned char d = s[n];
+    for (int i = 1; i <= errors; i++) {
+      d ^= gfMul(lambda[i], s[n - i]);
+    }
+    if (d == 0) {
+      m++;
+      continue;
+    }
+    unsigned char coef = gfDiv(d, b);
+    memcpy(t, lambda, sizeof(t));
+    for (int i = 0; i + m <= parity; i++) {
+      lambda[i + m] ^= gfMul(coef, prev[i]);
+    }
+    if (2 * errors <= n) {
+      errors = n + 1 - errors;
+      memcpy(prev, t, sizeof(prev));
+      b = d;
+      m = 1;
+    }
+    else {
+      m++;
+    }
+  }
+  if (2 * errors > parity) {
+    return -1;
+  }
+
+  // Error evaluator, omega(x) = s(x) lambda(x) mod x^parity
+  unsigned char omega[FEC_MAX_PARITY] = {0};
+  for (int k = 0; k < parity; k++) {
+    for (int i = 0; i <= errors && i <= k; i++) {
+      omega[k] ^= gfMul(lambda[i], s[k - i]);
+    }
+  }
+
+  // Chien search - the roots of lambda among the degrees the codeword has - and Forney:
+  // the error at X is X omega(1/X) / lambda'(1/X)
+  int pos[FEC_MAX_PARITY / 2];
+  unsigned char mag[FEC_MAX_PARITY / 2];
+  int found = 0;
+  for (int deg = 0; deg < len && found < errors; deg++) {
+    int inv = 255 - deg; // log of 1/X
+    unsigned char v = 0;
+    for (int i = 0; i <= errors; i++) {
+      v ^= gfMul(lambda[i], gfPow(inv * i));
+    }
+    if (v != 0) {
+      continue;
+    }
+
+    unsigned char num = 0, den = 0;
+    for (int k = 0; k < parity; k++) {
+      num ^= gfMul(omega[k], gfPow(inv * k));
+    }
+    for (int i = 1; i <= errors; i += 2) { // Only the odd terms survive the derivative
+      den ^= gfMul(lambda[i], gfPow(inv * (i - 1)));
+    }
+    if (den == 0) {
+      return -1;
+    }
+    pos[found] = len - 1 - deg;
+    mag[found] = gfMul(gfPow(deg), gfDiv(num, den));
+    found++;
+  }
+  if (found != errors) { // Roots outside the codeword - too many errors
+    return -1;
+  }
+
+  for (int i = 0; i < found; i++) {
+    cw[pos[i]] ^= mag[i];
+  }
+  return found;
+}
+
+
+int fecDecode(unsigned char *coded, int codedLen, int parity)
+{
+  int len = fecFieldLen(codedLen, parity);
+  if (len < 0) {
+    return -1;
+  }
+  if (parity == 0) {
+    return 0;
+  }
+
+  int n = codewords(len, parity);
+  int corrected = 0;
+  unsigned char cw[FEC_SYMBOLS];
+
+  for (int c = 0; c < n; c++) {
+    // Gather the codeword - its field bytes, then its parity bytes
+    int k = 0;
+    for (int i = c; i < len; i += n) {
+      cw[k++] = coded[i];
+    }
+    for (int j = 0; j < parity; j++) {
+      cw[k + j] = coded[len + j * n + c];
+    }
+
+    int ret = decodeWord(cw, k + parity, parity);
+    if (ret == -1) {
+      return -1;
+    }
+    if (ret > 0) {
+      k = 0;
+      for (int i = c; i < len; i += n) {
+        coded[i] = cw[k++];
+      }
+      for (int j = 0; j < parity; j++) {
+        coded[len + j * n + c] = cw[k + j];
+      }
+      corrected += ret;
+    }
+  }
+
+  return corrected;
+}
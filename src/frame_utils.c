@@ -1,5 +1,12 @@
 #include "frame_utils.h"
 
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 
 unsigned int funcI_BCC2(const unsigned char *arr, int len)
 {
@@ -23,3 +30,728 @@ void prepSU(unsigned char *buf, unsigned char addr, unsigned char ctrl)
   buf[4] = SU_Flag;
 }
 
+
+
+int seqFromI(unsigned char ctrl)
+{
+  if (ctrl == I_C0) return 0;
+  if (ctrl == I_C1) return 1;
+  if (IS_I_CX(ctrl)) return (ctrl >> 3) & 0x07;
+  return -1;
+}
+
+
+int seqFromRR(unsigned char ctrl)
+{
+  if (ctrl == SU_C_RR0) return 0;
+  if (ctrl == SU_C_RR1) return 1;
+  if ((ctrl & 0xF8) == SU_C_RRX(0)) return ctrl & 0x07;
+  return -1;
+}
+
+
+int seqFromREJ(unsigned char ctrl)
+{
+  if (ctrl == SU_C_REJ0) return 0;
+  if (ctrl == SU_C_REJ1) return 1;
+  if ((ctrl & 0xF8) == SU_C_REJX(0)) return ctrl & 0x07;
+  return -1;
+}
+
+
+int seqFromSREJ(unsigned char ctrl)
+{
+  if (ctrl == SU_C_SREJ0) return 0;
+  if (ctrl == SU_C_SREJ1) return 1;
+  if ((ctrl & 0xF8) == SU_C_SREJX(0)) return ctrl & 0x07;
+  return -1;
+}
+
+
+int seqFromIA(unsigned char ctrl)
+{
+  return IS_I_CXA(ctrl) ? (ctrl >> 3) & 0x07 : -1;
+}
+
+
+int ackFromIA(unsigned char ctrl)
+{
+  return IS_I_CXA(ctrl) ? ctrl & 0x07 : -1;
+}
+
+
+////////////////////////////////////////////////
+// BYTE STUFFING KERNELS
+// All of them copy the runs without special bytes in bulk and only fall back to
+// byte-by-byte escaping around I_Flag/STUFF_ESC
+////////////////////////////////////////////////
+
+int stuffBytesScalar(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2)
+{
+  unsigned char acc = *bcc2;
+  int j = 0;
+
+  for (int i = 0; i < len; i++) {
+    acc ^= src[i];
+    if (src[i] == I_Flag || src[i] == STUFF_ESC) {
+      dst[j++] = STUFF_ESC;
+      dst[j++] = STUFF_MASK(src[i]);
+    }
+    else {
+      dst[j++] = src[i];
+    }
+  }
+
+  *bcc2 = acc;
+  return j;
+}
+
+
+// Does the word have a byte equal to the one repeated in pattern? (classic "has zero byte" trick)
+#define ONES_64 0x0101010101010101ULL
+#define HIGHS_64 0x8080808080808080ULL
+#define HAS_BYTE_64(w, pattern) ((((w) ^ (pattern)) - ONES_64) & ~((w) ^ (pattern)) & HIGHS_64)
+
+int stuffBytesWord(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2)
+{
+  const uint64_t flags = ONES_64 * I_Flag;
+  const uint64_t escs = ONES_64 * STUFF_ESC;
+  uint64_t acc = 0;
+  int i = 0, j = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, src + i, 8);
+    acc ^= w;
+
+    if (!(HAS_BYTE_64(w, flags) | HAS_BYTE_64(w, escs))) {
+      memcpy(dst + j, &w, 8);
+      j += 8;
+      continue;
+    }
+
+    for (int k = i; k < i + 8; k++) {
+      if (src[k] == I_Flag || src[k] == STUFF_ESC) {
+        dst[j++] = STUFF_ESC;
+        dst[j++] = STUFF_MASK(src[k]);
+      }
+      else {
+        dst[j++] = src[k];
+      }
+    }
+  }
+
+  // Fold the word into a byte
+  acc ^= acc >> 32;
+  acc ^= acc >> 16;
+  acc ^= acc >> 8;
+  *bcc2 ^= (unsigned char)acc;
+
+  return j + stuffBytesScalar(dst + j, src + i, len - i, bcc2);
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// XOR of the 16 (or 32) bytes of a vector accumulator
+__attribute__((target("sse2")))
+static inline unsigned char xorFold128(__m128i acc)
+{
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+  acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+  return (unsigned char)_mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned char xorFold256(__m256i acc)
+{
+  return xorFold128(_mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+// Blocks with special bytes are copied in pieces with unaligned vector stores that
+// may write past the piece - the following stores overwrite that garbage. Only used
+// while 2 blocks remain, so that loads stay inside src and stores inside dst.
+
+#define STUFF_DENSE_BLOCK 4 // Blocks with more special bytes than this are stuffed byte by byte
+
+// Byte by byte stuffing, without the BCC2 (the vector kernels already have it)
+static inline int stuffBytesDense(unsigned char *dst, const unsigned char *src, int len)
+{
+  int j = 0;
+  for (int i = 0; i < len; i++) {
+    if (src[i] == I_Flag || src[i] == STUFF_ESC) {
+      dst[j++] = STUFF_ESC;
+      dst[j++] = STUFF_MASK(src[i]);
+    }
+    else {
+      dst[j++] = src[i];
+    }
+  }
+  return j;
+}
+
+// 16 special bytes - every one becomes STUFF_ESC followed by the masked byte
+__attribute__((target("sse2")))
+static inline void stuffAllSpecial16(unsigned char *dst, __m128i v)
+{
+  const __m128i escs = _mm_set1_epi8((char)STUFF_ESC);
+  __m128i masked = _mm_xor_si128(v, _mm_set1_epi8(STUFF_MASK(0)));
+  _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(escs, masked));
+  _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi8(escs, masked));
+}
+
+
+__attribute__((target("sse2")))
+int stuffBytesSSE2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2)
+{
+  const __m128i flags = _mm_set1_epi8((char)I_Flag);
+  const __m128i escs = _mm_set1_epi8((char)STUFF_ESC);
+  __m128i acc = _mm_setzero_si128();
+  int i = 0, j = 0;
+
+  for (; i + 32 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    acc = _mm_xor_si128(acc, v);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flags), _mm_cmpeq_epi8(v, escs)));
+
+    if (mask == 0) {
+      _mm_storeu_si128((__m128i *)(dst + j), v);
+      j += 16;
+      continue;
+    }
+
+    if (mask == 0xFFFF) {
+      stuffAllSpecial16(dst + j, v);
+      j += 32;
+      continue;
+    }
+    if (__builtin_popcount(mask) > STUFF_DENSE_BLOCK) { // Mostly special bytes - piecewise copies don't pay off
+      j += stuffBytesDense(dst + j, src + i, 16);
+      continue;
+    }
+
+    int prev = 0;
+    while (mask) {
+      int pos = __builtin_ctz(mask);
+      mask &= mask - 1;
+      _mm_storeu_si128((__m128i *)(dst + j), _mm_loadu_si128((const __m128i *)(src + i + prev)));
+      j += pos - prev;
+      dst[j++] = STUFF_ESC;
+      dst[j++] = STUFF_MASK(src[i + pos]);
+      prev = pos + 1;
+    }
+    _mm_storeu_si128((__m128i *)(dst + j), _mm_loadu_si128((const __m128i *)(src + i + prev)));
+    j += 16 - prev;
+  }
+
+  *bcc2 ^= xorFold128(acc);
+
+  return j + stuffBytesWord(dst + j, src + i, len - i, bcc2);
+}
+
+
+__attribute__((target("avx2")))
+int stuffBytesAVX2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2)
+{
+  const __m256i flags = _mm256_set1_epi8((char)I_Flag);
+  const __m256i escs = _mm256_set1_epi8((char)STUFF_ESC);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0, j = 0;
+
+  for (; i + 64 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    acc = _mm256_xor_si256(acc, v);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flags), _mm256_cmpeq_epi8(v, escs)));
+
+    if (mask == 0) {
+      _mm256_storeu_si256((__m256i *)(dst + j), v);
+      j += 32;
+      continue;
+    }
+
+    if (mask == 0xFFFFFFFF) {
+      stuffAllSpecial16(dst + j, _mm256_castsi256_si128(v));
+      stuffAllSpecial16(dst + j + 32, _mm256_extracti128_si256(v, 1));
+      j += 64;
+      continue;
+    }
+    if (__builtin_popcount(mask) > STUFF_DENSE_BLOCK) { // Mostly special bytes - piecewise copies don't pay off
+      j += stuffBytesDense(dst + j, src + i, 32);
+      continue;
+    }
+
+    int prev = 0;
+    while (mask) {
+      int pos = __builtin_ctz(mask);
+      mask &= mask - 1;
+      _mm256_storeu_si256((__m256i *)(dst + j), _mm256_loadu_si256((const __m256i *)(src + i + prev)));
+      j += pos - prev;
+      dst[j++] = STUFF_ESC;
+      dst[j++] = STUFF_MASK(src[i + pos]);
+      prev = pos + 1;
+    }
+    _mm256_storeu_si256((__m256i *)(dst + j), _mm256_loadu_si256((const __m256i *)(src + i + prev)));
+    j += 32 - prev;
+  }
+
+  *bcc2 ^= xorFold256(acc);
+
+  return j + stuffBytesWord(dst + j, src + i, len - i, bcc2);
+}
+
+#endif
+
+
+static StuffFn currStuffKernel = NULL;
+static const char *currStuffKernelName = NULL;
+
+StuffFn stuffKernel(const char **name)
+{
+  if (currStuffKernel == NULL) {
+    currStuffKernel = stuffBytesWord;
+    currStuffKernelName = "word";
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      currStuffKernel = stuffBytesAVX2;
+      currStuffKernelName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+      currStuffKernel = stuffBytesSSE2;
+      currStuffKernelName = "sse2";
+    }
+#endif
+  }
+
+  if (name != NULL) {
+    *name = currStuffKernelName;
+  }
+  return currStuffKernel;
+}
+
+
+int stuffBytes(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc2)
+{
+  return stuffKernel(NULL)(dst, src, len, bcc2);
+}
+
+
+
+////////////////////////////////////////////////
+// DESTUFFING KERNELS
+// The runs without special bytes are copied (and XORed) in bulk by a copyRun
+// function, the core only deals with escapes, the closing flag and the spill
+////////////////////////////////////////////////
+
+typedef int (*CopyRunFn)(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc);
+
+// Same for a run of escaped bytes (STUFF_ESC, byte, STUFF_ESC, byte...) - len is in src bytes
+// Returns how many src bytes were used (the output is half of that), may stop early
+typedef int (*EscRunFn)(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc);
+
+// Copy bytes up to the first special one (at most len), XORing them into *bcc
+// Returns how many were copied
+static inline int copyRunScalar(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc)
+{
+  unsigned char acc = *bcc;
+  int i = 0;
+
+  while (i < len && src[i] != I_Flag && src[i] != STUFF_ESC) {
+    acc ^= src[i];
+    dst[i] = src[i];
+    i++;
+  }
+
+  *bcc = acc;
+  return i;
+}
+
+
+static inline __attribute__((always_inline))
+int destuffCore(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen,
+                DestuffState *state, int *frameEnd, CopyRunFn copyRun, EscRunFn escRun)
+{
+  // Working copies, so that the stores to dst don't force them back to memory
+  int len = state->len;
+  int escaped = state->escaped;
+  unsigned char bcc = state->bcc;
+  int i = 0;
+
+  *frameEnd = 0;
+  while (i < srcLen) {
+    unsigned char byte = src[i];
+
+    if (byte == I_Flag) { // End of frame (even right after STUFF_ESC)
+      *frameEnd = 1;
+      i++;
+      break;
+    }
+    if (byte == STUFF_ESC && !escaped) {
+      if (escRun != NULL) {
+        int room = 2 * (dstCap - len);
+        int used = escRun(dst + len, src + i, (srcLen - i < room) ? srcLen - i : room, &bcc);
+        if (used > 0) {
+          len += used / 2;
+          i += used;
+          continue;
+        }
+      }
+      escaped = 1;
+      i++;
+      continue;
+    }
+
+    if (escaped || len >= dstCap) { // Single byte - escaped, or past dstCap (only the FCS may still fit, in the spill)
+      byte = escaped ? STUFF_MASK(byte) : byte;
+      if (len < dstCap) {
+        dst[len] = byte;
+      }
+      else if (len < dstCap + DESTUFF_SPILL_SIZE) {
+        state->spill[len - dstCap] = byte;
+      }
+      len++;
+      bcc ^= byte;
+      escaped = 0;
+      i++;
+      continue;
+    }
+
+    int room = dstCap - len;
+    int run = copyRun(dst + len, src + i, (srcLen - i < room) ? srcLen - i : room, &bcc);
+    len += run;
+    i += run;
+  }
+
+  state->len = len;
+  state->escaped = escaped;
+  state->bcc = bcc;
+  return i;
+}
+
+
+int destuffBytesScalar(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd)
+{
+  return destuffCore(dst, dstCap, src, srcLen, state, frameEnd, copyRunScalar, NULL);
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// Vector blocks are only stored whole, so nothing is written past len (dst may be the caller's packet)
+
+__attribute__((target("sse2")))
+static inline int copyRunSSE2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc)
+{
+  const __m128i flags = _mm_set1_epi8((char)I_Flag);
+  const __m128i escs = _mm_set1_epi8((char)STUFF_ESC);
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flags), _mm_cmpeq_epi8(v, escs)))) {
+      break;
+    }
+    acc = _mm_xor_si128(acc, v);
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+
+  *bcc ^= xorFold128(acc);
+
+  return i + copyRunScalar(dst + i, src + i, len - i, bcc);
+}
+
+
+__attribute__((target("avx2")))
+static inline int copyRunAVX2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc)
+{
+  const __m256i flags = _mm256_set1_epi8((char)I_Flag);
+  const __m256i escs = _mm256_set1_epi8((char)STUFF_ESC);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flags), _mm256_cmpeq_epi8(v, escs)))) {
+      break;
+    }
+    acc = _mm256_xor_si256(acc, v);
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+
+  *bcc ^= xorFold256(acc);
+
+  return i + copyRunSSE2(dst + i, src + i, len - i, bcc);
+}
+
+
+// 32 bytes made of 16 (STUFF_ESC, byte) pairs become 16 bytes: the odd ones, unmasked
+__attribute__((target("sse2")))
+static inline int escRunSSE2(unsigned char *dst, const unsigned char *src, int len, unsigned char *bcc)
+{
+  const __m128i flags = _mm_set1_epi8((char)I_Flag);
+  const __m128i escs = _mm_set1_epi8((char)STUFF_ESC);
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+    unsigned int escMask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, escs)) | (_mm_movemask_epi8(_mm_cmpeq_epi8(b, escs)) << 16);
+    unsigned int flagMask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, flags)) | (_mm_movemask_epi8(_mm_cmpeq_epi8(b, flags)) << 16);
+    if ((escMask & 0x55555555) != 0x55555555 || (flagMask & 0xAAAAAAAA) != 0) {
+      break;
+    }
+
+    __m128i out = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    out = _mm_xor_si128(out, _mm_set1_epi8(STUFF_MASK(0)));
+    acc = _mm_xor_si128(acc, out);
+    _mm_storeu_si128((__m128i *)(dst + i / 2), out);
+  }
+
+  *bcc ^= xorFold128(acc);
+
+  return i;
+}
+
+
+__attribute__((target("sse2")))
+int destuffBytesSSE2(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd)
+{
+  return destuffCore(dst, dstCap, src, srcLen, state, frameEnd, copyRunSSE2, escRunSSE2);
+}
+
+
+__attribute__((target("avx2")))
+int destuffBytesAVX2(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd)
+{
+  return destuffCore(dst, dstCap, src, srcLen, state, frameEnd, copyRunAVX2, escRunSSE2);
+}
+
+#endif
+
+
+static DestuffFn currDestuffKernel = NULL;
+static const char *currDestuffKernelName = NULL;
+
+DestuffFn destuffKernel(const char **name)
+{
+  if (currDestuffKernel == NULL) {
+    currDestuffKernel = destuffBytesScalar;
+    currDestuffKernelName = "scalar";
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      currDestuffKernel = destuffBytesAVX2;
+      currDestuffKernelName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+      currDestuffKernel = destuffBytesSSE2;
+      currDestuffKernelName = "sse2";
+    }
+#endif
+  }
+
+  if (name != NULL) {
+    *name = currDestuffKernelName;
+  }
+  return currDestuffKernel;
+}
+
+
+int destuffBytes(unsigned char *dst, int dstCap, const unsigned char *src, int srcLen, DestuffState *state, int *frameEnd)
+{
+  return destuffKernel(NULL)(dst, dstCap, src, srcLen, state, frameEnd);
+}
+
+
+void destuffTail(const unsigned char *dst, int dstCap, const DestuffState *state, int n, unsigned char *out)
+{
+  for (int k = 0; k < n; k++) {
+    int pos = state->len - n + k;
+    out[k] = (pos < dstCap) ? dst[pos] : state->spill[pos - dstCap];
+  }
+}
+
+
+
+////////////////////////////////////////////////
+// FRAME CHECK SEQUENCE
+////////////////////////////////////////////////
+
+#define CRC16_POLY 0x1021
+#define CRC32C_POLY 0x82F63B78 // Reflected
+
+// Slicing-by-8 tables - table[k][b] is the CRC of byte b followed by k zero bytes
+static unsigned short crc16Table[8][256];
+static unsigned int crc32cTable[8][256];
+static unsigned int (*crc32cKernel)(unsigned int crc, const unsigned char *data, int len) = crc32cSlice8;
+
+__attribute__((constructor))
+static void crcInit()
+{
+  for (int b = 0; b < 256; b++) {
+    unsigned short c16 = b << 8;
+    unsigned int c32 = b;
+    for (int bit = 0; bit < 8; bit++) {
+      c16 = (c16 & 0x8000) ? (c16 << 1) ^ CRC16_POLY : (c16 << 1);
+      c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : (c32 >> 1);
+    }
+    crc16Table[0][b] = c16;
+    crc32cTable[0][b] = c32;
+  }
+
+  for (int k = 1; k < 8; k++) {
+    for (int b = 0; b < 256; b++) {
+      unsigned short c16 = crc16Table[k - 1][b];
+      crc16Table[k][b] = (c16 << 8) ^ crc16Table[0][c16 >> 8];
+      unsigned int c32 = crc32cTable[k - 1][b];
+      crc32cTable[k][b] = (c32 >> 8) ^ crc32cTable[0][c32 & 0xFF];
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32cKernel = crc32cHw;
+  }
+#endif
+}
+
+
+unsigned short crc16Bytewise(unsigned short crc, const unsigned char *data, int len)
+{
+  for (int i = 0; i < len; i++) {
+    crc = (crc << 8) ^ crc16Table[0][(crc >> 8) ^ data[i]];
+  }
+
+  return crc;
+}
+
+
+unsigned short crc16(unsigned short crc, const unsigned char *data, int len)
+{
+  int i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    const unsigned char *p = data + i;
+    crc = crc16Table[7][(crc >> 8) ^ p[0]] ^ crc16Table[6][(crc & 0xFF) ^ p[1]] ^
+          crc16Table[5][p[2]] ^ crc16Table[4][p[3]] ^ crc16Table[3][p[4]] ^
+          crc16Table[2][p[5]] ^ crc16Table[1][p[6]] ^ crc16Table[0][p[7]];
+  }
+
+  for (; i < len; i++) {
+    crc = (crc << 8) ^ crc16Table[0][(crc >> 8) ^ data[i]];
+  }
+
+  return crc;
+}
+
+
+unsigned int crc32cSlice8(unsigned int crc, const unsigned char *data, int len)
+{
+  int i = 0;
+
+  crc = ~crc;
+
+  for (; i + 8 <= len; i += 8) {
+    const unsigned char *p = data + i;
+    unsigned int one = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+    crc = crc32cTable[7][one & 0xFF] ^ crc32cTable[6][(one >> 8) & 0xFF] ^
+          crc32cTable[5][(one >> 16) & 0xFF] ^ crc32cTable[4][one >> 24] ^
+          crc32cTable[3][p[4]] ^ crc32cTable[2][p[5]] ^
+          crc32cTable[1][p[6]] ^ crc32cTable[0][p[7]];
+  }
+
+  for (; i < len; i++) {
+    crc = (crc >> 8) ^ crc32cTable[0][(crc ^ data[i]) & 0xFF];
+  }
+
+  return ~crc;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+unsigned int crc32cHw(unsigned int crc32, const unsigned char *data, int len)
+{
+  int i = 0;
+  crc32 = ~crc32;
+#ifdef __x86_64__
+  unsigned long long crc = crc32;
+  for (; i + 8 <= len; i += 8) {
+    unsigned long long word;
+    memcpy(&word, data + i, 8);
+    crc = _mm_crc32_u64(crc, word);
+  }
+  crc32 = (unsigned int)crc;
+#else
+  for (; i + 4 <= len; i += 4) {
+    unsigned int word;
+    memcpy(&word, data + i, 4);
+    crc32 = _mm_crc32_u32(crc32, word);
+  }
+#endif
+
+  for (; i < len; i++) {
+    crc32 = _mm_crc32_u8(crc32, data[i]);
+  }
+
+  return ~crc32;
+}
+#endif
+
+
+unsigned int crc32c(unsigned int crc, const unsigned char *data, int len)
+{
+  return crc32cKernel(crc, data, len);
+}
+
+
+int fcsLen(int fcs)
+{
+  switch (fcs) {
+    case FCS_CRC16:
+      return 2;
+    case FCS_CRC32C:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+
+unsigned int fcsInit(int fcs)
+{
+  return (fcs == FCS_CRC16) ? CRC16_INIT : (fcs == FCS_CRC32C) ? CRC32C_INIT : 0;
+}
+
+
+unsigned int fcsUpdate(int fcs, unsigned int acc, const unsigned char *data, int len)
+{
+  switch (fcs) {
+    case FCS_CRC16:
+      return crc16(acc, data, len);
+    case FCS_CRC32C:
+      return crc32c(acc, data, len);
+    default:
+      return acc ^ funcI_BCC2(data, len);
+  }
+}
+
+
+void fcsFinal(int fcs, unsigned int acc, unsigned char *out)
+{
+  for (int i = fcsLen(fcs) - 1; i >= 0; i--) {
+    out[i] = acc;
+    acc >>= 8;
+  }
+}
+
+
+void fcsCompute(int fcs, const unsigned char *data, int len, unsigned char *out)
+{
+  fcsFinal(fcs, fcsUpdate(fcs, fcsInit(fcs), data, len), out);
+}
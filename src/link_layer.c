@@ -1,14 +1,17 @@
 // Link layer protocol implementation
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 
 #include "link_layer.h"
 #include "serial_port.h"
+#include "timer.h"
+#include "trace.h"
 
+#include "fec.h"
 #include "frame_utils.h"
 
 
@@ -16,29 +19,197 @@
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
 
+static void statAnalysis();
+static int writeFrame(const unsigned char *buf, int len);
+static long long lineBusyUs();
+static int writeSU(unsigned char addr, unsigned char ctrl);
+static int readSU(unsigned char *buf, unsigned char addr, int timed);
+static int waitSU(unsigned char addr, unsigned char ctrl);
+
+// Frame received by readI()
+typedef struct {
+  unsigned char addr;
+  unsigned char ctrl;
+  unsigned char *data; // Where the payload was destuffed to (see rxFrameDest())
+  int dataLen;         // Payload length, -1 for SU frames
+  int bcc2Ok;
+  long long flagNs;    // When its opening flag arrived (see trace.h)
+  long long doneNs;    // When its closing flag arrived
+} RxFrame;
+
+// How long readI() and duplexRead() wait for a frame - once one is arriving, all but
+// ReadBlock wait for the rest of it up to an RTO, whatever the timers say
+typedef enum {
+  ReadBlock, // Until one arrives
+  ReadTimed, // Until a timer expires
+  ReadPoll,  // Only for a frame already arriving
+  ReadLine,  // duplexRead(): like ReadTimed, but keeps the RR owed for the I frame about to go
+} ReadWait;
+
+static int readI(unsigned char *packet, RxFrame *frame, ReadWait wait);
+static int rxIFrame(RxFrame *frame, unsigned char *packet);
+static int duplexRead(unsigned char *packet, ReadWait wait, int *len);
+static int waitDisc();
+static void ackRx();
+static void flushAck();
+static unsigned char *frameHeader(unsigned char *body, unsigned char addr, unsigned char ctrl);
+static int frameBody(unsigned char *body, const unsigned char *head, int headLen,
+                     const unsigned char *data, int len, int fcs, int parity);
+static int writeParams(unsigned char ctrl, const unsigned char *params, int len);
+static int writeUA();
+static int findParam(const unsigned char *params, int len, unsigned char type, const unsigned char **value);
+static int waitAck();
+static int txAck(unsigned char ctrl);
+static int txTimeout();
+static int resendFrames(unsigned int first, unsigned int last);
+static void ackFrames(unsigned int next);
+static void rttSample(long long rttUs);
+static void rtoBackoff();
+static int allocBuffers(int payload, int slots);
+static void freeBuffers();
+static void adaptPayload();
+static double adaptOverheadBits();
+
+
 // ? For role distinction (for easier access, and MAINLY FOR llclose() -> why isn't it in the arguments???)
-static LinkLayerRole currRole;
+static __thread LinkLayerRole currRole;
 // ? For tracking the maximum number of retransmissions during the protocol (IS IT NEEDED?)
-static int currRetransmissions;
+static __thread int currRetransmissions;
+
+// Sliding window (Go-Back-N or Selective Repeat) - a window of 1 is plain Stop-and-Wait
+static __thread int windowSize = 1;
+static __thread int selRepeat = FALSE;
+static __thread int seqMod = SEQ_MOD_SW; // Sequence number modulus in use (Rx learns it from the I frames)
+
+// Full duplex - Rx sends I frames too, and each I frame acknowledges the other side's (see I_CXA)
+static __thread int duplex = FALSE;
+static __thread unsigned char txAddr = I_Addr_TX; // Our I frames, and the RR/REJ/SREJ answering them
+static __thread unsigned char rxAddr = I_Addr_TX; // The other side's I frames, and our answers
+static __thread int ackPending = FALSE;           // An RR owed - it goes with our next I frame (see flushAck())
+
+// Negotiated in llopen
+static __thread int fcsType = FCS_XOR;           // Check sequence of the I frames (SET/UA parameters always use BCC2)
+static __thread unsigned char uaParams[PARAMS_MAX_LEN]; // What Rx agreed to - sent again if Tx repeats SET (UA lost)
+static __thread int uaParamsLen = 0;             // 0 = plain UA
+static __thread unsigned char rxAnswer[MAX_ANSWER_SIZE]; // Rx: what llanswer() left for the POLL of Tx
+static __thread int rxAnswerLen = 0;             // 0 = nothing to answer yet
+static __thread int payloadSize = DEFAULT_PAYLOAD_SIZE; // Largest payload of an I frame (both ends take it)
+static __thread int fecParity = 0;               // Reed-Solomon parity bytes per codeword of the I frames (0 = no FEC, see fec.h)
+
+// Adaptive payload size (Tx) - frames are cut to txPayload, re-estimated every ADAPT_FRAMES frames
+static __thread int adaptive = FALSE;
+static __thread int txPayload = DEFAULT_PAYLOAD_SIZE;
+static __thread unsigned int adaptFrames = 0;  // Frames acknowledged since the last update
+static __thread unsigned int adaptErrors = 0;  // Losses (REJ, SREJ, timeouts) since the last update
+static __thread unsigned int adaptSent = 0;    // Frames sent (or resent) since the last update
+static __thread long long adaptWireBytes = 0;  // Their size on the wire
+static __thread double adaptLoss = 0;          // Smoothed -ln(1 - p) of a bit, p = bit error rate
+
+// Frame buffers - allocated in llopen for the largest payload this end takes
+static __thread int bufPayload = 0;
+static __thread unsigned char *txFrameBuf = NULL; // MAX_WINDOW_SIZE stuffed frames kept for retransmission
+static __thread unsigned char *rxBuf = NULL;      // Scratch for frames that are discarded anyway
+static __thread unsigned char *rxSlotBuf = NULL;  // SEQ_MOD_EXT reorder slots (Selective Repeat, full duplex)
+static __thread unsigned char *rxFecBuf = NULL;   // FEC: coded data field of the I frame being read, corrected there first
+static __thread int rxFecCap = 0;
+
+// Room for a stuffed I frame with up to n bytes of payload, FEC parity included
+#define TX_FRAME_SIZE(n) (2 * FEC_MAX_LEN((n) + FCS_MAX_LEN) + I_HDR_MAX + 1)
+
+// Tx window - frame numbers are absolute, only their (% seqMod) goes on the wire
+static __thread unsigned int txBase = 0; // Oldest frame not yet acknowledged
+static __thread unsigned int txNext = 0; // Next frame to be sent
+static __thread int txFrameLen[MAX_WINDOW_SIZE];
+
+// Rx state
+static __thread unsigned int rxExpected = 0; // Next frame missing (everything before it was acknowledged)
+static __thread unsigned int rxDeliver = 0;  // Next frame to be delivered to the application (Selective Repeat may hold some back)
+static __thread int rejSent = FALSE;         // Go-Back-N only REJects the first frame after a gap
+static __thread int rxPastGap = FALSE;       // Tx was seen sending rxExpected or after it, since it was last in sequence
+static __thread int discReceived = FALSE;    // DISC may arrive during llread()
+
+// Selective Repeat reorder buffer - frames after a gap are destuffed straight into the slot of their sequence number
+static __thread int rxSlotLen[SEQ_MOD_EXT];
+static __thread int rxHave[SEQ_MOD_EXT];   // Slot holds a valid frame not yet delivered
+static __thread int srejSent[SEQ_MOD_EXT]; // Frame already asked for with SREJ
+
+// for stats (llclose(), llstats())
+static __thread LinkLayerStats stats;
+static __thread long long openedAt = 0; // llopen
+static __thread long long closedAt = 0; // llclose (0 while the connection is open)
+
+// Retransmission timers (see timer.h) - one per Tx window slot, plus one for SET/DISC/UA
+#define TIMER_CTRL MAX_WINDOW_SIZE
+#define TIMER_LINE (MAX_WINDOW_SIZE + 1) // Full duplex: the line is done with our last frame (see llwritev())
+static __thread long long timeoutUs = DEFAULT_TIMEOUT_MS * 1000LL; // Configured - the RTO until the first RTT sample
+static __thread int txTimeouts[MAX_WINDOW_SIZE]; // Consecutive timeouts of the frame in each slot
+
+// Retransmission timeout from the measured round-trip times (Jacobson/Karels, as in RFC 6298)
+static __thread long long rtoUs = DEFAULT_TIMEOUT_MS * 1000LL;
+static __thread long long srttUs = 0;   // Smoothed RTT
+static __thread long long rttvarUs = 0; // RTT mean deviation
+static __thread unsigned int rttSamples = 0;
+static __thread long long txSentAt[MAX_WINDOW_SIZE]; // When the frame in each slot was first sent
+static __thread int txResent[MAX_WINDOW_SIZE];       // Karn's rule - a retransmitted frame gives no RTT sample
+
+// A frame only leaves the line once everything written before it has, so timers and RTT
+// samples count from when the line will be done with it (10 bits per byte at the baud rate)
+static __thread long long byteNs = 0;     // Time to send a byte
+static __thread long long lineFreeNs = 0; // When the line will have sent everything written so far
+static __thread long long rxReadNs = 0;   // When readI() last took a chunk of the serial port (see arrivedNs())
+
+
+// Control fields in the numbering currently in use
+// (full duplex I frames acknowledge everything received so far - rebuilt for every retransmission,
+// so the acknowledgements the other side sees never go back)
+static unsigned char ctrlI(unsigned int n)
+{
+  if (duplex) {
+    return I_CXA(n, rxExpected);
+  }
+  return (seqMod == SEQ_MOD_SW) ? I_C(n) : I_CX(n);
+}
+
+static unsigned char ctrlRR(unsigned int n)
+{
+  return (seqMod == SEQ_MOD_SW) ? SU_C_RR(n) : SU_C_RRX(n);
+}
 
-// for stats (llclose())
-static unsigned int frameCount = 0;
-static unsigned int retransmissionCount = 0;
-static unsigned int timeoutCount = 0; // ?? Não terá a mesma contagem que retransmissionCount, já que de cada vez que ocorre um timeout de leitura de resposta, ocorre uma retransmission ??
-static unsigned int errorCount = 0;   // ?? A que tipos de erros é que isto se refere ?? Maximum number of retransmissions é considerado erro?
+static unsigned char ctrlREJ(unsigned int n)
+{
+  return (seqMod == SEQ_MOD_SW) ? SU_C_REJ(n) : SU_C_REJX(n);
+}
+
+static unsigned char ctrlSREJ(unsigned int n)
+{
+  return (seqMod == SEQ_MOD_SW) ? SU_C_SREJ(n) : SU_C_SREJX(n);
+}
+
+// Sequence number of an I frame of the other side (-1 if it isn't one)
+static int seqI(unsigned char ctrl)
+{
+  return duplex ? seqFromIA(ctrl) : seqFromI(ctrl);
+}
 
-// for alarm (used by Tx)
-static unsigned int alarmEnabled = FALSE;
-static unsigned int alarmCount = 0;
+// Stuffed data field of the frame kept in a Tx window slot (the header goes right before it)
+static unsigned char *txFrame(int slot)
+{
+  return txFrameBuf + (long)slot * TX_FRAME_SIZE(bufPayload) + I_HDR_MAX;
+}
 
-static void alarmHandler(int signal)
+// Selective Repeat reorder slot of a sequence number
+static unsigned char *rxSlot(int seq)
 {
-  alarmEnabled = FALSE;
-  alarmCount++;
+  return rxSlotBuf + (long)seq * bufPayload;
+}
 
-  printf("alarmHandler() call #%d\n", alarmCount);
+// Absolute frame number in [txBase, txBase + seqMod) carrying the sequence number seq
+static unsigned int seqToFrame(int seq)
+{
+  return txBase + (unsigned int)((seq - (int)(txBase % seqMod) + seqMod) % seqMod);
 }
 
+
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
@@ -47,174 +218,405 @@ int llopen(LinkLayer connectionParameters)
 	if (openSerialPort(connectionParameters.serialPort,
 											connectionParameters.baudRate) < 0)
 	{
-    printf("Failed to open serial port %s\n", connectionParameters.serialPort);
+    TRACE(TrError, "Failed to open serial port");
 		return -1;
 	}
 
   // Save connection parameters for later use
   currRole = connectionParameters.role;
+  memset(&stats, 0, sizeof(stats));
+  stats.role = currRole;
+  stats.baudRate = connectionParameters.baudRate;
+  byteNs = serialPortPaced() ? 10000000000LL / connectionParameters.baudRate : 0; // Others send as fast as written
+  lineFreeNs = 0;
+  rxReadNs = 0;
+  openedAt = timerNowUs();
+  closedAt = 0;
+  traceReset();
+  traceInstallSignals();
   currRetransmissions = connectionParameters.nRetransmissions;
-
-  unsigned char sendBuf[SU_BUF_SIZE] = {0};   // Buffer with SU message
-  unsigned char retBuf[SU_BUF_SIZE] = {0};    // Feedback buffer
+  if (connectionParameters.timeoutMs > 0) {
+    timeoutUs = connectionParameters.timeoutMs * 1000LL;
+  }
+  else if (connectionParameters.timeout > 0) {
+    timeoutUs = connectionParameters.timeout * 1000000LL;
+  }
+  else {
+    timeoutUs = DEFAULT_TIMEOUT_MS * 1000LL;
+  }
+  rtoUs = timeoutUs;
+  srttUs = rttvarUs = 0;
+  rttSamples = 0;
+
+  windowSize = connectionParameters.windowSize;
+  selRepeat = connectionParameters.selectiveRepeat;
+  if (windowSize < 1) windowSize = 1;
+  if (windowSize > MAX_WINDOW_SIZE) windowSize = MAX_WINDOW_SIZE;
+  if (selRepeat && windowSize > MAX_SR_WINDOW_SIZE) windowSize = MAX_SR_WINDOW_SIZE;
+  seqMod = (windowSize > 1) ? SEQ_MOD_EXT : SEQ_MOD_SW;
+  duplex = FALSE;
+  txAddr = (currRole == LlTx) ? I_Addr_TX : I_Addr_RX;
+  rxAddr = (currRole == LlTx) ? I_Addr_RX : I_Addr_TX;
+  ackPending = FALSE;
+
+  // Buffers for the largest payload this end takes - whatever is agreed can't be larger
+  // (full duplex keeps the frames llread() didn't take yet in the reorder slots)
+  int maxPayload = connectionParameters.payloadSize;
+  if (maxPayload < DEFAULT_PAYLOAD_SIZE) maxPayload = DEFAULT_PAYLOAD_SIZE;
+  if (maxPayload > MAX_PAYLOAD_SIZE) maxPayload = MAX_PAYLOAD_SIZE;
+  if (allocBuffers(maxPayload, selRepeat || connectionParameters.fullDuplex) == -1) {
+    TRACE1(TrError, "Out of memory for %lld-byte frames", maxPayload);
+    closeSerialPort();
+    return -1;
+  }
+  payloadSize = DEFAULT_PAYLOAD_SIZE;
+  adaptive = connectionParameters.adaptivePayload && currRole == LlTx;
+  adaptFrames = adaptErrors = adaptSent = 0;
+  adaptWireBytes = 0;
+
+  fcsType = FCS_XOR;
+  fecParity = 0;
+  uaParamsLen = 0;
+  rxAnswerLen = 0;
+  txBase = txNext = 0;
+  rxExpected = rxDeliver = 0;
+  rejSent = FALSE;
+  rxPastGap = FALSE;
+  discReceived = FALSE;
+  memset(rxHave, 0, sizeof(rxHave));
+  memset(srejSent, 0, sizeof(srejSent));
+
+  timerStopAll();
+
+  RxFrame frame;
+  const unsigned char *value;
 
   if (currRole == LlTx) {
-    // Set alarm function handler
-    (void)signal(SIGALRM, alarmHandler);
+    // Anything but BCC2 and the original payload size has to be proposed (a plain SET keeps the original protocol)
+    unsigned char params[PARAMS_MAX_LEN];
+    int paramsLen = 0;
+    if (connectionParameters.frameCheck != LlFcsXor) {
+      params[paramsLen++] = PARAM_FCS;
+      params[paramsLen++] = 1;
+      params[paramsLen++] = (unsigned char)connectionParameters.frameCheck;
+    }
+    if (maxPayload != DEFAULT_PAYLOAD_SIZE) {
+      params[paramsLen++] = PARAM_PAYLOAD;
+      params[paramsLen++] = 2;
+      params[paramsLen++] = maxPayload >> 8;
+      params[paramsLen++] = maxPayload & 0xFF;
+    }
+    if (connectionParameters.fullDuplex) {
+      params[paramsLen++] = PARAM_DUPLEX;
+      params[paramsLen++] = 1;
+      params[paramsLen++] = TRUE;
+    }
+    if (connectionParameters.fecParity > 0 && fecValid(connectionParameters.fecParity)) {
+      params[paramsLen++] = PARAM_FEC;
+      params[paramsLen++] = 1;
+      params[paramsLen++] = connectionParameters.fecParity;
+    }
+    if (windowSize > 1) {
+      params[paramsLen++] = PARAM_WINDOW;
+      params[paramsLen++] = 1;
+      params[paramsLen++] = windowSize;
+    }
+    if (windowSize > 1 && selRepeat) {
+      params[paramsLen++] = PARAM_ARQ;
+      params[paramsLen++] = 1;
+      params[paramsLen++] = TRUE;
+    }
+    int proposedWindow = windowSize;
+    int proposedSelRepeat = selRepeat;
 
     int uaReceived = FALSE;
+    int timeouts = 0;
     int readRet;
-    while (alarmCount < connectionParameters.nRetransmissions && !uaReceived) {
-      // Prepare and send SET frame
-      prepSU(sendBuf, SU_Addr_TX, SU_C_SET);
-      if (writeSU(sendBuf) == -1) {
-        errorCount++;
-        printf("%s: Tx write error!\n", __func__);
-        alarmCount = 0;
-        alarmEnabled = FALSE;
+    while (timeouts < connectionParameters.nRetransmissions && !uaReceived) {
+      // Send SET frame
+      if (writeParams(SU_C_SET, params, paramsLen) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Tx write error!");
+        timerStop(TIMER_CTRL);
         return -1;
       }
 
-      // ALARM FOR MAX TIME TO RECEIVE UA
-      alarm(ALARM_INTV);
-      alarmEnabled = TRUE;
-      printf("Alarme set for %d seconds!\n", ALARM_INTV);
+      // TIMER FOR MAX TIME TO RECEIVE UA
+      long long sentAt = timerNowUs() + lineBusyUs();
+      timerStart(TIMER_CTRL, lineBusyUs() + rtoUs);
+      TRACE1(TrDebug, "Timer set for %lld ms!", rtoUs / 1000);
+
+      // Receive UA frame (with the parameters Rx agreed to, if any)
+      do {
+        readRet = readI(rxBuf, &frame, ReadTimed);
+      } while (readRet == 1 && (frame.ctrl != SU_C_UA || (frame.dataLen >= 0 && !frame.bcc2Ok)));
 
-      // Receive UA frame
-      if ((readRet = readSU_OC(retBuf, SU_C_UA)) == -1) {
-        errorCount++;
-        printf("%s: Tx readSU error!\n", __func__);
-        alarmCount = 0;
-        alarmEnabled = FALSE;
+      if (readRet == -1) {
+        stats.errors++;
+        TRACE(TrError, "Tx readI error!");
+        timerStop(TIMER_CTRL);
         return -1;
       }
       else if (readRet == 0) {
-        retransmissionCount++;
-        printf("%s: Tx readSU timeout!\n", __func__);
+        timeouts++;
+        stats.timeouts++;
+        stats.retransmissions++;
+        rtoBackoff();
+        TRACE(TrInfo, "Tx readSU timeout!");
         continue;
       }
       else { // readRet == 1
         uaReceived = TRUE;
-        printf("%s: Tx readSU success! UA frame received!\n", __func__);
+        if (timeouts == 0) { // Karn's rule
+          rttSample((timerNowUs() > sentAt) ? timerNowUs() - sentAt : 0);
+        }
+        if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_FCS, &value) == 1 &&
+            value[0] <= FCS_CRC32C) {
+          fcsType = value[0];
+        }
+        if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_PAYLOAD, &value) == 2) {
+          int agreed = (value[0] << 8) | value[1];
+          if (agreed >= DEFAULT_PAYLOAD_SIZE && agreed <= maxPayload) {
+            payloadSize = agreed;
+          }
+        }
+        if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_DUPLEX, &value) == 1) {
+          duplex = (value[0] == TRUE && connectionParameters.fullDuplex);
+        }
+        if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_FEC, &value) == 1 &&
+            value[0] == connectionParameters.fecParity) {
+          fecParity = value[0];
+        }
+        // Without an answer Rx only knows the original protocol
+        windowSize = 1;
+        selRepeat = FALSE;
+        if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_WINDOW, &value) == 1 &&
+            value[0] >= 1 && value[0] <= proposedWindow) {
+          windowSize = value[0];
+        }
+        if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_ARQ, &value) == 1) {
+          selRepeat = (value[0] == TRUE && proposedSelRepeat);
+        }
+        TRACE2(TrInfo, "Tx readSU success! UA frame received (FCS %lld, payload %lld)!", fcsType, payloadSize);
       }
     }
 
-    // Reset alarm variables
-    alarmCount = 0;
-    alarmEnabled = FALSE;
+    timerStop(TIMER_CTRL);
 
     if (!uaReceived) { // Exceeded retransmissions (maybe Rx is turned off)
-      printf("%s: Maximum retransmissions reached, UA not received!\n", __func__);
+      TRACE(TrError, "Maximum retransmissions reached, UA not received!");
       return -1;
     }
   }
   else { // currRole == LlRx
-    if (readSU_OC(retBuf, SU_C_SET) == -1) {
-      errorCount++;
-      printf("%s: Rx readSU error!\n", __func__);
-      return -1;
+    do {
+      if (readI(rxBuf, &frame, ReadBlock) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Rx readI error!");
+        return -1;
+      }
+    } while (frame.ctrl != SU_C_SET || (frame.dataLen >= 0 && !frame.bcc2Ok));
+
+    // Agree to what Tx proposed, as far as we know it (unknown parameters keep the original protocol)
+    if (frame.dataLen > 0) {
+      int len;
+      if ((len = findParam(frame.data, frame.dataLen, PARAM_FCS, &value)) >= 0) {
+        if (len == 1 && value[0] <= FCS_CRC32C) {
+          fcsType = value[0];
+        }
+        uaParams[uaParamsLen++] = PARAM_FCS;
+        uaParams[uaParamsLen++] = 1;
+        uaParams[uaParamsLen++] = (unsigned char)fcsType;
+      }
+      if ((len = findParam(frame.data, frame.dataLen, PARAM_PAYLOAD, &value)) >= 0) {
+        if (len == 2) {
+          int proposed = (value[0] << 8) | value[1];
+          payloadSize = (proposed < maxPayload) ? proposed : maxPayload;
+          if (payloadSize < DEFAULT_PAYLOAD_SIZE) payloadSize = DEFAULT_PAYLOAD_SIZE;
+        }
+        uaParams[uaParamsLen++] = PARAM_PAYLOAD;
+        uaParams[uaParamsLen++] = 2;
+        uaParams[uaParamsLen++] = payloadSize >> 8;
+        uaParams[uaParamsLen++] = payloadSize & 0xFF;
+      }
+      if ((len = findParam(frame.data, frame.dataLen, PARAM_DUPLEX, &value)) >= 0) {
+        duplex = (len == 1 && value[0] == TRUE && connectionParameters.fullDuplex);
+        uaParams[uaParamsLen++] = PARAM_DUPLEX;
+        uaParams[uaParamsLen++] = 1;
+        uaParams[uaParamsLen++] = duplex;
+      }
+      if ((len = findParam(frame.data, frame.dataLen, PARAM_FEC, &value)) >= 0) {
+        if (len == 1 && fecValid(value[0])) {
+          fecParity = value[0];
+        }
+        uaParams[uaParamsLen++] = PARAM_FEC;
+        uaParams[uaParamsLen++] = 1;
+        uaParams[uaParamsLen++] = fecParity;
+      }
+    }
+
+    // Both ends run the same ARQ - the smaller window, Selective Repeat if both ask for it
+    // (neither proposed - Stop-and-Wait, like the original protocol)
+    int proposedWindow = 1;
+    selRepeat = selRepeat && frame.dataLen > 0 &&
+                findParam(frame.data, frame.dataLen, PARAM_ARQ, &value) == 1 && value[0] == TRUE;
+    if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_WINDOW, &value) == 1 && value[0] >= 1) {
+      proposedWindow = value[0];
+    }
+    windowSize = connectionParameters.windowSize;
+    if (windowSize < 1) windowSize = 1;
+    if (windowSize > proposedWindow) windowSize = proposedWindow;
+    if (windowSize > MAX_WINDOW_SIZE) windowSize = MAX_WINDOW_SIZE;
+    if (selRepeat && windowSize > MAX_SR_WINDOW_SIZE) windowSize = MAX_SR_WINDOW_SIZE;
+    if (proposedWindow > 1) {
+      uaParams[uaParamsLen++] = PARAM_WINDOW;
+      uaParams[uaParamsLen++] = 1;
+      uaParams[uaParamsLen++] = windowSize;
+    }
+    if (frame.dataLen > 0 && findParam(frame.data, frame.dataLen, PARAM_ARQ, &value) >= 0) {
+      uaParams[uaParamsLen++] = PARAM_ARQ;
+      uaParams[uaParamsLen++] = 1;
+      uaParams[uaParamsLen++] = selRepeat;
     }
 
-    // Prepare and send UA frame
-    prepSU(sendBuf, SU_Addr_TX, SU_C_UA);
-    if (writeSU(sendBuf) == -1) {
-      errorCount++;
-      printf("%s: Rx write error!\n", __func__);
+    // Send UA frame
+    if (writeUA() == -1) {
+      stats.errors++;
+      TRACE(TrError, "Rx write error!");
       return -1;
     }
   }
 
+  // Full duplex numbers the frames both ways like a window, since the acknowledgement
+  // they carry needs the extended numbering (and Rx may adapt its frames too).
+  // An acknowledgement may also wait for the frame the other side is sending, which the RTT of
+  // SET/UA says nothing about - the configured timeout holds until I frames are measured
+  seqMod = (windowSize > 1) ? SEQ_MOD_EXT : SEQ_MOD_SW;
+  if (duplex) {
+    seqMod = SEQ_MOD_EXT;
+    adaptive = connectionParameters.adaptivePayload;
+    rtoUs = timeoutUs;
+    srttUs = rttvarUs = 0;
+    rttSamples = 0;
+    TRACE(TrInfo, "Full duplex");
+  }
+
+  // Adaptive frames start at the original size - as if the line had the bit error rate it suits best -
+  // and grow while the line stays clean (frames already sent can't shrink if it is worse)
+  stats.payloadSize = payloadSize;
+  stats.fullDuplex = duplex;
+  stats.fecParity = fecParity;
+  stats.windowSize = windowSize;
+  stats.selectiveRepeat = selRepeat;
+  txPayload = payloadSize;
+  if (adaptive) {
+    double h = adaptOverheadBits(), l = 8.0 * DEFAULT_PAYLOAD_SIZE;
+    adaptLoss = h / (l * (l + h));
+    txPayload = DEFAULT_PAYLOAD_SIZE;
+  }
 	return 1; // Success
 }
 
 
 ////////////////////////////////////////////////
 // LLWRITE - For Transmitter (Tx) of Link Layer -> receives data from Application Layer (through the arguments) and sends data to Rx
+// With a window > 1 (Go-Back-N) it only blocks while the window is full, so the
+// frame may still be unacknowledged when it returns (llclose waits for all of them)
 ////////////////////////////////////////////////
 int llwrite(const unsigned char *buf, int bufSize)
 {
-  // ?? O bufSize não devia ser unsigned int (já que nunca poderá ser negativo)
-  if (bufSize <= 0) {
+  return llwritev(NULL, 0, buf, bufSize);
+}
+
+
+////////////////////////////////////////////////
+// LLWRITEV - llwrite() of a packet in two pieces (header and data), stuffed straight into the frame
+////////////////////////////////////////////////
+int llwritev(const unsigned char *head, int headSize, const unsigned char *buf, int bufSize)
+{
+  if (headSize < 0 || bufSize < 0 || headSize + bufSize <= 0 || headSize + bufSize > payloadSize) {
     return -1; // Invalid buffer size
   }
 
-  // ?? Why is this error happening (é pela macro ser dinâmica)
-  unsigned char stuffBuf[I_BUF_SIZE] = {0}; // Array that will be filled with the frame (including stuffed bits)
-  unsigned char retBuf[SU_BUF_SIZE] = {0};  // Feedback buffer
-
-  // ?? O BUF VEM COM HEADER E TAILER??? ACHO QUE NÃO
-  // while (i < 4) { // Header
-  //   stuffBuf[i] = buf[i];
-  //   i++;
-  // }
-  // Preparing Header
-  stuffBuf[0] = I_Flag;
-  stuffBuf[1] = I_Addr_TX;
-  stuffBuf[2] = I_C(frameCount);
-  stuffBuf[3] = I_BCC1(stuffBuf[1], stuffBuf[2]);
-
-  // Byte stuffing the packet
-  int i = 0, j = 4;
-  while (i < bufSize) {
-    if (buf[i] == I_Flag || buf[i] == STUFF_ESC) {
-        stuffBuf[j++] = STUFF_ESC;
-        stuffBuf[j++] = STUFF_MASK(buf[i++]);
-    } else {
-        stuffBuf[j++] = buf[i++];
-    }
-  }
-
-  // Preparing Trailer
-  stuffBuf[j++] = funcI_BCC2(buf, bufSize);
-  stuffBuf[j++] = I_Flag;
-  // ?? O BUF VEM COM HEADER E TAILER??? ACHO QUE NÃO
-  // while (i < bufSize) { // Trailer
-  //   stuffBuf[i] = buf[i];
-  //   i++;
-  // }
-
-  int rrReceived = FALSE;
-  int readRet;
-  while (alarmCount < currRetransmissions && !rrReceived) {
-    // ?? (void)signal(SIGALRM, alarmHandler); Already did it in llopen() probably don't need to do it again right ??
-
-    if (writeBytesSerialPort(stuffBuf, j) != j) { // ?? FAÇO != j OU == -1 ??
-      errorCount++;
-      printf("%s: Tx write error!\n", __func__);
-      return -1;
+  // Full duplex: take in the frames the other side sent meanwhile, so this one acknowledges them.
+  // Room in the window is waited for here, and only while llread() has nothing to take - with
+  // both ends waiting for room, their frames would be refused by each other for good.
+  // So is the line: the acknowledgements we owe would wait behind every frame written ahead
+  // (and arrive after the other side timed out, or moved on past the frame a REJ asks for)
+  if (duplex) {
+    int readRet, len;
+    while ((readRet = duplexRead(NULL, ReadPoll, &len)) == 1) {
     }
-
-    // ALARM FOR MAX TIME TO RECEIVE RR OR REJ
-    alarm(ALARM_INTV);
-    alarmEnabled = TRUE;
-    printf("Alarme set for %d seconds!\n", ALARM_INTV);
-
-    // Receive UA frame
-    if ((readRet = readSU_RW(retBuf, frameCount)) == -1) {
-      errorCount;
-      printf("%s: Tx readSU error!\n", __func__);
-      alarmCount = 0;
-      alarmEnabled = FALSE;
+    if (readRet == -1) {
       return -1;
     }
-    else if (readRet == 0) {
-      retransmissionCount++;
-      printf("%s: Tx readSU timeout/Neg ACK received!\n", __func__);
-      continue;
+    while (txNext - txBase >= windowSize || lineBusyUs() > 0) {
+      if (llavailable() > 0) {
+        return 0;
+      }
+      if (txNext - txBase >= windowSize) {
+        readRet = waitAck();
+      }
+      else {
+        timerStart(TIMER_LINE, lineBusyUs());
+        readRet = duplexRead(NULL, ReadLine, &len);
+        timerStop(TIMER_LINE);
+      }
+      if (readRet == -1) {
+        return -1;
+      }
     }
-    else {
-      rrReceived = TRUE;
-      printf("%s: Tx readSU success! UA frame received!\n", __func__);
+  }
+
+  // A retransmission timer may have expired while the application was busy
+  if (txBase != txNext && timerFirstExpired() != -1) {
+    if (waitAck() == -1) {
+      return -1;
     }
   }
 
-  alarmCount = 0;
-  alarmEnabled = FALSE;
+  // Traced from here - the waits above are for the frames before it (as half duplex waits after them)
+  traceStamp(txNext, TrTxQueued, traceNowNs());
 
-  if (!rrReceived) { // Exceeded retransmissions (maybe Rx is turned off)
-    printf("%s: Maximum retransmissions reached, UA not received!\n", __func__);
+  // The frame is kept in the window until acknowledged (its header is built again for each retransmission)
+  int slot = txNext % MAX_WINDOW_SIZE;
+  unsigned char *body = txFrame(slot);
+
+  txFrameLen[slot] = frameBody(body, head, headSize, buf, bufSize, fcsType, fecParity);
+  unsigned char *frame = frameHeader(body, txAddr, ctrlI(txNext));
+  int j = (body - frame) + txFrameLen[slot];
+  traceStamp(txNext, TrTxStuffed, traceNowNs());
+
+  if (writeFrame(frame, j) == -1) {
+    stats.errors++;
+    TRACE(TrError, "Tx write error!");
     return -1;
   }
+  traceStamp(txNext, TrTxWritten, traceNowNs());
+  ackPending = FALSE;
+  stats.iFramesSent++;
+  stats.dataBytes += headSize + bufSize;
+  stats.fieldBytes += (fecParity > 0) ? fecCodedLen(headSize + bufSize + fcsLen(fcsType), fecParity)
+                                       : headSize + bufSize + fcsLen(fcsType);
+  stats.stuffedBytes += txFrameLen[slot] - 1; // All but the flags, address, control and BCC1
+
+  // Every outstanding frame has its own timer, from when its last byte leaves (a transport
+  // that isn't paced has sent it already, lineBusyUs() is 0)
+  timerStart(slot, lineBusyUs() + rtoUs);
+  txSentAt[slot] = timerNowUs() + lineBusyUs();
+  txResent[slot] = FALSE;
+  txTimeouts[slot] = 0;
+  txNext++;
+
+  adaptSent++;
+  adaptWireBytes += j;
+
+  // Stop-and-Wait (window of 1) always waits here for the RR (full duplex waits before the next frame instead)
+  while (!duplex && txNext - txBase >= windowSize) {
+    if (waitAck() == -1) {
+      return -1;
+    }
+  }
 
   return j;
 }
@@ -222,269 +624,1371 @@ int llwrite(const unsigned char *buf, int bufSize)
 
 ////////////////////////////////////////////////
 // LLREAD - For Receiver (Rx) of Link Layer -> receives data from Tx, and "sends" (returns through the argument) to application layer
-// Ter atenção ao MAX_PAYLOAD_SIZE (macro)
+// The frame in sequence is destuffed straight into packet; with Selective Repeat,
+// frames after a gap wait in their reorder slots and are handed over by the following calls
+// (so do the frames full duplex took in while llwrite() waited)
+// Returns 0 if the Tx disconnected (DISC received)
 ////////////////////////////////////////////////
 int llread(unsigned char *packet)
 {
-  // TODO
+  RxFrame frame;
+
+  // Frames held back that are now in sequence go first
+  if (rxDeliver != rxExpected) {
+    int slot = rxDeliver % SEQ_MOD_EXT;
+    int len = rxSlotLen[slot];
+    memcpy(packet, rxSlot(slot), len);
+    rxHave[slot] = FALSE;
+    traceStamp(rxDeliver, TrRxDelivered, traceNowNs());
+    rxDeliver++;
+    stats.dataBytes += len;
+    return len;
+  }
+
+  while (!discReceived) {
+    int len;
+
+    // Full duplex: our own frames may be acknowledged (or time out) meanwhile
+    if (duplex) {
+      if (duplexRead(packet, ReadTimed, &len) == -1) {
+        return -1;
+      }
+      if (len > 0) {
+        return len;
+      }
+      continue;
+    }
+
+    if (readI(packet, &frame, ReadBlock) == -1) {
+      stats.errors++;
+      TRACE(TrError, "Rx read error!");
+      return -1;
+    }
+
+    if (frame.ctrl == SU_C_SET) { // Our UA was lost (SET may carry parameters)
+      writeUA();
+      continue;
+    }
+    if (frame.dataLen < 0) { // SU frame
+      if (frame.ctrl == SU_C_DISC) {
+        discReceived = TRUE;
+      }
+      else if (frame.ctrl == SU_C_POLL && rxAnswerLen > 0 && writeParams(SU_C_ANSWER, rxAnswer, rxAnswerLen) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Rx write error!");
+        return -1;
+      }
+      continue;
+    }
+
+    if ((len = rxIFrame(&frame, packet)) > 0) {
+      return len;
+    }
+  }
 
   return 0;
 }
 
 
 ////////////////////////////////////////////////
-// LLCLOSE - For Transmitter (Tx) - no way of distinguishing Tx from Rx (no connectionParameters)
-// Tx uses when he wants to close
-// Rx reads values sent here by Tx in llwrite
-// Rx invoke this when it wants to turn off
+// LLAVAILABLE
 ////////////////////////////////////////////////
-int llclose(int showStatistics)
+int llavailable()
 {
-  unsigned char closeBuf[SU_BUF_SIZE] = {0};
+  return rxExpected - rxDeliver;
+}
 
-  if (currRole == LlTx) {
-    int discReceived = FALSE;
-    int readRet;
 
-    while (alarmCount < currRetransmissions && !discReceived) {
-      // Prepare and send DISC frame
-      prepSU(closeBuf, SU_Addr_TX, SU_C_DISC);
-      if (writeSU(closeBuf) == -1) {
-        errorCount++;
-        printf("%s: Tx write error!\n", __func__);
-        return -1;
+// An I frame of the other side read by readI(): the one in sequence is delivered (if it went
+// to packet) or kept in its slot for llread(), anything else is acknowledged, rejected or
+// buffered as the ARQ mode says
+// Returns the size of the packet delivered to packet (0 if none)
+static int rxIFrame(RxFrame *frame, unsigned char *packet)
+{
+  int seq = seqI(frame->ctrl);
+  if (seq < 0 || frame->dataLen < 1) { // Not an I frame, or empty payload
+    return 0;
+  }
+  seqMod = (duplex || IS_I_CX(frame->ctrl)) ? SEQ_MOD_EXT : SEQ_MOD_SW;
+  int ahead = (seq - (int)(rxExpected % seqMod) + seqMod) % seqMod;
+
+  if (ahead == 0) {
+    if (!frame->bcc2Ok) {
+      stats.bcc2Errors++;
+      TRACE1(TrInfo, "BCC2 error on frame %lld!", seq);
+      writeSU(rxAddr, selRepeat ? ctrlSREJ(rxExpected) : ctrlREJ(rxExpected));
+      rejSent = TRUE;
+      rxPastGap = TRUE;
+      srejSent[seq] = selRepeat; // Go-Back-N sent a REJ
+      return 0;
+    }
+    if (frame->data == rxBuf) { // Full duplex, and the slots are full of frames llread() didn't take - Tx sends it again
+      TRACE1(TrInfo, "No room for frame %lld, dropped", seq);
+      return 0;
+    }
+
+    traceStamp(rxExpected, TrRxFlag, frame->flagNs);
+    traceStamp(rxExpected, TrRxComplete, frame->doneNs);
+    stats.iFramesReceived++;
+    rejSent = FALSE;
+    rxPastGap = FALSE;
+    srejSent[seq] = FALSE;
+    if (frame->data == packet) { // Already in packet (see rxFrameDest())
+      traceStamp(rxExpected, TrRxDelivered, traceNowNs());
+      stats.dataBytes += frame->dataLen;
+      rxExpected++;
+      rxDeliver = rxExpected;
+    }
+    else { // In its slot until llread() takes it
+      rxSlotLen[seq] = frame->dataLen;
+      rxHave[seq] = TRUE;
+      rxExpected++;
+    }
+
+    // Frames buffered after this one are now in sequence too
+    while (selRepeat && rxHave[rxExpected % SEQ_MOD_EXT]) {
+      srejSent[rxExpected % SEQ_MOD_EXT] = FALSE;
+      rxExpected++;
+    }
+    ackRx();
+    return (frame->data == packet) ? frame->dataLen : 0;
+  }
+
+  if (selRepeat && ahead < MAX_SR_WINDOW_SIZE) {
+    if (frame->bcc2Ok && frame->data == rxSlot(seq)) {
+      rxSlotLen[seq] = frame->dataLen;
+      rxHave[seq] = TRUE;
+      traceStamp(rxExpected + ahead, TrRxFlag, frame->flagNs);
+      traceStamp(rxExpected + ahead, TrRxComplete, frame->doneNs);
+      stats.iFramesReceived++;
+    }
+    else if (!frame->bcc2Ok) {
+      stats.bcc2Errors++;
+      TRACE1(TrInfo, "BCC2 error on frame %lld!", seq);
+    }
+    else if (rxHave[seq]) { // Already buffered
+      stats.duplicates++;
+    }
+    else { // No room (full duplex) - Tx sends it again
+      return 0;
+    }
+
+    // Ask for every frame missing up to this one (this one too if it came damaged)
+    for (int k = 0; k <= ahead; k++) {
+      unsigned int missing = (rxExpected + k) % SEQ_MOD_EXT;
+      if (!rxHave[missing] && !srejSent[missing]) {
+        writeSU(rxAddr, ctrlSREJ(missing));
+        srejSent[missing] = TRUE;
       }
+    }
+    return 0;
+  }
+
+  // Out of sequence: behind rxExpected (already delivered - a resent window whose RR was lost)
+  // or past a gap. A Go-Back-N window over half the modulus makes some numbers either one:
+  // those are past the gap once Tx was seen sending the missing frame or one after it
+  int pastGap = (ahead < windowSize) && (ahead < seqMod - windowSize || rxPastGap);
+  if (pastGap) {
+    stats.outOfSequence++;
+    rxPastGap = TRUE;
+  }
+  else {
+    stats.duplicates++;
+  }
+
+  // Go-Back-N REJects the first one (REJ acknowledges what came before it either way)
+  if (seqMod != SEQ_MOD_SW && !selRepeat) {
+    if (!rejSent) {
+      writeSU(rxAddr, ctrlREJ(rxExpected));
+      rejSent = TRUE;
+    }
+  }
+  else {
+    TRACE1(TrInfo, "Duplicate frame %lld, acknowledging again", seq);
+    ackRx();
+  }
+  return 0;
+}
+
+
+// Acknowledge the frames before rxExpected - at once, or (full duplex) with our next
+// I frame, unless we wait for the other side before sending one (see flushAck())
+static void ackRx()
+{
+  if (duplex) {
+    ackPending = TRUE;
+  }
+  else {
+    writeSU(rxAddr, ctrlRR(rxExpected));
+  }
+}
+
+// Send the RR owed, if any - full duplex is about to wait, with no I frame to carry it
+static void flushAck()
+{
+  if (ackPending) {
+    writeSU(rxAddr, ctrlRR(rxExpected));
+    ackPending = FALSE;
+  }
+}
+
+
+// Full duplex: read the next frame of the other side and handle it - acknowledgements (RR,
+// REJ, SREJ or the one an I frame carries) go to the Tx window, I frames as llread() takes them
+// wait is ReadTimed (the window's timers are handled here, the caller sees the others), ReadLine
+// (the same, waiting for the line to send our next frame) or ReadPoll
+// Returns -1 on error, 0 if nothing arrived, 1 otherwise - *len is the size of the packet
+// delivered to packet (0 if none)
+static int duplexRead(unsigned char *packet, ReadWait wait, int *len)
+{
+  RxFrame frame;
+  int readRet;
+
+  *len = 0;
+  if (wait == ReadTimed) {
+    flushAck();
+  }
+  if ((readRet = readI(packet, &frame, wait)) == -1) {
+    stats.errors++;
+    TRACE(TrError, "Read error!");
+    return -1;
+  }
+  if (readRet == 0) {
+    int expired = timerFirstExpired();
+    if (wait != ReadPoll && expired >= 0 && expired < MAX_WINDOW_SIZE && txBase != txNext) {
+      return (txTimeout() == -1) ? -1 : 0;
+    }
+    return 0;
+  }
+
+  if (frame.ctrl == SU_C_SET && frame.addr == I_Addr_TX) { // Our UA was lost (Rx)
+    writeUA();
+    return 1;
+  }
+  if (frame.dataLen < 0) { // SU frame - an answer to our I frames, or a command of the other side
+    if (frame.addr == txAddr) {
+      return (txAck(frame.ctrl) == -1) ? -1 : 1;
+    }
+    if (frame.ctrl == SU_C_DISC) {
+      discReceived = TRUE;
+    }
+    return 1;
+  }
+  if (frame.addr != rxAddr || seqFromIA(frame.ctrl) < 0) {
+    return 1;
+  }
+
+  // The acknowledgement is only trusted if the whole frame is
+  if (frame.bcc2Ok && txAck(SU_C_RRX(ackFromIA(frame.ctrl))) == -1) {
+    return -1;
+  }
+  *len = rxIFrame(&frame, packet);
+  return 1;
+}
+
+
+// Full duplex: wait for the DISC of the other side until a timer expires, still
+// acknowledging its I frames (it may be waiting for the last RR before it disconnects)
+// Returns -1 on error, 0 on timeout, 1 once DISC was received
+static int waitDisc()
+{
+  int readRet = 1, len;
+  while (!discReceived && (readRet = duplexRead(NULL, ReadTimed, &len)) == 1) {
+  }
+  return discReceived ? 1 : readRet;
+}
+
 
+////////////////////////////////////////////////
+// LLCLOSE
+// Tx waits for the outstanding frames, sends DISC, receives DISC and sends the last UA
+// Rx waits for DISC (unless llread got it already), sends DISC and receives the last UA
+// Full duplex: Rx waits for its outstanding frames first, and both keep acknowledging
+// the other side's frames until its DISC
+////////////////////////////////////////////////
+int llclose(int showStatistics)
+{
+  int readRet;
+  int delivered = TRUE;
 
-      // Clear the buffer with the sent message
-      // Will fill with received message
-      memset(closeBuf, 0, sizeof(closeBuf));
+  if (currRole == LlTx) {
+    // Go-Back-N may still have unacknowledged frames
+    if (llflush() == -1) { // Still disconnect, so Rx doesn't wait forever
+      TRACE(TrError, "Tx could not deliver the remaining frames!");
+      delivered = FALSE;
+    }
+    timerStopAll();
+
+    int discRecv = FALSE;
+    int timeouts = 0;
+    while (timeouts < currRetransmissions && !discRecv) {
+      // Send DISC frame
+      if (writeSU(SU_Addr_TX, SU_C_DISC) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Tx write error!");
+        return -1;
+      }
 
-      // ALARM FOR MAX TIME TO RECEIVE DISC
-      alarm(ALARM_INTV);
-      alarmEnabled = TRUE;
-      printf("Alarme set for %d seconds!\n", ALARM_INTV);
+      // TIMER FOR MAX TIME TO RECEIVE DISC
+      timerStart(TIMER_CTRL, lineBusyUs() + rtoUs);
+      TRACE1(TrDebug, "Timer set for %lld ms!", rtoUs / 1000);
 
-      // Receive DISC frame
-      if ((readRet = readSU_default(&closeBuf, SU_C_DISC)) == -1) {
-        errorCount++;
-        printf("%s: Tx readSU error!\n", __func__);
+      // Receive DISC frame (a command from Rx)
+      if ((readRet = duplex ? waitDisc() : waitSU(SU_Addr_RX, SU_C_DISC)) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Tx readSU error!");
         return -1;
       }
       else if (readRet == 0) {
-        printf("%s: Tx readSU timeout!\n", __func__);
+        timeouts++;
+        stats.timeouts++;
+        stats.retransmissions++;
+        rtoBackoff();
+        TRACE(TrInfo, "Tx readSU timeout!");
         continue;
       }
-      else {
-        discReceived = TRUE;
-        alarmCount = 0;
-        alarmEnabled = FALSE;
-        printf("%s: DISC frame received!\n", __func__);
-      }
 
+      discRecv = TRUE;
+      TRACE(TrInfo, "DISC frame received!");
 
-      // Prepare to send UA frame (LAST)
-      prepSU(closeBuf, SU_Addr_TX, SU_C_UA);
-      if (writeSU(closeBuf) == -1) {
-        errorCount++;
-        printf("%s: Tx write error!\n", __func__);
+      // Send UA frame (LAST) - a reply to the Rx command
+      if (writeSU(SU_Addr_RX, SU_C_UA) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Tx write error!");
         return -1;
       }
     }
+    timerStop(TIMER_CTRL);
 
-    if (!discReceived) { // Exceeded retransmissions (maybe Rx is turned off)
-      printf("%s: Maximum retransmissions reached, disc not received\n", __func__);
+    if (!discRecv) { // Exceeded retransmissions (maybe Rx is turned off)
+      TRACE(TrError, "Maximum retransmissions reached, disc not received");
       return -1;
     }
   }
   else { // currRole == LlRx
-    // ?? Do nothing??
+    RxFrame frame;
+
+    if (duplex) {
+      if (llflush() == -1) {
+        TRACE(TrError, "Rx could not deliver the remaining frames!");
+        delivered = FALSE;
+      }
+      timerStopAll();
+      if (waitDisc() == -1) {
+        return -1;
+      }
+    }
+
+    while (!discReceived) {
+      if (readI(rxBuf, &frame, ReadBlock) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Rx read error!");
+        return -1;
+      }
+      if (frame.dataLen < 0 && frame.ctrl == SU_C_DISC) {
+        discReceived = TRUE;
+      }
+      else if (frame.dataLen >= 0) { // Retransmission of something already delivered
+        writeSU(rxAddr, ctrlRR(rxExpected));
+      }
+    }
+
+    int uaReceived = FALSE;
+    int timeouts = 0;
+    while (timeouts < currRetransmissions && !uaReceived) {
+      if (writeSU(SU_Addr_RX, SU_C_DISC) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Rx write error!");
+        return -1;
+      }
+
+      timerStart(TIMER_CTRL, lineBusyUs() + rtoUs);
+      if ((readRet = waitSU(SU_Addr_RX, SU_C_UA)) == -1) {
+        stats.errors++;
+        TRACE(TrError, "Rx readSU error!");
+        return -1;
+      }
+      else if (readRet == 0) {
+        timeouts++;
+        stats.timeouts++;
+        stats.retransmissions++;
+        rtoBackoff();
+        continue;
+      }
+      uaReceived = TRUE;
+    }
+    timerStop(TIMER_CTRL);
+
+    if (!uaReceived) { // Tx already gave up or UA lost - the transfer itself is complete
+      TRACE(TrInfo, "Last UA not received, closing anyway");
+    }
   }
 
   // Print stats
+  closedAt = timerNowUs();
   if (showStatistics) {
     statAnalysis();
+    tracePrint();
   }
+  traceDump((currRole == LlTx) ? "tx" : "rx");
 
+  freeBuffers();
   int clstat = closeSerialPort();
-  printf("%s - Serial port of role: %s has been closed", __func__, (currRole == LlTx) ? "LlTx" : "LlRx");
-  return clstat;
+  TRACE(TrInfo, (currRole == LlTx) ? "Serial port of role LlTx has been closed" : "Serial port of role LlRx has been closed");
+  traceEventsDump();
+  return delivered ? clstat : -1;
 }
 
 static void statAnalysis() {
-  printf("Number of frames: %d\n", frameCount);
-  printf("Number of retransmissions: %d\n", retransmissionCount);
-  printf("Number of timeouts: %d\n", timeoutCount);
-  printf("Number of errors: %d\n", errorCount);
+  LinkLayerStats st;
+  llstats(&st);
+
+  printf("\n---- Link layer statistics (%s) ----\n", (st.role == LlTx) ? "Tx" : "Rx");
+  if (st.fullDuplex) {
+    printf("Full duplex: I frames both ways, counted together below\n");
+  }
+  printf("Payload: %lld bytes in %.3f s - goodput %.0f bytes/s\n", st.dataBytes, st.seconds, st.goodput);
+  printf("Efficiency: S = %.4f (goodput in bits/s over %d baud)\n", st.efficiency, st.baudRate);
+  printf("Data fields: %lld bytes, %lld after stuffing (overhead %.2f%%)\n", st.fieldBytes, st.stuffedBytes,
+         st.fieldBytes ? 100.0 * (st.stuffedBytes - st.fieldBytes) / st.fieldBytes : 0.0);
+  printf("Serial port: %lld bytes written, %lld bytes read\n", st.txBytes, st.rxBytes);
+  printf("I frames: %u sent, %u received (payload size %d, window %d, %s)\n", st.iFramesSent, st.iFramesReceived,
+         st.payloadSize, st.windowSize, (st.windowSize == 1) ? "Stop-and-Wait" : st.selectiveRepeat ? "Selective Repeat" : "Go-Back-N");
+  printf("Number of retransmissions: %u\n", st.retransmissions);
+  printf("Number of REJ / SREJ: %u / %u\n", st.rejs, st.srejs);
+  printf("Number of duplicate frames: %u (and %u discarded after a gap)\n", st.duplicates, st.outOfSequence);
+  printf("Number of timeouts: %u\n", st.timeouts);
+  printf("Number of BCC1 / BCC2 errors: %u / %u\n", st.bcc1Errors, st.bcc2Errors);
+  if (st.fecParity > 0) {
+    printf("FEC (%d parity bytes per codeword): %u frames corrected (%lld bytes), %u frames beyond it (retransmitted)\n",
+           st.fecParity, st.fecFrames, st.fecBytes, st.fecFailures);
+  }
+  printf("Number of errors: %u\n", st.errors);
+  if (currRole == LlTx || st.fullDuplex) {
+    printf("Smoothed RTT: %.3f ms (deviation %.3f ms, %u samples)\n", srttUs / 1000.0, rttvarUs / 1000.0, rttSamples);
+    printf("Retransmission timeout: %.3f ms\n", rtoUs / 1000.0);
+  }
+  if (adaptive) {
+    printf("Adaptive payload size: %d bytes at the end\n", txPayload);
+  }
 
-  // !! provavelmente há mais, muito mais
+  // The same, machine-readable (one line)
+  printf("{\"role\":\"%s\",\"baudRate\":%d,\"payloadSize\":%d,\"windowSize\":%d,\"selectiveRepeat\":%s,\"fullDuplex\":%s,"
+         "\"dataBytes\":%lld,\"fieldBytes\":%lld,"
+         "\"stuffedBytes\":%lld,\"txBytes\":%lld,\"rxBytes\":%lld,\"iFramesSent\":%u,\"iFramesReceived\":%u,"
+         "\"retransmissions\":%u,\"rejs\":%u,\"srejs\":%u,\"duplicates\":%u,\"outOfSequence\":%u,\"timeouts\":%u,\"bcc1Errors\":%u,"
+         "\"bcc2Errors\":%u,\"fecParity\":%d,\"fecFrames\":%u,\"fecBytes\":%lld,\"fecFailures\":%u,"
+         "\"errors\":%u,\"seconds\":%.6f,\"goodput\":%.1f,\"efficiency\":%.6f}\n",
+         (st.role == LlTx) ? "tx" : "rx", st.baudRate, st.payloadSize, st.windowSize, st.selectiveRepeat ? "true" : "false",
+         st.fullDuplex ? "true" : "false",
+         st.dataBytes, st.fieldBytes,
+         st.stuffedBytes, st.txBytes, st.rxBytes, st.iFramesSent, st.iFramesReceived,
+         st.retransmissions, st.rejs, st.srejs, st.duplicates, st.outOfSequence, st.timeouts, st.bcc1Errors,
+         st.bcc2Errors, st.fecParity, st.fecFrames, st.fecBytes, st.fecFailures,
+         st.errors, st.seconds, st.goodput, st.efficiency);
 }
 
 
-// Send Supervision/Unnumbered Frames
-static int writeSU(const unsigned char *buf)
+////////////////////////////////////////////////
+// LLSTATS
+////////////////////////////////////////////////
+int llstats(LinkLayerStats *st)
 {
-  if (writeBytesSerialPort(buf, 5) != 5) { // ?? FAÇO != 5 OU == -1 ??
+  if (st == NULL || openedAt == 0) {
     return -1;
   }
-  printf("Unnumbered (U) message written!\n");
+
+  *st = stats;
+  st->seconds = ((closedAt ? closedAt : timerNowUs()) - openedAt) / 1e6;
+  st->goodput = (st->seconds > 0) ? st->dataBytes / st->seconds : 0;
+  st->efficiency = (st->baudRate > 0) ? st->goodput * 8 / st->baudRate : 0;
   return 1;
 }
 
 
-// For llopen and llclose (UA, DISC) - frameNum not needed for SU-frames feedback
-inline int readSU_OC(unsigned char *buf, unsigned char ctrl)
-{
-  return readSU(buf, ctrl, -1);
-}
-// For llread and llwrite (RR0, RR1, REJ0, REJ1) - ctrl not needed for I-Frame feedback
-inline int readSU_RW(unsigned char *buf, int frameNum)
+////////////////////////////////////////////////
+// LLFLUSH
+////////////////////////////////////////////////
+int llflush()
 {
-  return readSU(buf, 0xFF, frameNum);
+  while (txBase != txNext) {
+    if (waitAck() == -1) {
+      return -1;
+    }
+  }
+  return 1;
 }
-// Read Supervision/Unnumbered Frames
-static int readSU(unsigned char *buf, unsigned char ctrl, int frameNum)
+
+
+////////////////////////////////////////////////
+// LLPOLL
+////////////////////////////////////////////////
+int llpoll(unsigned char *buf)
 {
-  SU_State currState = SU_START;
-  unsigned char currByte;
+  RxFrame frame;
 
-  // !! PASSAR ESTE WHILE PARA RECEBER UM A UM (É ISSO QUE É O PART LÁ EM BAIXO) - o que é isto??
-  while (currState != SU_DONE && ((!alarmEnabled && currRole == LlTx) || currRole == LlRx)) {
-    // Receiver stays here until it reads SET,
-    // Transmitter has timeout if not received UA, to send SET again
+  if (currRole != LlTx || duplex || llflush() == -1) {
+    return -1;
+  }
 
-    if (readByteSerialPort(&currByte) == -1) { // Read error
-      errorCount++;
+  // Like SET/UA in llopen - POLL is sent again until the answer comes
+  int timeouts = 0;
+  int readRet;
+  while (timeouts < currRetransmissions) {
+    if (writeSU(SU_Addr_TX, SU_C_POLL) == -1) {
+      stats.errors++;
+      TRACE(TrError, "Tx write error!");
       return -1;
     }
+    timerStart(TIMER_CTRL, lineBusyUs() + rtoUs);
 
-    printf("The received byte is: 0x%02x\n", currByte);
+    // RR of frames already acknowledged, or a repeated UA, may still be on the way
+    do {
+      readRet = readI(rxBuf, &frame, ReadTimed);
+    } while (readRet == 1 && (frame.ctrl != SU_C_ANSWER || frame.dataLen < 1 || !frame.bcc2Ok));
+    timerStop(TIMER_CTRL);
 
+    if (readRet == -1) {
+      stats.errors++;
+      TRACE(TrError, "Tx readI error!");
+      return -1;
+    }
+    if (readRet == 1 && frame.dataLen <= MAX_ANSWER_SIZE) {
+      memcpy(buf, frame.data, frame.dataLen);
+      TRACE1(TrInfo, "Answer of %lld byte(s) received!", frame.dataLen);
+      return frame.dataLen;
+    }
+    timeouts++;
+    stats.timeouts++;
+    stats.retransmissions++;
+    rtoBackoff();
+    TRACE(TrInfo, "Tx POLL timeout!");
+  }
 
-    switch(currState) {
-      case SU_START:
-        if (currByte == SU_Flag) {
-          currState = SU_FLAG_STATE;
-          buf[0] = currByte;
-          printf("State has changed from SU_START to SU_FLAG_STATE\n");
-        }
-        else {
-          memset(buf, 0, sizeof(SU_BUF_SIZE));
-          printf("State didn't change from SU_START because the byte isn't a Flag. Cleared the buffer\n");
-        }
-        break;
+  TRACE(TrError, "Maximum retransmissions reached, no answer to POLL!");
+  return -1;
+}
 
-      case SU_FLAG_STATE:
-        if (currByte == SU_Addr_TX) {
-          currState = SU_A_STATE;
-          printf("State has changed from SU_FLAG_STATE to SU_A_STATE\n");
-          buf[1] = currByte;
-        }
-        else if (currByte == SU_Flag) {
-          printf("State didn't change from SU_FLAG_STATE because the byte is a Flag, again.");
-          continue;
-        }
-        else {
-          memset(buf, 0, sizeof(SU_BUF_SIZE));
-          currState = SU_START;
-          printf("State has changed from SU_FLAG_STATE to SU_START because the byte isn't an Address byte or a Flag. Cleared the buffer\n");
-        }
-        break;
 
-      case SU_A_STATE:
-        // !! For llopen and llclose
-        if (ctrl != 0xFF) { // && frameNum == -1
-          if (currByte == ctrl) {
-            currState = SU_C_STATE;
-            buf[2] = currByte;
-            printf("State has changed from SU_A_STATE to SU_C_STATE.\n");
+////////////////////////////////////////////////
+// LLANSWER
+////////////////////////////////////////////////
+int llanswer(const unsigned char *buf, int len)
+{
+  if (currRole != LlRx || len < 1 || len > MAX_ANSWER_SIZE) {
+    return -1;
+  }
+  memcpy(rxAnswer, buf, len);
+  rxAnswerLen = len;
+  return 1;
+}
+
+
+////////////////////////////////////////////////
+// LLPENDING
+////////////////////////////////////////////////
+int llpending()
+{
+  return txNext - txBase;
+}
+
+
+////////////////////////////////////////////////
+// LLMAXPAYLOAD
+////////////////////////////////////////////////
+int llmaxpayload()
+{
+  return adaptive ? txPayload : payloadSize;
+}
+
+
+// Allocate the frame buffers for payloads of up to payload bytes (the reorder slots only if slots is TRUE)
+// Returns -1 if there is no memory, 1 otherwise
+static int allocBuffers(int payload, int slots)
+{
+  freeBuffers();
+  bufPayload = payload;
+  txFrameBuf = malloc((size_t)MAX_WINDOW_SIZE * TX_FRAME_SIZE(payload));
+  rxBuf = malloc(payload);
+  rxSlotBuf = slots ? malloc((size_t)SEQ_MOD_EXT * payload) : NULL;
+  rxFecCap = FEC_MAX_LEN(payload + FCS_MAX_LEN);
+  rxFecBuf = malloc(rxFecCap); // Whatever Tx proposes is agreed to
+
+  if (txFrameBuf == NULL || rxBuf == NULL || (slots && rxSlotBuf == NULL) || rxFecBuf == NULL) {
+    freeBuffers();
+    return -1;
+  }
+  return 1;
+}
+
+static void freeBuffers()
+{
+  free(txFrameBuf);
+  free(rxBuf);
+  free(rxSlotBuf);
+  free(rxFecBuf);
+  txFrameBuf = rxBuf = rxSlotBuf = rxFecBuf = NULL;
+  bufPayload = 0;
+}
+
+
+// Adaptive payload size - the frame length with the best efficiency for the bit error rate p
+// measured since the last update. A frame of L payload and h overhead bits gets through with
+// (1 - p)^(L + h), so its efficiency L / (L + h) * (1 - p)^(L + h) peaks at
+// L = (sqrt(h^2 + 4h/k) - h) / 2, with k = -ln(1 - p)
+static void adaptPayload()
+{
+  // A frame of n bits is lost with 1 - (1 - p)^n, so k = -ln(1 - lost fraction) / n
+  // (losses are counted against the frames that got through - Go-Back-N resends whole windows)
+  unsigned int total = adaptFrames + adaptErrors;
+  double frameBits = 8.0 * adaptWireBytes / (adaptSent ? adaptSent : 1);
+  double lost = adaptFrames ? (double)adaptErrors / total : 1 - 0.5 / total;
+  double k = -log1p(-lost) / frameBits;
+
+  // Smoothed, so one clean stretch doesn't jump straight to the largest frames (nor one burst to the smallest)
+  adaptLoss += (k - adaptLoss) / 4;
+
+  double h = adaptOverheadBits();
+  int best = payloadSize;
+  if (adaptLoss > 0) {
+    double l = (sqrt(h * h + 4 * h / adaptLoss) - h) / 2 / 8;
+    best = (l < payloadSize) ? (int)l : payloadSize;
+  }
+  if (best < MIN_PAYLOAD_SIZE) {
+    best = MIN_PAYLOAD_SIZE;
+  }
+
+  if (best != txPayload) {
+    TRACE2(TrInfo, "%llu of %llu frames lost", adaptErrors, total);
+    TRACE2(TrInfo, "Payload size %lld -> %lld bytes", txPayload, best);
+    txPayload = best;
+  }
+  adaptFrames = adaptErrors = adaptSent = 0;
+  adaptWireBytes = 0;
+}
+
+// Bits each frame costs besides its payload - header, check sequence and closing flag, plus the RR answering it
+// (FEC parity grows with the payload - only one codeword's worth is counted)
+static double adaptOverheadBits()
+{
+  return 8.0 * (5 + fcsLen(fcsType) + fecParity + SU_BUF_SIZE);
+}
+
+
+// Wait for one RR/REJ (or the timeout of the oldest frame) and update the Tx window
+// (full duplex takes whatever the other side sends meanwhile)
+// Returns -1 on error or when the retransmissions are exhausted, 1 otherwise
+static int waitAck()
+{
+  unsigned char retBuf[SU_BUF_SIZE] = {0};
+  int readRet, len;
+
+  if (timerRemainingUs() == -1) { // Outstanding frames without timers - already given up on
+    return -1;
+  }
+
+  if (duplex) {
+    return (duplexRead(NULL, ReadTimed, &len) == -1) ? -1 : 1;
+  }
+
+  if ((readRet = readSU(retBuf, txAddr, TRUE)) == -1) {
+    stats.errors++;
+    TRACE(TrError, "Tx readSU error!");
+    return -1;
+  }
+
+  return (readRet == 0) ? txTimeout() : txAck(retBuf[2]);
+}
+
+
+// The oldest timer of the Tx window expired: Go-Back-N resends the whole window, Selective
+// Repeat only the frame that timed out
+// Returns -1 on error or when the retransmissions are exhausted, 1 otherwise
+static int txTimeout()
+{
+  int slot = timerFirstExpired();
+  unsigned int n = txBase + (unsigned int)((slot - (int)(txBase % MAX_WINDOW_SIZE) + MAX_WINDOW_SIZE) % MAX_WINDOW_SIZE);
+  stats.timeouts++;
+  adaptErrors++;
+  if (!selRepeat) { // The window times out as a whole, so its frames count the timeout once each
+    for (n = txBase; n != txNext; n++) {
+      txTimeouts[n % MAX_WINDOW_SIZE]++;
+    }
+    n = txBase;
+    slot = n % MAX_WINDOW_SIZE;
+  }
+  else {
+    txTimeouts[slot]++;
+  }
+  if (txTimeouts[slot] >= currRetransmissions) {
+    TRACE(TrError, "Maximum retransmissions reached, RR not received!");
+    timerStopAll();
+    return -1;
+  }
+  // The RTO stays backed off until the next sample (resent frames give none, see Karn's rule in txAck())
+  rtoBackoff();
+  TRACE(TrInfo, "Tx timeout!");
+  return selRepeat ? resendFrames(n, n + 1) : resendFrames(txBase, txNext);
+}
+
+
+// RR/REJ/SREJ (control field ctrl) answering our I frames - slide the Tx window, resend what is asked for
+// Returns -1 on error, 1 otherwise
+static int txAck(unsigned char ctrl)
+{
+  int seq;
+
+  if ((seq = seqFromRR(ctrl)) >= 0) { // Cumulative - acknowledges everything before seq
+    unsigned int ackNext = seqToFrame(seq);
+    if (ackNext > txBase && ackNext <= txNext) {
+      int last = (ackNext - 1) % MAX_WINDOW_SIZE; // The frame this RR answers
+      if (!txResent[last]) {
+        long long rtt = timerNowUs() - txSentAt[last];
+        rttSample((rtt > 0) ? rtt : 0);
+      }
+      ackFrames(ackNext);
+    }
+    return 1;
+  }
+
+  if ((seq = seqFromREJ(ctrl)) >= 0) { // Acknowledges everything before seq and asks for the rest
+    unsigned int rejFrame = seqToFrame(seq);
+    if (rejFrame >= txBase && rejFrame < txNext) {
+      ackFrames(rejFrame);
+      adaptErrors++;
+      stats.rejs++;
+      TRACE1(TrInfo, "REJ received! Resending %llu frame(s)", txNext - txBase);
+      return resendFrames(txBase, txNext);
+    }
+    return 1;
+  }
+
+  if ((seq = seqFromSREJ(ctrl)) >= 0) { // Only that frame was lost
+    unsigned int srejFrame = seqToFrame(seq);
+    if (srejFrame >= txBase && srejFrame < txNext) {
+      adaptErrors++;
+      stats.srejs++;
+      TRACE1(TrInfo, "SREJ received! Resending frame %lld", seq);
+      return resendFrames(srejFrame, srejFrame + 1);
+    }
+  }
+
+  return 1; // Stale or unrelated SU frame
+}
+
+
+// Frames before next were received - stop their timers and slide the window
+static void ackFrames(unsigned int next)
+{
+  long long now = traceNowNs();
+  for (; txBase != next; txBase++) {
+    timerStop(txBase % MAX_WINDOW_SIZE);
+    traceStamp(txBase, TrTxAcked, now);
+    adaptFrames++;
+  }
+  if (adaptive && adaptFrames + adaptErrors >= ADAPT_FRAMES) {
+    adaptPayload();
+  }
+
+  // Go-Back-N counts timeouts of the window - progress starts them over
+  for (unsigned int n = txBase; !selRepeat && n != txNext; n++) {
+    txTimeouts[n % MAX_WINDOW_SIZE] = 0;
+  }
+}
+
+
+// New round-trip time measurement - updates the smoothed RTT, its deviation and the RTO
+// (which also ends any backoff)
+static void rttSample(long long rttUs)
+{
+  if (rttSamples++ == 0) {
+    srttUs = rttUs;
+    rttvarUs = rttUs / 2;
+  }
+  else {
+    long long err = (srttUs > rttUs) ? srttUs - rttUs : rttUs - srttUs;
+    rttvarUs += (err - rttvarUs) / 4; // beta = 1/4
+    srttUs += (rttUs - srttUs) / 8;   // alpha = 1/8
+  }
+
+  rtoUs = srttUs + 4 * rttvarUs;
+  if (rtoUs < RTO_MIN_MS * 1000LL) {
+    rtoUs = RTO_MIN_MS * 1000LL;
+  }
+  if (rtoUs > RTO_MAX_MS * 1000LL) {
+    rtoUs = RTO_MAX_MS * 1000LL;
+  }
+}
+
+
+// Repeated loss of SET/DISC/UA or of I frames - double the RTO until an RTT sample is taken again
+static void rtoBackoff()
+{
+  rtoUs *= 2;
+  if (rtoUs > RTO_MAX_MS * 1000LL) {
+    rtoUs = RTO_MAX_MS * 1000LL;
+  }
+}
+
+
+// Resend the outstanding frames in [first, last) and restart their timers
+// Returns -1 on error, 1 otherwise
+static int resendFrames(unsigned int first, unsigned int last)
+{
+  for (unsigned int n = first; n != last; n++) {
+    int slot = n % MAX_WINDOW_SIZE;
+    unsigned char *frame = frameHeader(txFrame(slot), txAddr, ctrlI(n));
+    int len = (txFrame(slot) - frame) + txFrameLen[slot];
+    if (writeFrame(frame, len) == -1) {
+      stats.errors++;
+      TRACE(TrError, "Tx write error!");
+      return -1;
+    }
+    traceStamp(n, TrTxWritten, traceNowNs()); // Counted as a resend
+    ackPending = FALSE;
+    // Each timeout in a row already doubled the RTO (see txTimeout())
+    timerStart(slot, lineBusyUs() + rtoUs);
+    txResent[slot] = TRUE;
+    stats.retransmissions++;
+    adaptSent++;
+    adaptWireBytes += len;
+  }
+
+  // Frames too large for the line are lost over and over - don't wait for acknowledgements to shrink them
+  if (adaptive && adaptFrames + adaptErrors >= ADAPT_FRAMES) {
+    adaptPayload();
+  }
+  return 1;
+}
+
+
+// Write a frame to the serial port and keep track of the time the line needs to send it
+// Returns -1 on error (or partial write), 1 otherwise
+static int writeFrame(const unsigned char *buf, int len)
+{
+  if (writeBytesSerialPort(buf, len) != len) {
+    return -1;
+  }
+  long long now = traceNowNs();
+  lineFreeNs = ((lineFreeNs > now) ? lineFreeNs : now) + len * byteNs;
+  stats.txBytes += len;
+  return 1;
+}
+
+// Time until the line has sent everything written so far
+static long long lineBusyUs()
+{
+  long long left = lineFreeNs - traceNowNs();
+  return (left > 0) ? left / 1000 : 0;
+}
+
+
+// Send Supervision/Unnumbered Frames
+static int writeSU(unsigned char addr, unsigned char ctrl)
+{
+  unsigned char buf[SU_BUF_SIZE];
+  prepSU(buf, addr, ctrl);
+
+  if (writeFrame(buf, SU_BUF_SIZE) == -1) {
+    return -1;
+  }
+  if (seqFromREJ(ctrl) >= 0) {
+    stats.rejs++;
+  }
+  else if (seqFromSREJ(ctrl) >= 0) {
+    stats.srejs++;
+  }
+  TRACE(TrDebug, "Unnumbered (U) message written!");
+  return 1;
+}
+
+
+// Put the header of a frame (flag, address, control field and BCC1) right before its data field
+// at body - the control field and BCC1 are stuffed, since in full duplex they may be a flag
+// Returns where the frame starts (at most I_HDR_MAX bytes before body)
+static unsigned char *frameHeader(unsigned char *body, unsigned char addr, unsigned char ctrl)
+{
+  unsigned char header[I_HDR_MAX];
+  unsigned char fields[2] = {ctrl, I_BCC1(addr, ctrl)};
+  unsigned char unused = 0;
+
+  header[0] = I_Flag;
+  header[1] = addr;
+  int n = 2 + stuffBytesScalar(header + 2, fields, 2, &unused);
+  memcpy(body - n, header, n);
+  return body - n;
+}
+
+
+// Build the rest of a frame at body: stuffed data field (head followed by data),
+// stuffed check sequence, stuffed FEC parity of both (if parity > 0) and closing flag
+// Returns its length
+static int frameBody(unsigned char *body, const unsigned char *head, int headLen,
+                     const unsigned char *data, int len, int fcs, int parity)
+{
+  unsigned char check[FCS_MAX_LEN];
+  unsigned char bcc2 = 0;
+
+  // Byte stuffing the data (BCC2 is computed in the same pass, a CRC needs its own)
+  int j = stuffBytes(body, head, headLen, &bcc2);
+  j += stuffBytes(body + j, data, len, &bcc2);
+  if (fcs == FCS_XOR) {
+    check[0] = bcc2;
+  }
+  else {
+    fcsFinal(fcs, fcsUpdate(fcs, fcsUpdate(fcs, fcsInit(fcs), head, headLen), data, len), check);
+  }
+
+  // Preparing Trailer (the check sequence must be stuffed as well)
+  j += stuffBytesScalar(body + j, check, fcsLen(fcs), &bcc2);
+  if (parity > 0) {
+    FecEncoder enc;
+    unsigned char fec[FEC_MAX_PARITY * FEC_MAX_CODEWORDS];
+    int fieldLen = headLen + len + fcsLen(fcs);
+
+    fecInit(&enc, fieldLen, parity);
+    fecUpdate(&enc, head, headLen);
+    fecUpdate(&enc, data, len);
+    fecUpdate(&enc, check, fcsLen(fcs));
+    fecFinal(&enc, fec);
+    j += stuffBytes(body + j, fec, fecCodedLen(fieldLen, parity) - fieldLen, &bcc2);
+  }
+  body[j++] = I_Flag;
+  return j;
+}
+
+
+// Send SET/UA (or the ANSWER to POLL) with a parameter list in the data field (protected by BCC2, so any peer can parse it)
+// An empty list sends the plain SU frame
+static int writeParams(unsigned char ctrl, const unsigned char *params, int len)
+{
+  unsigned char buf[I_BUF_SIZE(PARAMS_MAX_LEN)];
+
+  if (len == 0) {
+    return writeSU(SU_Addr_TX, ctrl);
+  }
+
+  unsigned char *body = buf + I_HDR_MAX;
+  int bodyLen = frameBody(body, NULL, 0, params, len, FCS_XOR, 0);
+  unsigned char *frame = frameHeader(body, SU_Addr_TX, ctrl);
+  if (writeFrame(frame, (body - frame) + bodyLen) == -1) {
+    return -1;
+  }
+  TRACE1(TrDebug, "Unnumbered (U) message with %lld parameter byte(s) written!", len);
+  return 1;
+}
+
+
+// Rx: UA with whatever was agreed to in llopen
+static int writeUA()
+{
+  return writeParams(SU_C_UA, uaParams, uaParamsLen);
+}
+
+
+// Find a parameter in a TLV list (malformed lists end the search)
+// Returns its length and points *value to it, or -1 if it isn't there
+static int findParam(const unsigned char *params, int len, unsigned char type, const unsigned char **value)
+{
+  int i = 0;
+  while (i + 2 <= len && i + 2 + params[i + 1] <= len) {
+    if (params[i] == type) {
+      *value = params + i + 2;
+      return params[i + 1];
+    }
+    i += 2 + params[i + 1];
+  }
+  return -1;
+}
+
+
+// Wait for a specific SU frame until a timer expires (other SU frames are ignored)
+// Returns -1 on error, 0 on timeout, 1 if the frame was received
+static int waitSU(unsigned char addr, unsigned char ctrl)
+{
+  unsigned char retBuf[SU_BUF_SIZE] = {0};
+  int readRet;
+
+  while ((readRet = readSU(retBuf, addr, TRUE)) == 1) {
+    if (retBuf[2] == ctrl) {
+      return 1;
+    }
+  }
+  return readRet;
+}
+
+
+// Read Supervision/Unnumbered Frames with the given address (control field is left in buf[2])
+// If timed, gives up when a timer expires
+// Returns -1 on error, 0 on timeout, 1 if a frame was received
+static int readSU(unsigned char *buf, unsigned char addr, int timed)
+{
+  SU_State currState = SU_START;
+  unsigned char currByte;
+  const unsigned char *chunk;
+  long long waitUs = -1;
+  int chunkLen, i;
+
+  while (currState != SU_DONE) {
+    if (timed) {
+      waitUs = timerRemainingUs();
+    }
+
+    // Work on whatever the serial port buffered, leave what comes after the frame there
+    if ((chunkLen = peekSerialPort(&chunk, waitUs)) == -1) { // Read error
+      stats.errors++;
+      return -1;
+    }
+
+    // Transmitter has timeout if no reply was received, to send the frame again
+    // (a reply that arrived while Tx was busy elsewhere still counts)
+    if (timed && chunkLen == 0 && timerRemainingUs() == 0) {
+      return 0;
+    }
+
+    for (i = 0; i < chunkLen && currState != SU_DONE; i++) {
+      currByte = chunk[i];
+      TRACE1(TrByte, "The received byte is: 0x%02llx", currByte);
+
+
+      switch(currState) {
+        case SU_START:
+          if (currByte == SU_Flag) {
+            currState = SU_FLAG_STATE;
+            buf[0] = currByte;
+            TRACE(TrByte, "State has changed from SU_START to SU_FLAG_STATE");
+          }
+          else {
+            memset(buf, 0, SU_BUF_SIZE);
+            TRACE(TrByte, "State didn't change from SU_START because the byte isn't a Flag. Cleared the buffer");
+          }
+          break;
+
+        case SU_FLAG_STATE:
+          if (currByte == addr) {
+            currState = SU_A_STATE;
+            TRACE(TrByte, "State has changed from SU_FLAG_STATE to SU_A_STATE");
+            buf[1] = currByte;
           }
           else if (currByte == SU_Flag) {
-            currState = SU_FLAG_STATE;
-            memset(buf, 0, sizeof(SU_BUF_SIZE));
-            buf[1] = SU_Flag;
-            printf("State has changed from SU_A_STATE to SU_FLAG_STATE because the byte is a Flag.\n");
+            TRACE(TrByte, "State didn't change from SU_FLAG_STATE because the byte is a Flag, again.");
           }
           else {
+            memset(buf, 0, SU_BUF_SIZE);
             currState = SU_START;
-            memset(buf, 0, sizeof(SU_BUF_SIZE));
-            printf("State has changed from SU_A_STATE to SU_START because the byte isn't a Control byte or a Flag. Cleared the buffer\n");
+            TRACE(TrByte, "State has changed from SU_FLAG_STATE to SU_START because the byte isn't an Address byte or a Flag. Cleared the buffer");
           }
-        }
-        // !! For llread and llwrite
-        else { // ctrl == 0xFF (obviously && frameNum != -1)
-          if (currByte == SU_C_RR(frameNum)) {
+          break;
+
+        case SU_A_STATE:
+          if (currByte == SU_Flag) {
+            currState = SU_FLAG_STATE;
+            memset(buf, 0, SU_BUF_SIZE);
+            buf[0] = SU_Flag;
+            TRACE(TrByte, "State has changed from SU_A_STATE to SU_FLAG_STATE because the byte is a Flag.");
+          }
+          else { // Any control field - the caller decides what to do with it
             currState = SU_C_STATE;
             buf[2] = currByte;
-            printf("State has changed from SU_A_STATE to SU_C_STATE.\n");
+            TRACE(TrByte, "State has changed from SU_A_STATE to SU_C_STATE.");
           }
-          else if (currByte == SU_C_REJ(frameNum)) {
-            printf("Function will return 0 because REJ response was reached!\n");
-            return 0;
+          break;
+
+        case SU_C_STATE:
+          if (currByte == SU_BCC1(buf[1], buf[2])) { // Uses BCC to check if the message is correctly received
+            currState = SU_BCC_STATE;
+            buf[3] = currByte;
+            TRACE(TrByte, "State has changed from SU_C_STATE to SU_BCC_STATE.");
           }
           else if (currByte == SU_Flag) {
             currState = SU_FLAG_STATE;
-            memset(buf, 0, sizeof(SU_BUF_SIZE));
-            buf[1] = SU_Flag;
-            printf("State has changed from SU_A_STATE to SU_FLAG_STATE because the byte is a Flag.\n");
+            memset(buf, 0, SU_BUF_SIZE);
+            buf[0] = SU_Flag;
+            TRACE(TrByte, "State has changed from SU_C_STATE to SU_FLAG_STATE because the byte is a Flag.");
           }
           else {
             currState = SU_START;
-            memset(buf, 0, sizeof(SU_BUF_SIZE));
-            printf("State has changed from SU_A_STATE to SU_START because the byte isn't a Control byte or a Flag. Cleared the buffer\n");
+            memset(buf, 0, SU_BUF_SIZE);
+            stats.bcc1Errors++;
+            TRACE(TrByte, "State has changed from SU_C_STATE to SU_START because the byte isn't a BCC byte or a Flag. Cleared the buffer");
           }
-        }
-        break;
-
+          break;
 
-      case SU_C_STATE:
-        if (currByte == SU_BCC1(buf[1], buf[2])) { // Uses BCC to check if the message is correctly received
-          currState = SU_BCC_STATE;
-          buf[3] = currByte;
-          printf("State has changed from SU_C_STATE to SU_BCC_STATE.\n");
-        }
-        else if (currByte == SU_Flag) {
-          currState = SU_FLAG_STATE;
-          memset(buf, 0, sizeof(SU_BUF_SIZE));
-          buf[1] = SU_Flag;
-          printf("State has changed from SU_C_STATE to SU_FLAG_STATE because the byte is a Flag.\n");
-        }
-        else {
-          currState = SU_START;
-          memset(buf, 0, sizeof(SU_BUF_SIZE));
-          printf("State has changed from SU_C_STATE to SU_START because the byte isn't a BCC byte or a Flag. Cleared the buffer\n");
-        }
-        break;
+        case SU_BCC_STATE:
+          if (currByte == SU_Flag) {
+            currState = SU_DONE;
+            buf[4] = currByte;
+            TRACE(TrByte, "State has changed from SU_BCC_STATE to SU_DONE");
+          }
+          else {
+            currState = SU_START;
+            memset(buf, 0, SU_BUF_SIZE);
+            TRACE(TrByte, "State has changed from SU_BCC_STATE to SU_START because the byte isn't a Flag. Cleared the buffer");
+          }
+          break;
 
-      case SU_BCC_STATE:
-        if (currByte == SU_Flag) {
-          currState = SU_DONE;
-          buf[4] = currByte;
-          printf("State has changed from SU_BCC_STATE to SU_DONE\n");
-        }
-        else {
-          currState = SU_START;
-          memset(buf, 0, sizeof(SU_BUF_SIZE));
-          printf("State has changed from SU_C_STATE to SU_START because the byte isn't a BCC byte or a Flag. Cleared the buffer\n");
-        }
-        break;
+        default:
+          break;
+      }
     }
-  }
-
-  // Read timeout
-  if (alarmEnabled) { // Only for LlTx
-    alarmEnabled == FALSE;
-    return 0;
+    consumeSerialPort(i);
+    stats.rxBytes += i;
   }
 
   // Read success
-  printf("SET message received!\n");
+  TRACE1(TrDebug, "SU message received (C = 0x%02llx)!", buf[2]);
   return 1;
 }
 
 
+// Where the payload of a frame goes, decided as soon as its header is known:
+// the frame in sequence goes straight into the application's packet, a Selective
+// Repeat frame after a gap into its reorder slot, anything else to scratch
+// Full duplex may have no packet (llwrite() waiting) or frames llread() didn't take yet -
+// the frame in sequence waits in its slot too then, as long as one is free
+static unsigned char *rxFrameDest(unsigned char ctrl, unsigned char *packet)
+{
+  int seq = seqI(ctrl);
+  if (seq < 0) {
+    return rxBuf;
+  }
+
+  int mod = (duplex || IS_I_CX(ctrl)) ? SEQ_MOD_EXT : SEQ_MOD_SW;
+  int ahead = (seq - (int)(rxExpected % mod) + mod) % mod;
+  if (ahead == 0 && packet != NULL && rxDeliver == rxExpected) {
+    return packet;
+  }
+  // One slot is always left free, so the Selective Repeat scan in rxIFrame() ends
+  int room = (rxExpected + ahead - rxDeliver < SEQ_MOD_EXT - 1);
+  if ((ahead == 0 || (selRepeat && ahead < MAX_SR_WINDOW_SIZE)) && room && !rxHave[seq]) {
+    return rxSlot(seq);
+  }
+  return rxBuf;
+}
+
+
+// The serial port hands over a chunk at once, but its bytes arrived one after another: a byte
+// with after more behind it in a chunk read at readNs arrived about after byte times earlier
+// (on a paced line - the others deliver them all at once), though not before sinceNs: a
+// termios port may be a relay that isn't paced at all, and a burst must not be spread back
+static long long arrivedNs(long long readNs, long long sinceNs, int after)
+{
+  long long at = readNs - after * byteNs;
+  return (at > sinceNs) ? at : sinceNs;
+}
+
 // Read Information Frame
-static int readSU(unsigned char *buf, unsigned char ctrl)
+// Also recognizes the SU commands Tx may send while Rx is reading (SET, DISC), and the
+// SET/UA with parameters of llopen
+// The data field is destuffed in bulk straight to rxFrameDest(), with BCC2 checked in the
+// same pass (the check sequence never takes room there, so bufPayload bytes are enough).
+// With FEC, I frames go to rxFecBuf instead, and their payload is copied over once corrected
+// Full duplex takes the frames of both addresses (and unstuffs their headers, see frameHeader())
+// Unless wait is ReadBlock, gives up when a timer expires (ReadPoll: when nothing is arriving) -
+// but not while a frame is arriving, a frame cut in two would be lost
+// Returns -1 on error, 0 on timeout, 1 when a frame with a valid header was received
+static int readI(unsigned char *packet, RxFrame *frame, ReadWait wait)
 {
+  I_STATE currState = I_START;
+  unsigned char currByte;
+  unsigned char *data = rxBuf;
+  unsigned char *coded = rxBuf; // Where the data field is destuffed to - data, or rxFecBuf with FEC
+  int codedCap = bufPayload;
+  DestuffState destuff = DESTUFF_INIT;
+  const unsigned char *chunk;
+  long long waitUs = -1;
+  int chunkLen, i;
+  int stuffedLen = 0; // Data field bytes on the wire (with the closing flag)
+  int escaped = FALSE; // Last header byte was STUFF_ESC
+  long long now = 0, flagNs = 0; // Arrival of the current chunk, and of the last flag in it
+  long long waitNs = 0, sinceNs = 0; // When the wait for the chunk began, and the earliest its bytes arrived
+
+  while (currState != I_DONE) {
+    switch (wait) {
+      case ReadBlock:
+        waitUs = -1;
+        break;
+      case ReadTimed:
+      case ReadLine:
+        waitUs = (currState == I_START) ? timerRemainingUs() : rtoUs;
+        break;
+      case ReadPoll:
+        waitUs = (currState == I_START) ? 0 : rtoUs;
+        break;
+    }
 
-}
\ No newline at end of file
+    // Work on whatever the serial port buffered, leave what comes after the frame there
+    waitNs = (byteNs > 0) ? traceNowNs() : 0;
+    if ((chunkLen = peekSerialPort(&chunk, waitUs)) == -1) { // Read error
+      return -1;
+    }
+    if (wait != ReadBlock && chunkLen == 0 && (wait == ReadPoll || currState != I_START || timerRemainingUs() == 0)) {
+      return 0;
+    }
+    now = traceNowNs(); // One clock read per chunk - its bytes are dated from it (see arrivedNs())
+
+    // Bytes already waiting came after the last chunk was taken; if the port had to wait for them
+    // (longer than a byte takes), the first one only just came, and a paced line sent few more since
+    sinceNs = (now - waitNs > byteNs) ? now : rxReadNs;
+    rxReadNs = now;
+
+    i = 0;
+    while (i < chunkLen && currState != I_DONE) {
+      if (currState == I_DATA_STATE) {
+        int frameEnd;
+        int used = destuffBytes(coded, codedCap, chunk + i, chunkLen - i, &destuff, &frameEnd);
+        i += used;
+        stuffedLen += used;
+
+        if (DESTUFF_OVERFLOW(&destuff, codedCap)) { // Too long, can't be a valid frame
+          currState = frameEnd ? I_FLAG_STATE : I_START;
+          flagNs = frameEnd ? arrivedNs(now, sinceNs, chunkLen - i) : flagNs;
+        }
+        else if (frameEnd) {
+          // I frames use the negotiated check sequence (and FEC), the SET/UA parameters always BCC2
+          int fcs = (seqI(frame->ctrl) >= 0) ? fcsType : FCS_XOR;
+          int fieldLen = destuff.len;
+          if (coded == rxFecBuf) {
+            fieldLen = (destuff.len <= codedCap) ? fecFieldLen(destuff.len, fecParity) : -1;
+          }
+          int dataLen = fieldLen - fcsLen(fcs);
+          if (fieldLen < 0 || dataLen < 1 || dataLen > bufPayload) { // Not payload + check sequence - take the flag as an opening one
+            currState = I_FLAG_STATE;
+            flagNs = arrivedNs(now, sinceNs, chunkLen - i);
+            continue;
+          }
+          frame->doneNs = arrivedNs(now, sinceNs, chunkLen - i);
+          frame->data = data;
+          frame->dataLen = dataLen;
+          if (fcs == fcsType && seqI(frame->ctrl) >= 0) { // I frames only
+            stats.fieldBytes += destuff.len;
+            stats.stuffedBytes += stuffedLen - 1;
+          }
+          if (coded == rxFecBuf) {
+            // Corrected first - the check sequence then catches what FEC got wrong
+            int corrected = fecDecode(rxFecBuf, destuff.len, fecParity);
+            if (corrected == -1) {
+              frame->bcc2Ok = FALSE;
+            }
+            else if (fcs == FCS_XOR) {
+              frame->bcc2Ok = (funcI_BCC2(rxFecBuf, fieldLen) == 0);
+            }
+            else {
+              unsigned char calc[FCS_MAX_LEN];
+              fcsCompute(fcs, rxFecBuf, dataLen, calc);
+              frame->bcc2Ok = (memcmp(rxFecBuf + dataLen, calc, fcsLen(fcs)) == 0);
+            }
+            if (frame->bcc2Ok) {
+              memcpy(data, rxFecBuf, dataLen);
+              if (corrected > 0) {
+                stats.fecFrames++;
+                stats.fecBytes += corrected;
+                TRACE1(TrInfo, "FEC corrected %lld byte(s)", corrected);
+              }
+            }
+            else {
+              stats.fecFailures++;
+            }
+          }
+          else if (fcs == FCS_XOR) {
+            frame->bcc2Ok = (destuff.bcc == 0);
+          }
+          else {
+            unsigned char recv[FCS_MAX_LEN], calc[FCS_MAX_LEN];
+            destuffTail(data, bufPayload, &destuff, fcsLen(fcs), recv);
+            fcsCompute(fcs, data, dataLen, calc);
+            frame->bcc2Ok = (memcmp(recv, calc, fcsLen(fcs)) == 0);
+          }
+          currState = I_DONE;
+        }
+        continue;
+      }
+
+      currByte = chunk[i++];
+      int literal = escaped; // An escaped header byte is never a flag
+      if (currByte == I_Flag) {
+        flagNs = arrivedNs(now, sinceNs, chunkLen - i);
+        literal = escaped = FALSE;
+      }
+      else if (escaped) {
+        currByte = STUFF_MASK(currByte);
+        escaped = FALSE;
+      }
+      else if (currByte == STUFF_ESC && (currState == I_A_STATE || currState == I_C_STATE)) {
+        escaped = TRUE;
+        continue;
+      }
+
+      switch (currState) {
+        case I_START:
+          if (currByte == I_Flag) {
+            currState = I_FLAG_STATE;
+          }
+          break;
+
+        case I_FLAG_STATE:
+          if (currByte == I_Addr_TX || (duplex && currByte == I_Addr_RX)) {
+            frame->addr = currByte;
+            currState = I_A_STATE;
+          }
+          else if (currByte != I_Flag) {
+            currState = I_START;
+          }
+          break;
+
+        case I_A_STATE:
+          if (currByte == I_Flag && !literal) {
+            currState = I_FLAG_STATE;
+          }
+          else {
+            frame->ctrl = currByte;
+            currState = I_C_STATE;
+          }
+          break;
+
+        case I_C_STATE:
+          if (currByte == I_BCC1(frame->addr, frame->ctrl)) {
+            currState = I_BCC1_STATE;
+          }
+          else if (currByte == I_Flag && !literal) {
+            currState = I_FLAG_STATE;
+          }
+          else { // Header error - frame is ignored, Tx will resend it on timeout
+            stats.bcc1Errors++;
+            currState = I_START;
+          }
+          break;
+
+        case I_BCC1_STATE:
+          if (currByte == I_Flag) { // No data field - SU frame
+            frame->data = NULL;
+            frame->dataLen = -1;
+            frame->bcc2Ok = FALSE;
+            currState = I_DONE;
+            break;
+          }
+          // First byte of the data field - left for the destuffing kernel
+          i--;
+          data = (frame->addr == rxAddr) ? rxFrameDest(frame->ctrl, packet) : rxBuf;
+          coded = data;
+          codedCap = bufPayload;
+          if (fecParity > 0 && seqI(frame->ctrl) >= 0) {
+            coded = rxFecBuf;
+            codedCap = rxFecCap;
+          }
+          frame->flagNs = flagNs;
+          destuff = (DestuffState)DESTUFF_INIT;
+          stuffedLen = 0;
+          currState = I_DATA_STATE;
+          break;
+
+        default:
+          break;
+      }
+    }
+    consumeSerialPort(i);
+    stats.rxBytes += i;
+  }
+
+  return 1;
+}
@@ -0,0 +1,76 @@
+// Timer engine implementation
+
+#include "timer.h"
+
+#include <time.h>
+
+#include "link_layer.h" // TRUE/FALSE
+
+
+static __thread long long deadline[MAX_TIMERS]; // Expiry time in microseconds
+static __thread int running[MAX_TIMERS];
+
+
+long long timerNowUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+void timerStart(int id, long long timeoutUs)
+{
+  deadline[id] = timerNowUs() + timeoutUs;
+  running[id] = TRUE;
+}
+
+
+void timerStop(int id)
+{
+  running[id] = FALSE;
+}
+
+
+void timerStopAll()
+{
+  for (int id = 0; id < MAX_TIMERS; id++) {
+    running[id] = FALSE;
+  }
+}
+
+
+int timerRunning(int id)
+{
+  return running[id];
+}
+
+
+long long timerRemainingUs()
+{
+  long long first = -1;
+  for (int id = 0; id < MAX_TIMERS; id++) {
+    if (running[id] && (first == -1 || deadline[id] < first)) {
+      first = deadline[id];
+    }
+  }
+  if (first == -1) {
+    return -1;
+  }
+
+  long long left = first - timerNowUs();
+  return (left > 0) ? left : 0;
+}
+
+
+int timerFirstExpired()
+{
+  long long now = timerNowUs();
+  int first = -1;
+  for (int id = 0; id < MAX_TIMERS; id++) {
+    if (running[id] && deadline[id] <= now && (first == -1 || deadline[id] < deadline[first])) {
+      first = id;
+    }
+  }
+  return first;
+}
@@ -0,0 +1,501 @@
+// Per-frame latency tracing implementation
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "link_layer.h" // TRUE/FALSE
+
+
+// A frame and the time of each stage it reached (0 = not yet)
+typedef struct {
+  unsigned int frame;
+  int resends;
+  long long t[TR_STAGES];
+} TraceFrame;
+
+// Time between two stages of the same side, kept as a histogram
+typedef struct {
+  const char *name;
+  TraceStage from, to;
+} TraceSpan;
+
+static const TraceSpan spans[] = {
+  {"tx stuff", TrTxQueued, TrTxStuffed},
+  {"tx write", TrTxStuffed, TrTxWritten},
+  {"tx ack", TrTxWritten, TrTxAcked},
+  {"tx total", TrTxQueued, TrTxAcked},
+  {"rx receive", TrRxFlag, TrRxComplete},
+  {"rx deliver", TrRxComplete, TrRxDelivered},
+  {"rx total", TrRxFlag, TrRxDelivered},
+};
+#define N_SPANS (int)(sizeof(spans) / sizeof(spans[0]))
+
+static const char *stageNames[TR_STAGES] = {"queued", "stuffed", "written", "acked", "flag", "complete", "delivered"};
+
+// Frames of the connection of a thread, allocated by its first traceReset()
+typedef struct {
+  TraceFrame inFlight[2][TRACE_OPEN]; // [Tx, Rx][frame % TRACE_OPEN]
+  TraceFrame ring[TRACE_RING_SIZE];   // Last frames completed
+  unsigned long long ringCount;
+
+  unsigned long long hist[N_SPANS][TRACE_BUCKETS];
+  unsigned long long histCount[N_SPANS];
+  long long histMax[N_SPANS];
+} FrameTrace;
+
+static __thread FrameTrace *ft = NULL; // NULL (out of memory) - frames aren't traced
+static pthread_key_t ftKey;              // Frees ft when its thread exits
+static pthread_once_t ftKeyOnce = PTHREAD_ONCE_INIT;
+
+// Event log - one ring per thread, allocated on its first event
+typedef struct {
+  long long t;
+  const char *func;
+  const char *fmt;
+  long long a, b;
+  TraceLevel level;
+} TraceRecord;
+
+typedef struct {
+  TraceRecord events[TRACE_EVENTS];
+  unsigned long long count;   // Events stored so far
+  unsigned long long printed; // Events already dumped
+} EventRing;
+
+int traceLevel = TrInfo;
+static _Atomic long long eventOrigin = 0; // Time 0 of every dump - the first llopen (or event) of the process
+static __thread EventRing *myRing = NULL;
+static EventRing *eventRings[TRACE_THREADS];
+static int nEventRings = 0;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+long long traceNowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void ftKeyCreate()
+{
+  pthread_key_create(&ftKey, free);
+}
+
+// Set time 0 of the dumps, unless it already is
+static void setOrigin(long long t)
+{
+  long long unset = 0;
+  if (atomic_load_explicit(&eventOrigin, memory_order_relaxed) == 0) {
+    atomic_compare_exchange_strong(&eventOrigin, &unset, t);
+  }
+}
+
+
+void traceReset()
+{
+  if (ft == NULL) {
+    pthread_once(&ftKeyOnce, ftKeyCreate);
+    if ((ft = malloc(sizeof(FrameTrace))) != NULL) {
+      pthread_setspecific(ftKey, ft);
+    }
+  }
+  if (ft != NULL) {
+    memset(ft->inFlight, 0, sizeof(ft->inFlight));
+    memset(ft->hist, 0, sizeof(ft->hist));
+    memset(ft->histCount, 0, sizeof(ft->histCount));
+    memset(ft->histMax, 0, sizeof(ft->histMax));
+    ft->ringCount = 0;
+  }
+
+  // Only the ring of this thread - the others may be in use by their own connections
+  pthread_mutex_lock(&ringsLock);
+  if (myRing != NULL) {
+    myRing->count = myRing->printed = 0;
+  }
+  pthread_mutex_unlock(&ringsLock);
+  setOrigin(traceNowNs());
+
+  const char *level = getenv(TRACE_LEVEL_ENV);
+  if (level != NULL && *level >= '0' && *level <= '0' + TrByte) {
+    traceLevel = *level - '0';
+  }
+}
+
+
+void traceSetLevel(TraceLevel level)
+{
+  traceLevel = level;
+}
+
+
+// Ring of the calling thread (NULL if every ring is taken or out of memory)
+static EventRing *threadRing()
+{
+  if (myRing == NULL) {
+    pthread_mutex_lock(&ringsLock);
+    if (nEventRings < TRACE_THREADS && (myRing = calloc(1, sizeof(EventRing))) != NULL) {
+      eventRings[nEventRings++] = myRing;
+    }
+    pthread_mutex_unlock(&ringsLock);
+  }
+  return myRing;
+}
+
+
+void traceEvent(TraceLevel level, const char *func, const char *fmt, long long a, long long b)
+{
+  EventRing *ring = threadRing();
+  if (ring == NULL) {
+    return;
+  }
+  TraceRecord *e = &ring->events[ring->count % TRACE_EVENTS];
+  e->t = traceNowNs();
+  setOrigin(e->t); // Before llopen
+  e->func = func;
+  e->fmt = fmt;
+  e->a = a;
+  e->b = b;
+  e->level = level;
+  ring->count++;
+
+  if (level == TrError) {
+    traceEventsDump();
+  }
+}
+
+
+// Formatting of the dumps - done here with nothing but write(), since a dump may run in a
+// signal handler (even one that interrupted malloc() or stdio, whose locks snprintf() may need).
+// Appends to line (of cap bytes, n used), returns the new n.
+static int putStr(char *line, int cap, int n, const char *s, int width)
+{
+  int len = strlen(s);
+  for (int i = 0; i < len && n < cap; i++) {
+    line[n++] = s[i];
+  }
+  for (int i = len; i < width && n < cap; i++) { // Left-aligned
+    line[n++] = ' ';
+  }
+  return n;
+}
+
+// v in base 10 or 16, right-aligned in width with pad (' ' or '0')
+static int putNum(char *line, int cap, int n, long long v, int isSigned, int base, int width, char pad)
+{
+  char digits[24];
+  int nd = 0, neg = (isSigned && v < 0);
+  unsigned long long u = neg ? -(unsigned long long)v : (unsigned long long)v;
+  do {
+    digits[nd++] = "0123456789abcdef"[u % base];
+    u /= base;
+  } while (u > 0);
+  for (int i = nd + neg; i < width && n < cap; i++) {
+    line[n++] = pad;
+  }
+  if (neg && n < cap) {
+    line[n++] = '-';
+  }
+  while (nd > 0 && n < cap) {
+    line[n++] = digits[--nd];
+  }
+  return n;
+}
+
+// The formats of the TRACE macros - %lld, %llu and %llx with an optional width (0 to pad with zeros)
+static int putFormat(char *line, int cap, int n, const char *fmt, long long a, long long b)
+{
+  long long args[2] = {a, b};
+  int next = 0;
+  while (*fmt != '\0' && n < cap) {
+    if (*fmt != '%') {
+      line[n++] = *fmt++;
+      continue;
+    }
+    fmt++;
+    if (*fmt == '%') {
+      line[n++] = *fmt++;
+      continue;
+    }
+    char pad = (*fmt == '0') ? '0' : ' ';
+    int width = 0;
+    while (*fmt >= '0' && *fmt <= '9') {
+      width = width * 10 + (*fmt++ - '0');
+    }
+    while (*fmt == 'l') {
+      fmt++;
+    }
+    if (*fmt == '\0') {
+      break;
+    }
+    long long v = (next < 2) ? args[next++] : 0;
+    n = putNum(line, cap, n, v, *fmt == 'd', (*fmt == 'x') ? 16 : 10, width, pad);
+    fmt++;
+  }
+  return n;
+}
+
+static void writeLine(char *line, int cap, int n)
+{
+  n = (n < cap - 1) ? n : cap - 1;
+  line[n++] = '\n';
+  if (write(STDOUT_FILENO, line, n) < 0) {
+    return;
+  }
+}
+
+static void writeEvent(const TraceRecord *e, long long origin)
+{
+  static const char *levelNames[] = {"ERROR", "info", "debug", "byte"};
+  char line[256];
+  long long us = (e->t - origin) / 1000;
+  int n = putStr(line, sizeof(line), 0, "[", 0);
+  n = putNum(line, sizeof(line), n, us / 1000, TRUE, 10, 8, ' ');
+  n = putStr(line, sizeof(line), n, ".", 0);
+  n = putNum(line, sizeof(line), n, (us < 0) ? -us % 1000 : us % 1000, FALSE, 10, 3, '0');
+  n = putStr(line, sizeof(line), n, " ms] ", 0);
+  n = putStr(line, sizeof(line), n, levelNames[e->level], 5);
+  n = putStr(line, sizeof(line), n, " ", 0);
+  n = putStr(line, sizeof(line), n, e->func, 0);
+  n = putStr(line, sizeof(line), n, ": ", 0);
+  n = putFormat(line, sizeof(line), n, e->fmt, e->a, e->b);
+  writeLine(line, sizeof(line), n);
+}
+
+
+// Not locked - a thread may still be adding events to its ring while it is dumped
+static void dumpRings()
+{
+  unsigned long long next[TRACE_THREADS];
+  for (int r = 0; r < nEventRings; r++) {
+    EventRing *ring = eventRings[r];
+    unsigned long long oldest = (ring->count > TRACE_EVENTS) ? ring->count - TRACE_EVENTS : 0;
+    next[r] = (ring->printed > oldest) ? ring->printed : oldest;
+    if (next[r] > ring->printed) {
+      char line[96];
+      int n = putFormat(line, sizeof(line), 0, "[trace] %llu event(s) of thread %lld overwritten", next[r] - ring->printed, r);
+      writeLine(line, sizeof(line), n);
+    }
+  }
+
+  // Merge the rings by time
+  long long origin = atomic_load(&eventOrigin);
+  while (1) {
+    int first = -1;
+    for (int r = 0; r < nEventRings; r++) {
+      if (next[r] < eventRings[r]->count &&
+          (first == -1 || eventRings[r]->events[next[r] % TRACE_EVENTS].t < eventRings[first]->events[next[first] % TRACE_EVENTS].t)) {
+        first = r;
+      }
+    }
+    if (first == -1) {
+      break;
+    }
+    writeEvent(&eventRings[first]->events[next[first]++ % TRACE_EVENTS], origin);
+  }
+  for (int r = 0; r < nEventRings; r++) {
+    eventRings[r]->printed = next[r];
+  }
+}
+
+
+void traceEventsDump()
+{
+  fflush(stdout); // What was printed before goes first
+  pthread_mutex_lock(&ringsLock);
+  dumpRings();
+  pthread_mutex_unlock(&ringsLock);
+}
+
+
+static void onSignal(int sig)
+{
+  dumpRings();
+  if (sig != SIGUSR1) {
+    raise(sig); // SA_RESETHAND - dies with the default action
+  }
+}
+
+
+void traceInstallSignals()
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onSignal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  sa.sa_flags = SA_RESETHAND;
+  const int fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGABRT};
+  for (int i = 0; i < (int)(sizeof(fatal) / sizeof(fatal[0])); i++) {
+    sigaction(fatal[i], &sa, NULL);
+  }
+}
+
+
+// Values below 2^TRACE_SUB_BITS have a bucket each, above that every power of two
+// is split in 2^TRACE_SUB_BITS buckets
+static int bucketOf(long long v)
+{
+  if (v < (1 << TRACE_SUB_BITS)) {
+    return (v > 0) ? (int)v : 0;
+  }
+  int e = 63 - __builtin_clzll((unsigned long long)v);
+  return ((e - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) + (int)((v >> (e - TRACE_SUB_BITS)) & ((1 << TRACE_SUB_BITS) - 1));
+}
+
+// Smallest value that falls in bucket b
+static long long bucketLow(int b)
+{
+  if (b < (1 << TRACE_SUB_BITS)) {
+    return b;
+  }
+  int e = (b >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+  long long m = (1 << TRACE_SUB_BITS) + (b & ((1 << TRACE_SUB_BITS) - 1));
+  return m << (e - TRACE_SUB_BITS);
+}
+
+
+// Last stage of the frame reached - histograms and ring
+static void traceComplete(const TraceFrame *f)
+{
+  for (int s = 0; s < N_SPANS; s++) {
+    if (f->t[spans[s].from] != 0 && f->t[spans[s].to] != 0) {
+      long long d = f->t[spans[s].to] - f->t[spans[s].from];
+      ft->hist[s][bucketOf(d)]++;
+      ft->histCount[s]++;
+      ft->histMax[s] = (d > ft->histMax[s]) ? d : ft->histMax[s];
+    }
+  }
+  ft->ring[ft->ringCount++ % TRACE_RING_SIZE] = *f;
+}
+
+
+void traceStamp(unsigned int frame, TraceStage stage, long long t)
+{
+  if (ft == NULL) {
+    return;
+  }
+  int rx = (stage >= TrRxFlag);
+  TraceFrame *f = &ft->inFlight[rx][frame % TRACE_OPEN];
+
+  if (stage == TrTxQueued || stage == TrRxFlag) {
+    memset(f, 0, sizeof(*f));
+    f->frame = frame;
+  }
+  else if (f->frame != frame || f->t[rx ? TrRxFlag : TrTxQueued] == 0 || f->t[stage] != 0) {
+    if (stage == TrTxWritten && f->frame == frame) {
+      f->resends++;
+    }
+    return; // Not traced from its first stage, or already past this one
+  }
+
+  f->t[stage] = t;
+  if (stage == TrTxAcked || stage == TrRxDelivered) {
+    traceComplete(f);
+    f->t[rx ? TrRxFlag : TrTxQueued] = 0;
+  }
+}
+
+
+// Value below which a fraction q of the samples of histogram s fall (upper end of its bucket)
+static double percentileUs(int s, double q)
+{
+  unsigned long long rank = (unsigned long long)(q * ft->histCount[s]);
+  unsigned long long seen = 0;
+  for (int b = 0; b < TRACE_BUCKETS; b++) {
+    seen += ft->hist[s][b];
+    if (seen > rank) {
+      long long high = bucketLow(b + 1) - 1;
+      return ((high < ft->histMax[s]) ? high : ft->histMax[s]) / 1000.0;
+    }
+  }
+  return ft->histMax[s] / 1000.0;
+}
+
+
+void tracePrint()
+{
+  if (ft == NULL) {
+    return;
+  }
+
+  printf("\n---- Frame latency (us) ----\n");
+  printf("%-12s %8s %10s %10s %10s %10s %10s\n", "stage", "frames", "p50", "p90", "p99", "p99.9", "max");
+  for (int s = 0; s < N_SPANS; s++) {
+    if (ft->histCount[s] == 0) {
+      continue;
+    }
+    printf("%-12s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", spans[s].name, ft->histCount[s],
+           percentileUs(s, 0.5), percentileUs(s, 0.9), percentileUs(s, 0.99), percentileUs(s, 0.999),
+           ft->histMax[s] / 1000.0);
+  }
+}
+
+
+int traceDump(const char *role)
+{
+  const char *wanted = getenv(TRACE_FILE_ENV);
+  if (wanted == NULL || *wanted == '\0' || strcmp(wanted, "0") == 0) {
+    return 0;
+  }
+  if (ft == NULL) {
+    return -1;
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), TRACE_FILE, role);
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  // Chrome trace events - each frame is an async slice from its first stage to its last,
+  // with the stages in between as instants (timestamps in microseconds)
+  unsigned long long first = (ft->ringCount > TRACE_RING_SIZE) ? ft->ringCount - TRACE_RING_SIZE : 0;
+  long long origin = 0;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"link layer %s\"}}", role);
+  for (unsigned long long n = first; n < ft->ringCount; n++) {
+    const TraceFrame *f = &ft->ring[n % TRACE_RING_SIZE];
+    int rx = (f->t[TrRxFlag] != 0);
+    int begin = rx ? TrRxFlag : TrTxQueued;
+    int end = rx ? TrRxDelivered : TrTxAcked;
+    if (origin == 0) {
+      origin = f->t[begin];
+    }
+
+    for (int st = begin; st <= end; st++) {
+      if (f->t[st] == 0) {
+        continue;
+      }
+      const char *ph = (st == begin) ? "b" : (st == end) ? "e" : "n";
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"id\":%u,\"ts\":%.3f,\"pid\":1,\"tid\":1",
+              (st == begin || st == end) ? "frame" : stageNames[st], rx ? "rx" : "tx", ph, f->frame,
+              (f->t[st] - origin) / 1000.0);
+      if (st == begin) {
+        fprintf(file, ",\"args\":{\"frame\":%u,\"resends\":%d}", f->frame, f->resends);
+      }
+      fprintf(file, "}");
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  if (fclose(file) != 0) {
+    perror(path);
+    return -1;
+  }
+  printf("Trace of the last %llu frames written to %s\n", ft->ringCount - first, path);
+  return 1;
+}
@@ -0,0 +1,517 @@
+// Transport backends of the serial port: termios serial device, pseudo terminal slave,
+// open descriptor (socketpair, pty master) and shared memory ring
+
+#define _GNU_SOURCE // ppoll()
+
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// MISC
+#define _POSIX_SOURCE 1 // POSIX compliant source
+
+// Per thread, like the link layer above (see bond.h)
+static __thread int fd = -1;           // Descriptor of the termios and fd backends
+static __thread struct termios oldtio; // Serial port settings to restore on closing
+
+static void pairForget(int pairFd);
+
+
+////////////////////////////////////////////////
+// DESCRIPTOR (shared by the termios and fd backends)
+////////////////////////////////////////////////
+static int fdReadv(const struct iovec *iov, int iovcnt)
+{
+    int n = readv(fd, iov, iovcnt);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return 0;
+    }
+    return n;
+}
+
+static int fdWritev(const struct iovec *iov, int iovcnt)
+{
+    return writev(fd, iov, iovcnt);
+}
+
+static int fdPoll(long long timeoutUs)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    struct timespec ts = {.tv_sec = timeoutUs / 1000000, .tv_nsec = (timeoutUs % 1000000) * 1000};
+
+    // A signal only cuts the wait short
+    int ready = ppoll(&pfd, 1, (timeoutUs < 0) ? NULL : &ts, NULL);
+    if (ready < 0)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    return (ready > 0) ? 1 : 0;
+}
+
+
+////////////////////////////////////////////////
+// TERMIOS SERIAL PORT
+////////////////////////////////////////////////
+static int termiosOpen(const char *serialPort, int baudRate)
+{
+    // Open with O_NONBLOCK to avoid hanging when CLOCAL
+    // is not yet set on the serial port (changed later)
+    int oflags = O_RDWR | O_NOCTTY | O_NONBLOCK;
+    fd = open(serialPort, oflags);
+    if (fd < 0)
+    {
+        perror(serialPort);
+        return -1;
+    }
+
+    // Save current port settings
+    if (tcgetattr(fd, &oldtio) == -1)
+    {
+        perror("tcgetattr");
+        close(fd);
+        return -1;
+    }
+
+    // Convert baud rate to appropriate flag
+    tcflag_t br;
+    switch (baudRate)
+    {
+    case 1200:
+        br = B1200;
+        break;
+    case 1800:
+        br = B1800;
+        break;
+    case 2400:
+        br = B2400;
+        break;
+    case 4800:
+        br = B4800;
+        break;
+    case 9600:
+        br = B9600;
+        break;
+    case 19200:
+        br = B19200;
+        break;
+    case 38400:
+        br = B38400;
+        break;
+    case 57600:
+        br = B57600;
+        break;
+    case 115200:
+        br = B115200;
+        break;
+    case 230400:
+        br = B230400;
+        break;
+    case 460800:
+        br = B460800;
+        break;
+    case 921600:
+        br = B921600;
+        break;
+    default:
+        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600)\n");
+        close(fd);
+        return -1;
+    }
+
+    // New port settings
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+
+    newtio.c_cflag = br | CS8 | CLOCAL | CREAD;
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+
+    // Set input mode (non-canonical, no echo,...)
+    newtio.c_lflag = 0; // Non-canonic reception
+    newtio.c_cc[VTIME] = 0; // Reads never block - the timeout is up to ppoll() (see fdPoll())
+    newtio.c_cc[VMIN] = 0;
+
+    tcflush(fd, TCIOFLUSH);
+
+    // Set new port settings
+    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+    {
+        perror("tcsetattr");
+        close(fd);
+        return -1;
+    }
+
+    // Clear O_NONBLOCK (only there for the open) so writes wait for room - reads still
+    // return at once (VMIN = VTIME = 0)
+    oflags ^= O_NONBLOCK;
+    if (fcntl(fd, F_SETFL, oflags) == -1)
+    {
+        perror("fcntl");
+        close(fd);
+        return -1;
+    }
+
+    // Done
+    return fd;
+}
+
+static int termiosClose()
+{
+    // Restore the old port settings
+    if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
+    {
+        perror("tcsetattr");
+        return -1;
+    }
+
+    int res = close(fd);
+    fd = -1;
+    return res;
+}
+
+const Transport termiosTransport = {"serial", termiosOpen, fdReadv, fdWritev, fdPoll, termiosClose, 1};
+
+
+////////////////////////////////////////////////
+// PSEUDO TERMINAL
+////////////////////////////////////////////////
+// The slave end of a pair of transportPair() - set up like a serial port, but nothing
+// paces it: the bytes reach the master as soon as they are written
+static int ptyOpen(const char *port, int baudRate)
+{
+    return termiosOpen(port + strlen("pty:"), baudRate);
+}
+
+const Transport ptyTransport = {"pty", ptyOpen, fdReadv, fdWritev, fdPoll, termiosClose, 0};
+
+
+////////////////////////////////////////////////
+// OPEN DESCRIPTOR
+////////////////////////////////////////////////
+static int fdOpen(const char *port, int baudRate)
+{
+    (void) baudRate; // Not a line - nothing to configure
+    char *end;
+    long n = strtol(port + strlen("fd:"), &end, 10);
+    if (*end != '\0' || n < 0 || fcntl((int) n, F_GETFD) == -1)
+    {
+        fprintf(stderr, "%s: not an open descriptor\n", port);
+        return -1;
+    }
+    fd = (int) n;
+    return fd;
+}
+
+static int fdClose()
+{
+    pairForget(fd); // Closed here - transportUnpair() must not close the number again
+    int res = close(fd);
+    fd = -1;
+    return res;
+}
+
+const Transport fdTransport = {"fd", fdOpen, fdReadv, fdWritev, fdPoll, fdClose, 0};
+
+
+////////////////////////////////////////////////
+// SHARED MEMORY RING
+////////////////////////////////////////////////
+// Single producer, single consumer: the positions only grow (wrapping at 2^32) and each
+// has one writer, so moving bytes takes no lock - just an acquire/release pair. A side
+// that has to wait sleeps on the futex of the other side's position, and the other side
+// only makes the wake up system call when the waiting flag says someone is asleep.
+#define CACHE_LINE 64
+
+struct MemRing
+{
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail; // Bytes written (producer)
+    _Atomic uint32_t readerWaiting;
+    _Alignas(CACHE_LINE) _Atomic uint32_t head; // Bytes read (consumer)
+    _Atomic uint32_t writerWaiting;
+    _Alignas(CACHE_LINE) unsigned char data[MEM_RING_SIZE];
+};
+
+// Pairs made by transportPair(), until transportUnpair()
+typedef struct
+{
+    int used;
+    int fds[2];            // Descriptors this process holds (-1 = none)
+    struct MemRing *rings; // Two rings of a TpMem pair - end k writes to ring k
+} Pair;
+
+static Pair pairs[TRANSPORT_PAIRS_MAX];
+static __thread struct MemRing *memRx = NULL, *memTx = NULL;
+
+static long long monotonicUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Sleep while *addr holds val, up to timeoutUs (-1 = no limit)
+// Shared (not FUTEX_PRIVATE) - the rings outlive fork()
+static void futexWait(_Atomic uint32_t *addr, uint32_t val, long long timeoutUs)
+{
+    struct timespec ts = {.tv_sec = timeoutUs / 1000000, .tv_nsec = (timeoutUs % 1000000) * 1000};
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, (timeoutUs < 0) ? NULL : &ts, NULL, 0);
+}
+
+static void futexWake(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Wait (up to timeoutUs, -1 = no limit) for *pos to move from val, flagging the sleep in *waiting
+// Returns 0 on timeout, 1 otherwise
+static int memWait(_Atomic uint32_t *pos, uint32_t val, _Atomic uint32_t *waiting, long long timeoutUs)
+{
+    long long deadline = (timeoutUs < 0) ? -1 : monotonicUs() + timeoutUs;
+    while (atomic_load_explicit(pos, memory_order_acquire) == val)
+    {
+        long long left = (deadline < 0) ? -1 : deadline - monotonicUs();
+        if (deadline >= 0 && left <= 0)
+        {
+            return 0;
+        }
+
+        // Flag, then look again - the other side moves the position, then looks at the flag
+        atomic_store(waiting, 1);
+        if (atomic_load(pos) == val)
+        {
+            futexWait(pos, val, left);
+        }
+        atomic_store(waiting, 0);
+    }
+    return 1;
+}
+
+static int memOpen(const char *port, int baudRate)
+{
+    (void) baudRate; // Not a line - nothing to configure
+    int pair, end;
+    char extra;
+    if (sscanf(port, "mem:%d.%d%c", &pair, &end, &extra) != 2 || pair < 0 || pair >= TRANSPORT_PAIRS_MAX
+        || pairs[pair].rings == NULL || end < 0 || end > 1)
+    {
+        fprintf(stderr, "%s: no such memory ring (see transportPair())\n", port);
+        return -1;
+    }
+    memTx = &pairs[pair].rings[end];
+    memRx = &pairs[pair].rings[1 - end];
+    return 0;
+}
+
+static int memReadv(const struct iovec *iov, int iovcnt)
+{
+    uint32_t head = atomic_load_explicit(&memRx->head, memory_order_relaxed);
+    uint32_t avail = atomic_load_explicit(&memRx->tail, memory_order_acquire) - head;
+    uint32_t n = 0;
+
+    for (int i = 0; i < iovcnt && n < avail; i++)
+    {
+        uint32_t len = iov[i].iov_len;
+        if (len > avail - n)
+        {
+            len = avail - n;
+        }
+
+        // At most two pieces - up to the end of the ring, then from its start
+        uint32_t at = (head + n) & (MEM_RING_SIZE - 1);
+        uint32_t first = (len < MEM_RING_SIZE - at) ? len : MEM_RING_SIZE - at;
+        memcpy(iov[i].iov_base, memRx->data + at, first);
+        memcpy((unsigned char *) iov[i].iov_base + first, memRx->data, len - first);
+        n += len;
+    }
+
+    atomic_store(&memRx->head, head + n);
+    if (n > 0 && atomic_load(&memRx->writerWaiting))
+    {
+        futexWake(&memRx->head);
+    }
+    return n;
+}
+
+static int memWritev(const struct iovec *iov, int iovcnt)
+{
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const unsigned char *bytes = iov[i].iov_base;
+        uint32_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            uint32_t tail = atomic_load_explicit(&memTx->tail, memory_order_relaxed);
+            uint32_t head = atomic_load_explicit(&memTx->head, memory_order_acquire);
+            uint32_t room = MEM_RING_SIZE - (tail - head);
+            if (room == 0)
+            {
+                // Full - blocks like write() on a serial port
+                memWait(&memTx->head, head, &memTx->writerWaiting, -1);
+                continue;
+            }
+
+            uint32_t len = (left < room) ? left : room;
+            uint32_t at = tail & (MEM_RING_SIZE - 1);
+            uint32_t first = (len < MEM_RING_SIZE - at) ? len : MEM_RING_SIZE - at;
+            memcpy(memTx->data + at, bytes, first);
+            memcpy(memTx->data, bytes + first, len - first);
+
+            atomic_store(&memTx->tail, tail + len);
+            if (atomic_load(&memTx->readerWaiting))
+            {
+                futexWake(&memTx->tail);
+            }
+            bytes += len;
+            left -= len;
+            total += len;
+        }
+    }
+    return total;
+}
+
+static int memPoll(long long timeoutUs)
+{
+    uint32_t head = atomic_load_explicit(&memRx->head, memory_order_relaxed);
+    return memWait(&memRx->tail, head, &memRx->readerWaiting, timeoutUs);
+}
+
+static int memClose()
+{
+    memRx = memTx = NULL;
+    return 0;
+}
+
+const Transport memTransport = {"mem", memOpen, memReadv, memWritev, memPoll, memClose, 0};
+
+
+////////////////////////////////////////////////
+// PORT NAMES
+////////////////////////////////////////////////
+const Transport *transportFor(const char *port)
+{
+    if (strncmp(port, "fd:", strlen("fd:")) == 0)
+    {
+        return &fdTransport;
+    }
+    if (strncmp(port, "mem:", strlen("mem:")) == 0)
+    {
+        return &memTransport;
+    }
+    if (strncmp(port, "pty:", strlen("pty:")) == 0)
+    {
+        return &ptyTransport;
+    }
+    return &termiosTransport;
+}
+
+int transportPair(TransportKind kind, char *port0, char *port1, int portSize)
+{
+    int pair = 0;
+    while (pair < TRANSPORT_PAIRS_MAX && pairs[pair].used)
+    {
+        pair++;
+    }
+    if (pair == TRANSPORT_PAIRS_MAX)
+    {
+        fprintf(stderr, "Too many transport pairs\n");
+        return -1;
+    }
+    Pair *p = &pairs[pair];
+    p->fds[0] = p->fds[1] = -1;
+    p->rings = NULL;
+
+    char slave[64];
+    switch (kind)
+    {
+    case TpPty:
+        if (openpty(&p->fds[0], &p->fds[1], slave, NULL, NULL) == -1)
+        {
+            perror("openpty");
+            return -1;
+        }
+        // The slave end goes through termios like a serial port (unpaced) - only its name is
+        // needed, but the descriptor stays open: with no slave open, reads of the master fail (EIO)
+        snprintf(port0, portSize, "pty:%s", slave);
+        snprintf(port1, portSize, "fd:%d", p->fds[0]);
+        break;
+
+    case TpSocketpair:
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, p->fds) == -1)
+        {
+            perror("socketpair");
+            return -1;
+        }
+        snprintf(port0, portSize, "fd:%d", p->fds[0]);
+        snprintf(port1, portSize, "fd:%d", p->fds[1]);
+        break;
+
+    case TpMem:
+        p->rings = mmap(NULL, 2 * sizeof(struct MemRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p->rings == MAP_FAILED)
+        {
+            perror("mmap");
+            p->rings = NULL;
+            return -1;
+        }
+        // Zeroed - both rings empty
+        snprintf(port0, portSize, "mem:%d.0", pair);
+        snprintf(port1, portSize, "mem:%d.1", pair);
+        break;
+
+    default:
+        return -1;
+    }
+
+    p->used = 1;
+    return pair;
+}
+
+// A descriptor of a pair was closed by its transport (fdClose()) - the pair no longer holds it
+static void pairForget(int pairFd)
+{
+    for (int pair = 0; pair < TRANSPORT_PAIRS_MAX; pair++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (pairs[pair].used && pairs[pair].fds[i] == pairFd)
+            {
+                pairs[pair].fds[i] = -1;
+            }
+        }
+    }
+}
+
+void transportUnpair(int pair)
+{
+    Pair *p = &pairs[pair];
+    for (int i = 0; i < 2; i++)
+    {
+        if (p->fds[i] != -1)
+        {
+            close(p->fds[i]);
+        }
+    }
+    if (p->rings != NULL)
+    {
+        munmap(p->rings, 2 * sizeof(struct MemRing));
+    }
+    p->used = 0;
+}
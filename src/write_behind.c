@@ -0,0 +1,194 @@
+// Write-behind file output implementation
+
+#include "write_behind.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "link_layer.h" // TRUE/FALSE
+
+
+// Ring of buffers: the receiver fills bufs[filled % WB_BUF_COUNT], the writer thread
+// writes out bufs[written % WB_BUF_COUNT] - at most WB_BUF_COUNT full ones in between
+static unsigned char *bufs[WB_BUF_COUNT];
+static int bufLen[WB_BUF_COUNT];
+static unsigned int filled = 0;  // Buffers handed to the writer
+static unsigned int written = 0; // Buffers it wrote out
+static int curLen = 0;           // Bytes in the buffer being filled
+
+static int fd = -1;
+static WbDurableFn onDurable = NULL;
+static long long durable = 0; // Bytes of the file synced to disk (writer thread only)
+static int closing = FALSE; // No more buffers coming
+static int failed = FALSE;  // A write failed (both are under lock)
+static int seenFailed = FALSE; // Receiver's copy of failed
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t haveFull = PTHREAD_COND_INITIALIZER;  // Signalled by the receiver
+static pthread_cond_t haveEmpty = PTHREAD_COND_INITIALIZER; // Signalled by the writer
+
+
+static void *writerThread(void *arg)
+{
+  pthread_mutex_lock(&lock);
+  while (TRUE) {
+    while (written == filled && !closing) {
+      pthread_cond_wait(&haveFull, &lock);
+    }
+    if (written == filled) { // Closing and nothing left
+      break;
+    }
+
+    // The buffer is the writer's until written is incremented (after a failure it is only discarded)
+    int slot = written % WB_BUF_COUNT;
+    int ok = !failed;
+    pthread_mutex_unlock(&lock);
+
+    const unsigned char *p = bufs[slot];
+    int left = bufLen[slot];
+    while (ok && left > 0) {
+      ssize_t n = write(fd, p, left);
+      if (n < 0) {
+        perror("write");
+        ok = FALSE;
+        break;
+      }
+      p += n;
+      left -= n;
+    }
+    if (ok && onDurable != NULL) {
+      if (fdatasync(fd) == -1) {
+        perror("fdatasync");
+        ok = FALSE;
+      }
+      else {
+        durable += bufLen[slot];
+        onDurable(durable);
+      }
+    }
+
+    pthread_mutex_lock(&lock);
+    failed |= !ok;
+    written++;
+    pthread_cond_signal(&haveEmpty);
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+
+int wbOpen(const char *filename, long long offset, WbDurableFn durableFn)
+{
+  fd = open(filename, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(filename);
+    return -1;
+  }
+  if (ftruncate(fd, offset) == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+    perror(filename);
+    close(fd);
+    return -1;
+  }
+
+  for (int i = 0; i < WB_BUF_COUNT; i++) {
+    if (bufs[i] == NULL && posix_memalign((void **)&bufs[i], WB_ALIGN, WB_BUF_SIZE) != 0) {
+      bufs[i] = NULL;
+      printf("%s: Out of memory\n", __func__);
+      close(fd);
+      return -1;
+    }
+  }
+
+  filled = written = 0;
+  curLen = 0;
+  onDurable = durableFn;
+  durable = offset;
+  closing = failed = seenFailed = FALSE;
+
+  if (pthread_create(&writer, NULL, writerThread, NULL) != 0) {
+    printf("%s: Failed to start the writer thread\n", __func__);
+    close(fd);
+    return -1;
+  }
+  return 1;
+}
+
+
+// Hand the buffer being filled to the writer and wait for the next one to be free
+static void queueBuffer()
+{
+  pthread_mutex_lock(&lock);
+  bufLen[filled % WB_BUF_COUNT] = curLen;
+  filled++;
+  pthread_cond_signal(&haveFull);
+  while (filled - written == WB_BUF_COUNT) {
+    pthread_cond_wait(&haveEmpty, &lock);
+  }
+  seenFailed = failed;
+  pthread_mutex_unlock(&lock);
+  curLen = 0;
+}
+
+
+int wbWrite(const unsigned char *data, int len)
+{
+  int left = len;
+
+  if (seenFailed) {
+    return -1;
+  }
+
+  while (left > 0) {
+    int n = WB_BUF_SIZE - curLen;
+    if (n > left) {
+      n = left;
+    }
+    memcpy(bufs[filled % WB_BUF_COUNT] + curLen, data, n);
+    curLen += n;
+    data += n;
+    left -= n;
+
+    if (curLen == WB_BUF_SIZE) {
+      queueBuffer();
+    }
+  }
+
+  return len;
+}
+
+
+void wbFlush()
+{
+  if (curLen > 0) {
+    queueBuffer();
+  }
+}
+
+
+int wbClose()
+{
+  if (curLen > 0) {
+    queueBuffer();
+  }
+
+  pthread_mutex_lock(&lock);
+  closing = TRUE;
+  pthread_cond_signal(&haveFull);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+
+  // Only this thread is left
+  if (close(fd) == -1) {
+    perror("close");
+    failed = TRUE;
+  }
+  fd = -1;
+
+  return failed ? -1 : 1;
+}